@@ -60,6 +60,39 @@ static int lfs2_toerror(int err)
     }
 }
 
+// our extra open flags, random access and a 4-bit cache size, sit above
+// any open flags libc defines, newlib's end at _FPATH (0x2000000)
+#define LFS2_CACHE_FLAGS_SHIFT 27
+#define LFS2_CACHE_FLAGS_MASK  (0xf << LFS2_CACHE_FLAGS_SHIFT)
+
+static const int lfs2_libcflags = O_RDONLY | O_WRONLY | O_RDWR
+                                  | O_CREAT | O_EXCL | O_TRUNC | O_APPEND
+#ifdef O_NONBLOCK
+                                  | O_NONBLOCK
+#endif
+#ifdef O_BINARY
+                                  | O_BINARY
+#endif
+#ifdef O_SYNC
+                                  | O_SYNC
+#endif
+#ifdef O_NOCTTY
+                                  | O_NOCTTY
+#endif
+#ifdef O_NOFOLLOW
+                                  | O_NOFOLLOW
+#endif
+#ifdef O_DIRECTORY
+                                  | O_DIRECTORY
+#endif
+#ifdef O_CLOEXEC
+                                  | O_CLOEXEC
+#endif
+                                  ;
+static_assert(!(lfs2_libcflags & (LittleFileSystem2::O_RANDOM_ACCESS
+                                  | LFS2_CACHE_FLAGS_MASK)),
+              "LittleFileSystem2 open flags overlap libc's open flags");
+
 static int lfs2_fromflags(int flags)
 {
     return (
@@ -69,7 +102,9 @@ static int lfs2_fromflags(int flags)
                ((flags & O_CREAT)  ? LFS2_O_CREAT  : 0) |
                ((flags & O_EXCL)   ? LFS2_O_EXCL   : 0) |
                ((flags & O_TRUNC)  ? LFS2_O_TRUNC  : 0) |
-               ((flags & O_APPEND) ? LFS2_O_APPEND : 0));
+               ((flags & O_APPEND) ? LFS2_O_APPEND : 0) |
+               ((flags & LittleFileSystem2::O_RANDOM_ACCESS)
+                    ? LFS2_O_RANDOM : 0));
 }
 
 static int lfs2_fromwhence(int whence)
@@ -111,6 +146,42 @@ static int lfs2_totype(int type)
     }
 }
 
+static lfs2_size_t lfs2_toinlinemax(lfs2_size_t block_size)
+{
+    if (MBED_LFS2_INLINE_MAX < 0) {
+        return (lfs2_size_t) -1;
+    }
+
+    // clamp to what the block size can hold
+    return lfs2_min((lfs2_size_t)MBED_LFS2_INLINE_MAX,
+                    lfs2_min((lfs2_size_t)LFS2_ATTR_MAX, block_size / 4));
+}
+
+
+static lfs2_size_t lfs2_towearregions(lfs2_size_t block_size,
+                                      lfs2_size_t block_count)
+{
+    // clamp to what the superblock can hold
+    return lfs2_min((lfs2_size_t)MBED_LFS2_WEAR_REGIONS,
+                    lfs2_min((lfs2_size_t)255,
+                             lfs2_min(block_size / 32, block_count)));
+}
+
+#if MBED_LFS2_CONCURRENT_READS
+static bool lfs2_isconcurrent(const lfs2_t *lfs2, const lfs2_file_t *file,
+                              size_t len)
+{
+    // reads of clean, non-inline files that stay in the block they are
+    // already reading only touch the handle's position and cache, they
+    // don't look anything up or change the handle's flags, which other
+    // operations read while traversing open files
+    return !(file->flags & (LFS2_F_DIRTY | LFS2_F_WRITING | LFS2_F_INLINE))
+           && (file->flags & LFS2_F_READING)
+           && file->off < lfs2->cfg->block_size
+           && len <= lfs2->cfg->block_size - file->off;
+}
+#endif
+
 
 ////// Block device operations //////
 static int lfs2_bd_read(const struct lfs2_config *c, lfs2_block_t block,
@@ -147,8 +218,27 @@ LittleFileSystem2::LittleFileSystem2(const char *name, BlockDevice *bd,
                                    lfs2_size_t block_size, uint32_t block_cycles,
                                    lfs2_size_t cache_size, lfs2_size_t lookahead_size)
     : FileSystem(name)
+#if MBED_LFS2_WRITE_BEHIND_SIZE > 0
+    , _wb_cond(_wb_mutex)
+#endif
 {
     memset(&_config, 0, sizeof(_config));
+    _usage_valid = false;
+#if MBED_LFS2_ENABLE_STATS
+    memset(&_stats, 0, sizeof(_stats));
+    _config.stats = &_stats;
+#endif
+#if MBED_LFS2_WRITE_BEHIND_SIZE > 0
+    _wb_thread = NULL;
+    _wb_tail = 0;
+    _wb_used = 0;
+#endif
+#if MBED_LFS2_FILE_POOL_SIZE > 0
+    memset(_files_used, 0, sizeof(_files_used));
+#endif
+#if MBED_LFS2_DIR_POOL_SIZE > 0
+    memset(_dirs_used, 0, sizeof(_dirs_used));
+#endif
     _config.block_size = block_size;
     _config.block_cycles = block_cycles;
     _config.cache_size = cache_size;
@@ -176,10 +266,7 @@ int LittleFileSystem2::mount(BlockDevice *bd)
     }
 
     _config.context         = bd;
-    _config.read            = lfs2_bd_read;
-    _config.prog            = lfs2_bd_prog;
-    _config.erase           = lfs2_bd_erase;
-    _config.sync            = lfs2_bd_sync;
+    bd_bind(&_config);
     _config.read_size       = bd->get_read_size();
     _config.prog_size       = bd->get_program_size();
     _config.block_size      = lfs2_max(_config.block_size, (lfs2_size_t)bd->get_erase_size());
@@ -187,6 +274,12 @@ int LittleFileSystem2::mount(BlockDevice *bd)
     _config.block_cycles    = _config.block_cycles;
     _config.cache_size      = lfs2_max(_config.cache_size, _config.prog_size);
     _config.lookahead_size  = lfs2_min(_config.lookahead_size, 8 * ((_config.block_count + 63) / 64));
+    _config.inline_max      = lfs2_toinlinemax(_config.block_size);
+    _config.wear_regions    = lfs2_towearregions(_config.block_size, _config.block_count);
+    _config.wear_threshold  = MBED_LFS2_WEAR_THRESHOLD;
+#if MBED_LFS2_ENABLE_STATS
+    memset(&_stats, 0, sizeof(_stats));
+#endif
 
     err = lfs2_mount(&_lfs, &_config);
     if (err) {
@@ -195,12 +288,25 @@ int LittleFileSystem2::mount(BlockDevice *bd)
         return lfs2_toerror(err);
     }
 
+    // counted lazily on the first statvfs
+    _usage_valid = false;
+    wb_start();
     _mutex.unlock();
     return 0;
 }
 
+void LittleFileSystem2::bd_bind(struct lfs2_config *config)
+{
+    config->read  = lfs2_bd_read;
+    config->prog  = lfs2_bd_prog;
+    config->erase = lfs2_bd_erase;
+    config->sync  = lfs2_bd_sync;
+}
+
 int LittleFileSystem2::unmount()
 {
+    // programs anything still queued
+    wb_stop();
     _mutex.lock();
     int res = 0;
     if (_bd) {
@@ -246,6 +352,9 @@ int LittleFileSystem2::format(BlockDevice *bd,
     _config.block_cycles    = block_cycles;
     _config.cache_size      = lfs2_max(cache_size, _config.prog_size);
     _config.lookahead_size  = lfs2_min(lookahead_size, 8 * ((_config.block_count + 63) / 64));
+    _config.inline_max      = lfs2_toinlinemax(_config.block_size);
+    _config.wear_regions    = lfs2_towearregions(_config.block_size, _config.block_count);
+    _config.wear_threshold  = MBED_LFS2_WEAR_THRESHOLD;
 
     err = lfs2_format(&_lfs, &_config);
     if (err) {
@@ -262,6 +371,8 @@ int LittleFileSystem2::format(BlockDevice *bd,
 
 int LittleFileSystem2::reformat(BlockDevice *bd)
 {
+    // unmount is called with our lock held, stop writing behind first
+    wb_stop();
     _mutex.lock();
     if (_bd) {
         if (!bd) {
@@ -302,22 +413,29 @@ int LittleFileSystem2::reformat(BlockDevice *bd)
 
 int LittleFileSystem2::remove(const char *filename)
 {
+    wb_drain(NULL);
     _mutex.lock();
     int err = lfs2_remove(&_lfs, filename);
+    // frees blocks, count again on the next statvfs
+    _usage_valid = false;
     _mutex.unlock();
     return lfs2_toerror(err);
 }
 
 int LittleFileSystem2::rename(const char *oldname, const char *newname)
 {
+    wb_drain(NULL);
     _mutex.lock();
     int err = lfs2_rename(&_lfs, oldname, newname);
+    // may free the blocks of a file renamed over
+    _usage_valid = false;
     _mutex.unlock();
     return lfs2_toerror(err);
 }
 
 int LittleFileSystem2::mkdir(const char *name, mode_t mode)
 {
+    wb_drain(NULL);
     _mutex.lock();
     int err = lfs2_mkdir(&_lfs, name);
     _mutex.unlock();
@@ -327,6 +445,7 @@ int LittleFileSystem2::mkdir(const char *name, mode_t mode)
 int LittleFileSystem2::stat(const char *name, struct stat *st)
 {
     struct lfs2_info info;
+    wb_drain(NULL);
     _mutex.lock();
     int err = lfs2_stat(&_lfs, name, &info);
     _mutex.unlock();
@@ -335,111 +454,571 @@ int LittleFileSystem2::stat(const char *name, struct stat *st)
     return lfs2_toerror(err);
 }
 
-int LittleFileSystem2::statvfs(const char *name, struct statvfs *st)
+int LittleFileSystem2::usage_refresh()
 {
-    memset(st, 0, sizeof(struct statvfs));
-
-    lfs2_ssize_t in_use = 0;
-    _mutex.lock();
-    in_use = lfs2_fs_size(&_lfs);
-    _mutex.unlock();
+    // called with _mutex held
+    lfs2_ssize_t in_use = lfs2_fs_size(&_lfs);
     if (in_use < 0) {
-        return in_use;
+        return lfs2_toerror(in_use);
     }
 
+    _usage = in_use;
+    _usage_allocs = _lfs.allocs;
+    _usage_valid = true;
+    return 0;
+}
+
+void LittleFileSystem2::usage_fill(struct statvfs *st, uint32_t in_use)
+{
+    memset(st, 0, sizeof(struct statvfs));
     st->f_bsize  = _config.block_size;
     st->f_frsize = _config.block_size;
     st->f_blocks = _config.block_count;
     st->f_bfree  = _config.block_count - in_use;
     st->f_bavail = _config.block_count - in_use;
     st->f_namemax = LFS2_NAME_MAX;
+}
+
+int LittleFileSystem2::statvfs(const char *name, struct statvfs *st)
+{
+    _mutex.lock();
+    // every allocation since the last traversal is assumed still in use,
+    // so the estimate only errs towards less free space. Once that runs out
+    // count again, but at most every eighth of the disk's allocations so a
+    // nearly full disk doesn't traverse on every call
+    uint32_t allocs = _lfs.allocs - _usage_allocs;
+    if (!_usage_valid || (_usage + allocs >= _config.block_count &&
+                          allocs >= _config.block_count / 8)) {
+        int err = usage_refresh();
+        if (err) {
+            _mutex.unlock();
+            return err;
+        }
+        allocs = 0;
+    }
+
+    usage_fill(st, lfs2_min(_usage + allocs, _config.block_count));
+    _mutex.unlock();
+    return 0;
+}
+
+int LittleFileSystem2::statvfs_exact(const char *name, struct statvfs *st)
+{
+    wb_drain(NULL);
+    _mutex.lock();
+    int err = usage_refresh();
+    if (!err) {
+        usage_fill(st, _usage);
+    }
+    _mutex.unlock();
+    return err;
+}
+
+ssize_t LittleFileSystem2::dir_list(const char *path, off_t *pos,
+                                    struct dirent *ents, struct stat *sts,
+                                    size_t count,
+                                    const struct lfs2_attr *attrs,
+                                    size_t attr_count)
+{
+    if (attr_count > MBED_LFS2_DIR_LIST_ATTRS) {
+        return -EINVAL;
+    }
+
+    lfs2_dir_t dir;
+    wb_drain(NULL);
+    _mutex.lock();
+    int err = lfs2_dir_open(&_lfs, &dir, path);
+    if (err) {
+        _mutex.unlock();
+        return lfs2_toerror(err);
+    }
+
+    if (*pos) {
+        err = lfs2_dir_seek(&_lfs, &dir, *pos);
+        if (err) {
+            lfs2_dir_close(&_lfs, &dir);
+            _mutex.unlock();
+            return lfs2_toerror(err);
+        }
+    }
+
+    // read a batch of entries at a time, each batch reads each metadata
+    // pair once, with attributes pointed at the batch's slots
+    struct lfs2_info infos[MBED_LFS2_DIR_LIST_BATCH];
+    struct lfs2_attr battrs[MBED_LFS2_DIR_LIST_ATTRS];
+    size_t i = 0;
+    while (i < count) {
+        for (size_t j = 0; j < attr_count; j++) {
+            battrs[j] = attrs[j];
+            battrs[j].buffer = (uint8_t *)attrs[j].buffer + i * attrs[j].size;
+        }
+
+        lfs2_size_t n = lfs2_min(count - i, MBED_LFS2_DIR_LIST_BATCH);
+        lfs2_ssize_t res = lfs2_dir_readbatch(&_lfs, &dir, infos, n,
+                                              battrs, attr_count);
+        if (res <= 0) {
+            err = res;
+            break;
+        }
+
+        for (lfs2_ssize_t j = 0; j < res; j++, i++) {
+            ents[i].d_type = lfs2_totype(infos[j].type);
+            strcpy(ents[i].d_name, infos[j].name);
+            if (sts) {
+                memset(&sts[i], 0, sizeof(sts[i]));
+                sts[i].st_size = infos[j].size;
+                sts[i].st_mode = lfs2_tomode(infos[j].type);
+            }
+        }
+    }
+
+    *pos = lfs2_dir_tell(&_lfs, &dir);
+    lfs2_dir_close(&_lfs, &dir);
+    _mutex.unlock();
+    return err ? lfs2_toerror(err) : (ssize_t)i;
+}
+
+int LittleFileSystem2::get_stats(struct lfs2_stats *stats, bool reset)
+{
+#if MBED_LFS2_ENABLE_STATS
+    _mutex.lock();
+    if (stats) {
+        *stats = _stats;
+    }
+    if (reset) {
+        memset(&_stats, 0, sizeof(_stats));
+    }
+    _mutex.unlock();
+    return 0;
+#else
+    (void)stats;
+    (void)reset;
+    return -ENOTSUP;
+#endif
+}
+
+int LittleFileSystem2::wear_level()
+{
+    _mutex.lock();
+    int err = lfs2_fs_wearlevel(&_lfs);
+    _mutex.unlock();
+    return lfs2_toerror(err);
+}
+
+int LittleFileSystem2::get_wear(struct lfs2_wear *wear)
+{
+    _mutex.lock();
+    int err = lfs2_fs_wear(&_lfs, wear);
+    _mutex.unlock();
+    return lfs2_toerror(err);
+}
+
+////// Handle allocation //////
+LittleFileSystem2::lfs2_handle *LittleFileSystem2::file_alloc(
+    lfs2_size_t cache_size)
+{
+#if MBED_LFS2_FILE_POOL_SIZE > 0
+    for (int i = 0; i < MBED_LFS2_FILE_POOL_SIZE; i++) {
+        if (!_files_used[i]) {
+            _files_used[i] = true;
+            lfs2_handle *h = &_files[i];
+            memset(&h->cfg, 0, sizeof(h->cfg));
+            h->cfg.cache_size = cache_size;
+#if MBED_LFS2_WRITE_BEHIND_SIZE > 0
+            h->wb_pending = 0;
+            h->wb_err = 0;
+#endif
+            h->cfg.buffer = _file_buffers[i];
+            return h;
+        }
+    }
+
+    return NULL;
+#else
+    lfs2_handle *h = new lfs2_handle;
+    memset(&h->cfg, 0, sizeof(h->cfg));
+    h->cfg.cache_size = cache_size;
+#if MBED_LFS2_WRITE_BEHIND_SIZE > 0
+    h->wb_pending = 0;
+    h->wb_err = 0;
+#endif
+    return h;
+#endif
+}
+
+void LittleFileSystem2::file_free(lfs2_handle *h)
+{
+#if MBED_LFS2_FILE_POOL_SIZE > 0
+    _files_used[h - _files] = false;
+#else
+    delete h;
+#endif
+}
+
+lfs2_dir_t *LittleFileSystem2::dir_alloc()
+{
+#if MBED_LFS2_DIR_POOL_SIZE > 0
+    for (int i = 0; i < MBED_LFS2_DIR_POOL_SIZE; i++) {
+        if (!_dirs_used[i]) {
+            _dirs_used[i] = true;
+            return &_dirs[i];
+        }
+    }
+
+    return NULL;
+#else
+    return new lfs2_dir_t;
+#endif
+}
+
+void LittleFileSystem2::dir_free(lfs2_dir_t *d)
+{
+#if MBED_LFS2_DIR_POOL_SIZE > 0
+    _dirs_used[d - _dirs] = false;
+#else
+    delete d;
+#endif
+}
+
+
+////// Write-behind //////
+void LittleFileSystem2::wb_start()
+{
+#if MBED_LFS2_WRITE_BEHIND_SIZE > 0
+    _wb_stop = false;
+    _wb_thread = new rtos::Thread();
+    osStatus status = _wb_thread->start(
+                          mbed::callback(this, &LittleFileSystem2::wb_run));
+    if (status != osOK) {
+        // no thread, fall back to writing synchronously
+        delete _wb_thread;
+        _wb_thread = NULL;
+    }
+#endif
+}
+
+void LittleFileSystem2::wb_stop()
+{
+#if MBED_LFS2_WRITE_BEHIND_SIZE > 0
+    if (!_wb_thread) {
+        return;
+    }
+
+    // the flush thread empties the queue before exiting
+    _wb_mutex.lock();
+    _wb_stop = true;
+    _wb_cond.notify_all();
+    _wb_mutex.unlock();
+
+    _wb_thread->join();
+    delete _wb_thread;
+    _wb_thread = NULL;
+#endif
+}
+
+void LittleFileSystem2::wb_drain(lfs2_handle *h)
+{
+#if MBED_LFS2_WRITE_BEHIND_SIZE > 0
+    // wait for one file's queued writes, or everything if h is NULL
+    _wb_mutex.lock();
+    while (h ? h->wb_pending > 0 : _wb_used > 0) {
+        _wb_cond.wait();
+    }
+    _wb_mutex.unlock();
+#else
+    (void)h;
+#endif
+}
+
+int LittleFileSystem2::wb_error(lfs2_handle *h)
+{
+#if MBED_LFS2_WRITE_BEHIND_SIZE > 0
+    _wb_mutex.lock();
+    int err = h->wb_err;
+    h->wb_err = 0;
+    _wb_mutex.unlock();
+    return lfs2_toerror(err);
+#else
+    (void)h;
     return 0;
+#endif
+}
+
+#if MBED_LFS2_WRITE_BEHIND_SIZE > 0
+void LittleFileSystem2::wb_copyin(const void *buffer, lfs2_size_t size)
+{
+    lfs2_size_t off = (_wb_tail + _wb_used) % MBED_LFS2_WRITE_BEHIND_SIZE;
+    lfs2_size_t n = lfs2_min(size, MBED_LFS2_WRITE_BEHIND_SIZE - off);
+    memcpy(&_wb_buffer[off], buffer, n);
+    memcpy(_wb_buffer, (const uint8_t *)buffer + n, size - n);
+    _wb_used += size;
+}
+
+void LittleFileSystem2::wb_copyout(lfs2_size_t off, void *buffer,
+                                   lfs2_size_t size)
+{
+    off = (_wb_tail + off) % MBED_LFS2_WRITE_BEHIND_SIZE;
+    lfs2_size_t n = lfs2_min(size, MBED_LFS2_WRITE_BEHIND_SIZE - off);
+    memcpy(buffer, &_wb_buffer[off], n);
+    memcpy((uint8_t *)buffer + n, _wb_buffer, size - n);
 }
 
+ssize_t LittleFileSystem2::wb_write(lfs2_handle *h,
+                                    const void *buffer, size_t len)
+{
+    const uint8_t *data = (const uint8_t *)buffer;
+    size_t left = len;
+
+    _wb_mutex.lock();
+    while (true) {
+        // report errors from earlier writes instead of queueing more
+        if (h->wb_err) {
+            int err = h->wb_err;
+            h->wb_err = 0;
+            _wb_mutex.unlock();
+            return lfs2_toerror(err);
+        }
+
+        if (left == 0) {
+            break;
+        }
+
+        // wait for room for a header and at least a byte of data
+        if (_wb_used + sizeof(struct wb_entry) >= MBED_LFS2_WRITE_BEHIND_SIZE) {
+            _wb_cond.wait();
+            continue;
+        }
+
+        struct wb_entry e;
+        e.h = h;
+        e.size = lfs2_min(left, MBED_LFS2_WRITE_BEHIND_SIZE
+                          - _wb_used - sizeof(struct wb_entry));
+        wb_copyin(&e, sizeof(e));
+        wb_copyin(data, e.size);
+        h->wb_pending += e.size;
+        data += e.size;
+        left -= e.size;
+        _wb_cond.notify_all();
+    }
+    _wb_mutex.unlock();
+
+    return len;
+}
+
+void LittleFileSystem2::wb_run()
+{
+    _wb_mutex.lock();
+    while (true) {
+        while (_wb_used == 0 && !_wb_stop) {
+            _wb_cond.wait();
+        }
+
+        if (_wb_used == 0) {
+            break;
+        }
+
+        struct wb_entry e;
+        wb_copyout(0, &e, sizeof(e));
+        lfs2_size_t off = (_wb_tail + sizeof(e)) % MBED_LFS2_WRITE_BEHIND_SIZE;
+        // once a write fails, the file's later data has nowhere sane to go
+        bool skip = (e.h->wb_err != 0);
+        _wb_mutex.unlock();
+
+        // the entry stays queued, and its data untouched, until we
+        // release it below
+        lfs2_ssize_t res = 0;
+        if (!skip) {
+            lfs2_size_t n = lfs2_min(e.size, MBED_LFS2_WRITE_BEHIND_SIZE - off);
+            _mutex.lock();
+            e.h->mutex.lock();
+            res = lfs2_file_write(&_lfs, &e.h->file, &_wb_buffer[off], n);
+            if (res >= 0 && n < e.size) {
+                res = lfs2_file_write(&_lfs, &e.h->file,
+                                      _wb_buffer, e.size - n);
+            }
+            e.h->mutex.unlock();
+            _mutex.unlock();
+        }
+
+        _wb_mutex.lock();
+        if (res < 0 && !e.h->wb_err) {
+            e.h->wb_err = res;
+        }
+        _wb_tail = (_wb_tail + sizeof(e) + e.size)
+                   % MBED_LFS2_WRITE_BEHIND_SIZE;
+        _wb_used -= sizeof(e) + e.size;
+        e.h->wb_pending -= e.size;
+        _wb_cond.notify_all();
+    }
+    _wb_mutex.unlock();
+}
+#endif
+
+
 ////// File operations //////
+int LittleFileSystem2::cache_flags(lfs2_size_t size)
+{
+    // stored as log2(size)-2 so 0 still means the filesystem's cache size
+    lfs2_size_t log2 = lfs2_min(lfs2_max(lfs2_npw2(size), (uint32_t)3), (uint32_t)17);
+    return (int)((log2 - 2) << LFS2_CACHE_FLAGS_SHIFT);
+}
+
 int LittleFileSystem2::file_open(fs_file_t *file, const char *path, int flags)
 {
-    lfs2_file_t *f = new lfs2_file_t;
+    // per-file cache size from cache_flags, 0 uses the filesystem's
+    lfs2_size_t cache_size = 0;
+    if (flags & LFS2_CACHE_FLAGS_MASK) {
+        cache_size = (lfs2_size_t)1 << (((flags & LFS2_CACHE_FLAGS_MASK)
+                                         >> LFS2_CACHE_FLAGS_SHIFT) + 2);
+        cache_size = lfs2_max(cache_size, _config.read_size);
+        cache_size = lfs2_max(cache_size, _config.prog_size);
+    }
+
+    wb_drain(NULL);
     _mutex.lock();
-    int err = lfs2_file_open(&_lfs, f, path, lfs2_fromflags(flags));
-    _mutex.unlock();
+#if MBED_LFS2_FILE_POOL_SIZE > 0
+    // pooled handles only have room for caches up to their buffer size
+    if (lfs2_max(cache_size ? cache_size : _config.cache_size,
+                 _lfs.inline_max) > MBED_LFS2_FILE_BUFFER_SIZE) {
+        _mutex.unlock();
+        return -EINVAL;
+    }
+#endif
+
+    lfs2_handle *h = file_alloc(cache_size);
+    if (!h) {
+        _mutex.unlock();
+        return -ENFILE;
+    }
+
+    int err = lfs2_file_opencfg(&_lfs, &h->file, path,
+                                lfs2_fromflags(flags), &h->cfg);
     if (!err) {
-        *file = f;
+        *file = h;
     } else {
-        delete f;
+        file_free(h);
     }
+    _mutex.unlock();
     return lfs2_toerror(err);
 }
 
 int LittleFileSystem2::file_close(fs_file_t file)
 {
-    lfs2_file_t *f = (lfs2_file_t *)file;
+    lfs2_handle *h = (lfs2_handle *)file;
+    wb_drain(h);
     _mutex.lock();
-    int err = lfs2_file_close(&_lfs, f);
+    h->mutex.lock();
+    int err = lfs2_file_close(&_lfs, &h->file);
+    h->mutex.unlock();
+    int wb_err = wb_error(h);
+    if (wb_err) {
+        err = wb_err;
+    }
+    file_free(h);
     _mutex.unlock();
-    delete f;
     return lfs2_toerror(err);
 }
 
 ssize_t LittleFileSystem2::file_read(fs_file_t file, void *buffer, size_t len)
 {
-    lfs2_file_t *f = (lfs2_file_t *)file;
+    lfs2_handle *h = (lfs2_handle *)file;
+    wb_drain(h);
+#if MBED_LFS2_CONCURRENT_READS
+    h->mutex.lock();
+    if (lfs2_isconcurrent(&_lfs, &h->file, len)) {
+        lfs2_ssize_t res = lfs2_file_read(&_lfs, &h->file, buffer, len);
+        h->mutex.unlock();
+        return lfs2_toerror(res);
+    }
+    h->mutex.unlock();
+#endif
+
     _mutex.lock();
-    lfs2_ssize_t res = lfs2_file_read(&_lfs, f, buffer, len);
+    h->mutex.lock();
+    lfs2_ssize_t res = lfs2_file_read(&_lfs, &h->file, buffer, len);
+    h->mutex.unlock();
     _mutex.unlock();
     return lfs2_toerror(res);
 }
 
 ssize_t LittleFileSystem2::file_write(fs_file_t file, const void *buffer, size_t len)
 {
-    lfs2_file_t *f = (lfs2_file_t *)file;
+    lfs2_handle *h = (lfs2_handle *)file;
+#if MBED_LFS2_WRITE_BEHIND_SIZE > 0
+    if (_wb_thread) {
+        return wb_write(h, buffer, len);
+    }
+#endif
+
     _mutex.lock();
-    lfs2_ssize_t res = lfs2_file_write(&_lfs, f, buffer, len);
+    h->mutex.lock();
+    lfs2_ssize_t res = lfs2_file_write(&_lfs, &h->file, buffer, len);
+    h->mutex.unlock();
     _mutex.unlock();
     return lfs2_toerror(res);
 }
 
 int LittleFileSystem2::file_sync(fs_file_t file)
 {
-    lfs2_file_t *f = (lfs2_file_t *)file;
+    lfs2_handle *h = (lfs2_handle *)file;
+    wb_drain(h);
     _mutex.lock();
-    int err = lfs2_file_sync(&_lfs, f);
+    h->mutex.lock();
+    int err = lfs2_file_sync(&_lfs, &h->file);
+    h->mutex.unlock();
     _mutex.unlock();
+    int wb_err = wb_error(h);
+    if (wb_err) {
+        return wb_err;
+    }
     return lfs2_toerror(err);
 }
 
 off_t LittleFileSystem2::file_seek(fs_file_t file, off_t offset, int whence)
 {
-    lfs2_file_t *f = (lfs2_file_t *)file;
+    lfs2_handle *h = (lfs2_handle *)file;
+    wb_drain(h);
     _mutex.lock();
-    off_t res = lfs2_file_seek(&_lfs, f, offset, lfs2_fromwhence(whence));
+    h->mutex.lock();
+    off_t res = lfs2_file_seek(&_lfs, &h->file, offset, lfs2_fromwhence(whence));
+    h->mutex.unlock();
     _mutex.unlock();
     return lfs2_toerror(res);
 }
 
 off_t LittleFileSystem2::file_tell(fs_file_t file)
 {
-    lfs2_file_t *f = (lfs2_file_t *)file;
-    _mutex.lock();
-    off_t res = lfs2_file_tell(&_lfs, f);
-    _mutex.unlock();
+    // only reads the handle's position, which operations on other handles
+    // never change
+    lfs2_handle *h = (lfs2_handle *)file;
+    wb_drain(h);
+    h->mutex.lock();
+    off_t res = lfs2_file_tell(&_lfs, &h->file);
+    h->mutex.unlock();
     return lfs2_toerror(res);
 }
 
 off_t LittleFileSystem2::file_size(fs_file_t file)
 {
-    lfs2_file_t *f = (lfs2_file_t *)file;
-    _mutex.lock();
-    off_t res = lfs2_file_size(&_lfs, f);
-    _mutex.unlock();
+    // only reads the handle's size, which operations on other handles
+    // never change
+    lfs2_handle *h = (lfs2_handle *)file;
+    wb_drain(h);
+    h->mutex.lock();
+    off_t res = lfs2_file_size(&_lfs, &h->file);
+    h->mutex.unlock();
     return lfs2_toerror(res);
 }
 
 int LittleFileSystem2::file_truncate(fs_file_t file, off_t length)
 {
-    lfs2_file_t *f = (lfs2_file_t *)file;
+    lfs2_handle *h = (lfs2_handle *)file;
+    wb_drain(h);
     _mutex.lock();
-    int err = lfs2_file_truncate(&_lfs, f, length);
+    h->mutex.lock();
+    int err = lfs2_file_truncate(&_lfs, &h->file, length);
+    h->mutex.unlock();
+    _usage_valid = false;
     _mutex.unlock();
     return lfs2_toerror(err);
 }
@@ -448,15 +1027,21 @@ int LittleFileSystem2::file_truncate(fs_file_t file, off_t length)
 ////// Dir operations //////
 int LittleFileSystem2::dir_open(fs_dir_t *dir, const char *path)
 {
-    lfs2_dir_t *d = new lfs2_dir_t;
+    wb_drain(NULL);
     _mutex.lock();
+    lfs2_dir_t *d = dir_alloc();
+    if (!d) {
+        _mutex.unlock();
+        return -ENFILE;
+    }
+
     int err = lfs2_dir_open(&_lfs, d, path);
-    _mutex.unlock();
     if (!err) {
         *dir = d;
     } else {
-        delete d;
+        dir_free(d);
     }
+    _mutex.unlock();
     return lfs2_toerror(err);
 }
 
@@ -465,8 +1050,8 @@ int LittleFileSystem2::dir_close(fs_dir_t dir)
     lfs2_dir_t *d = (lfs2_dir_t *)dir;
     _mutex.lock();
     int err = lfs2_dir_close(&_lfs, d);
+    dir_free(d);
     _mutex.unlock();
-    delete d;
     return lfs2_toerror(err);
 }
 
@@ -24,16 +24,93 @@
 #include "BlockDevice.h"
 #include "PlatformMutex.h"
 #include "lfs2.h"
+#if MBED_LFS2_WRITE_BEHIND_SIZE > 0
+#if !MBED_CONF_RTOS_PRESENT
+#error "LittleFileSystem2 write-behind needs a thread, enable the RTOS"
+#elif MBED_LFS2_WRITE_BEHIND_SIZE < 64
+#error "LittleFileSystem2 write_behind_size must be at least 64 bytes"
+#endif
+#include "rtos/Thread.h"
+#include "rtos/Mutex.h"
+#include "rtos/ConditionVariable.h"
+#endif
 
 namespace mbed {
 
+// Entries LittleFileSystem2::dir_list reads per batch, each costs a
+// struct lfs2_info on the stack
+#ifndef MBED_LFS2_DIR_LIST_BATCH
+#define MBED_LFS2_DIR_LIST_BATCH 4
+#endif
+
+// Maximum number of custom attributes LittleFileSystem2::dir_list reads
+// with each entry
+#ifndef MBED_LFS2_DIR_LIST_ATTRS
+#define MBED_LFS2_DIR_LIST_ATTRS 4
+#endif
+
+#if MBED_LFS2_FILE_POOL_SIZE > 0
+// Pooled file buffers fit the configured cache size, or inline_max if that
+// is larger. Opening a file that needs more fails with -EINVAL.
+#define MBED_LFS2_FILE_BUFFER_SIZE \
+    ((MBED_LFS2_INLINE_MAX > MBED_LFS2_CACHE_SIZE) \
+        ? MBED_LFS2_INLINE_MAX : MBED_LFS2_CACHE_SIZE)
+#endif
+
 /**
  * LittleFileSystem2, a little file system
  *
  * Synchronization level: Thread safe
+ *
+ * Operations serialize on a filesystem lock, and each open file also has
+ * its own lock. file_tell and file_size only take the file's lock, so they
+ * don't wait for operations on other files. With the concurrent_reads option, reads of clean files that
+ * are not inlined skip the filesystem lock while they stay in the block the
+ * file is already reading. These reads still update the enable_stats
+ * counters and the binary trace, which are not safe to use together with
+ * concurrent_reads.
+ *
+ * File and directory handles come from the heap, or from fixed pools sized
+ * by the file_pool_size and dir_pool_size options. Pools make open and
+ * close allocation free, and opens fail with -ENFILE when a pool is empty.
+ *
+ * With the write_behind_size option, file_write copies data into a queue
+ * of that many bytes and returns, and a flush thread programs it in the
+ * background. file_sync and file_close wait for the file's queued data and
+ * report any error it hit, so files are only durable after a sync, as
+ * without write-behind. Other calls on a file wait for its queued data
+ * first, and calls that look up paths wait for the whole queue.
  */
 class LittleFileSystem2 : public mbed::FileSystem {
 public:
+    /** Extra flags accepted when opening files on a LittleFileSystem2
+     *
+     *  These are passed along with the usual open flags, for example
+     *  file.open(&fs, "log", O_RDONLY | LittleFileSystem2::O_RANDOM_ACCESS).
+     *  Other filesystems ignore or reject them. They use bits 26-30, above
+     *  the open flags libc defines.
+     */
+    enum {
+        /** Reads are random, only read what is asked for instead of
+         *  reading ahead to fill the file's cache. Sequential access is
+         *  the default, and O_APPEND covers append only access.
+         */
+        O_RANDOM_ACCESS = 0x04000000,
+    };
+
+    /** Encode a per-file cache size into open flags
+     *
+     *  Small caches save RAM on small files, large caches read ahead and
+     *  coalesce writes further on streaming files. The size is rounded up
+     *  to a power of two between 8 bytes and 128 KiB and to the
+     *  read/program sizes, and must be a factor of the block size. With the file_pool_size option, opens
+     *  fail with -EINVAL if the cache doesn't fit the pooled buffers.
+     *
+     *  @param size     Size of the file's cache in bytes.
+     *  @return         Flags to add to the open flags.
+     */
+    static int cache_flags(lfs2_size_t size);
+
     /** Lifetime of the LittleFileSystem2
      *
      *  @param name     Name of the file system in the tree.
@@ -152,6 +229,13 @@ public:
     virtual int mkdir(const char *path, mode_t mode);
 
     /** Store information about the mounted file system in a statvfs structure.
+     *
+     *  Free space is served from a cached block count that grows with
+     *  every block littlefs allocates, so this rarely touches storage.
+     *  remove, rename and file_truncate drop the cached count, which is
+     *  counted again on the next call. Blocks freed by rewriting files are
+     *  not credited back until then, so the free space reported may be
+     *  low until statvfs_exact is called.
      *
      *  @param path     The name of the file to find information about.
      *  @param buf      The stat buffer to write to.
@@ -159,6 +243,83 @@ public:
      */
     virtual int statvfs(const char *path, struct statvfs *buf);
 
+    /** Store exact information about the mounted file system in a statvfs
+     *  structure.
+     *
+     *  Traverses the filesystem to count the blocks in use and refreshes
+     *  the count statvfs is served from.
+     *
+     *  @param path     The name of the file to find information about.
+     *  @param buf      The stat buffer to write to.
+     *  @return         0 on success, negative error code on failure
+     */
+    int statvfs_exact(const char *path, struct statvfs *buf);
+
+    /** List a directory along with the size and type of each entry
+     *
+     *  Entries come in the same order as reading a Dir, but are filled in
+     *  from the same pass over the directory, so listings don't need to
+     *  look up each entry again with stat. Entries are read
+     *  MBED_LFS2_DIR_LIST_BATCH at a time, reading each metadata pair once
+     *  per batch.
+     *
+     *  @param path     The name of the directory to list.
+     *  @param pos      Position to start from, 0 for the start of the
+     *                  directory. Updated to continue where this call
+     *                  stopped.
+     *  @param ents     Array of count entries to fill in.
+     *  @param sts      Array of count stat buffers to fill in, or NULL.
+     *  @param count    Number of entries to read.
+     *  @param attrs    Custom attributes to read with each entry, or NULL.
+     *                  Each attribute's buffer holds count attributes of
+     *                  its size, entry i's is written at offset i*size and
+     *                  padded with zeros if missing or smaller.
+     *  @param attr_count Number of attributes, at most
+     *                  MBED_LFS2_DIR_LIST_ATTRS.
+     *  @return         Number of entries read, 0 at the end of the
+     *                  directory, or a negative error code on failure
+     */
+    ssize_t dir_list(const char *path, off_t *pos,
+                     struct dirent *ents, struct stat *sts, size_t count,
+                     const struct lfs2_attr *attrs = NULL,
+                     size_t attr_count = 0);
+
+    /** Get counts of block device and internal operations
+     *
+     *  Counts accumulate from mount or the last reset. To find out what a
+     *  single operation did, reset before it and read the counts after it.
+     *  Needs the enable_stats option.
+     *
+     *  @param stats    Buffer to fill in with the counts, or NULL to only
+     *                  reset them.
+     *  @param reset    Reset the counts after reading them.
+     *  @return         0 on success, -ENOTSUP if counts are not enabled
+     */
+    int get_stats(struct lfs2_stats *stats, bool reset = false);
+
+    /** Save erase counts and move cold data onto worn blocks
+     *
+     *  Files that never change keep their blocks out of dynamic
+     *  wear-leveling. With the wear_regions option set, erases are counted
+     *  per region of the disk, and this saves the counts and moves one file
+     *  out of a region that has fallen wear_threshold erases per block
+     *  behind the most worn one. Call it periodically, for example when
+     *  idle, counts since the last call are lost on power-loss.
+     *
+     *  @return         0 on success or a negative error code on failure
+     */
+    int wear_level();
+
+    /** Get approximate erases per block
+     *
+     *  Reports the min, average, and max erases per block and a histogram,
+     *  see lfs2_fs_wear. Needs the wear_regions option.
+     *
+     *  @param wear     Filled in with the erases per block.
+     *  @return         0 on success, -EINVAL if erases are not counted
+     */
+    int get_wear(struct lfs2_wear *wear);
+
 protected:
 #if !(DOXYGEN_ONLY)
     /** Open a file on the file system.
@@ -287,13 +448,171 @@ protected:
     virtual void dir_rewind(mbed::fs_dir_t dir);
 #endif //!(DOXYGEN_ONLY)
 
+    /** Fill in the block device callbacks used by littlefs
+     *
+     *  Called on mount with config->context set to the BlockDevice. The
+     *  default callbacks go through BlockDevice's virtual methods.
+     *
+     *  @param config   Configuration to fill in.
+     */
+    virtual void bd_bind(struct lfs2_config *config);
+
 private:
     lfs2_t _lfs; // The actual file system
     struct lfs2_config _config;
+#if MBED_LFS2_ENABLE_STATS
+    struct lfs2_stats _stats;
+#endif
     mbed::BlockDevice *_bd; // The block device
 
     // thread-safe locking
     PlatformMutex _mutex;
+
+    // blocks in use at the last traversal, and the allocator's count then,
+    // protected by _mutex
+    uint32_t _usage;
+    uint32_t _usage_allocs;
+    bool _usage_valid;
+    int usage_refresh();
+    void usage_fill(struct statvfs *st, uint32_t in_use);
+
+    // Each open file carries its own lock. Calls on a handle always take
+    // it, after the filesystem lock if they need that too, so queries that
+    // only touch the handle don't wait behind unrelated operations.
+    struct lfs2_handle {
+        lfs2_file_t file;
+        struct lfs2_file_config cfg;
+        PlatformMutex mutex;
+#if MBED_LFS2_WRITE_BEHIND_SIZE > 0
+        // bytes still queued, and the first error the flush thread hit,
+        // both protected by the queue lock
+        lfs2_size_t wb_pending;
+        int wb_err;
+#endif
+    };
+
+    // handle allocation, called with the filesystem lock held
+    lfs2_handle *file_alloc(lfs2_size_t cache_size);
+    void file_free(lfs2_handle *h);
+    lfs2_dir_t *dir_alloc();
+    void dir_free(lfs2_dir_t *d);
+
+#if MBED_LFS2_FILE_POOL_SIZE > 0
+    lfs2_handle _files[MBED_LFS2_FILE_POOL_SIZE];
+    uint32_t _file_buffers[MBED_LFS2_FILE_POOL_SIZE]
+            [(MBED_LFS2_FILE_BUFFER_SIZE + 3) / 4];
+    bool _files_used[MBED_LFS2_FILE_POOL_SIZE];
+#endif
+
+#if MBED_LFS2_DIR_POOL_SIZE > 0
+    lfs2_dir_t _dirs[MBED_LFS2_DIR_POOL_SIZE];
+    bool _dirs_used[MBED_LFS2_DIR_POOL_SIZE];
+#endif
+
+    // write-behind, called without the filesystem lock held since the
+    // flush thread needs it to make progress
+    void wb_start();
+    void wb_stop();
+    void wb_drain(lfs2_handle *h);
+    int wb_error(lfs2_handle *h);
+
+#if MBED_LFS2_WRITE_BEHIND_SIZE > 0
+    // queued writes are a wb_entry followed by its data, wrapping around
+    // the end of the buffer
+    struct wb_entry {
+        lfs2_handle *h;
+        lfs2_size_t size;
+    };
+
+    ssize_t wb_write(lfs2_handle *h, const void *buffer, size_t len);
+    void wb_copyin(const void *buffer, lfs2_size_t size);
+    void wb_copyout(lfs2_size_t off, void *buffer, lfs2_size_t size);
+    void wb_run();
+
+    rtos::Mutex _wb_mutex;
+    rtos::ConditionVariable _wb_cond;
+    rtos::Thread *_wb_thread;
+    bool _wb_stop;
+    lfs2_size_t _wb_tail;
+    lfs2_size_t _wb_used;
+    uint8_t _wb_buffer[MBED_LFS2_WRITE_BEHIND_SIZE];
+#endif
+};
+
+
+/**
+ * LittleFileSystem2 bound to a block device type known at compile time
+ *
+ * Block device calls skip virtual dispatch and call BD's methods directly,
+ * so they can be inlined where BD's methods are visible.
+ *
+ * BD must be the exact type of the mounted block device, methods
+ * overridden by a further derived class are not called.
+ */
+template <class BD>
+class LittleFileSystem2Direct : public LittleFileSystem2 {
+public:
+    /** Lifetime of the LittleFileSystem2Direct
+     *
+     *  Takes the same parameters as LittleFileSystem2.
+     */
+    LittleFileSystem2Direct(const char *name = NULL, BD *bd = NULL,
+                            lfs2_size_t block_size = MBED_LFS2_BLOCK_SIZE,
+                            uint32_t   block_cycles = MBED_LFS2_BLOCK_CYCLES,
+                            lfs2_size_t cache_size = MBED_LFS2_CACHE_SIZE,
+                            lfs2_size_t lookahead = MBED_LFS2_LOOKAHEAD_SIZE)
+        : LittleFileSystem2(name, NULL,
+                            block_size, block_cycles, cache_size, lookahead)
+    {
+        // mounted here, our callbacks aren't bound during the base
+        // class's constructor
+        if (bd) {
+            mount(bd);
+        }
+    }
+
+protected:
+    virtual void bd_bind(struct lfs2_config *config)
+    {
+        // adjust from BlockDevice in case it isn't BD's first base
+        BD *bd = static_cast<BD *>(
+                     static_cast<mbed::BlockDevice *>(config->context));
+        config->context = bd;
+        config->read    = bd_read;
+        config->prog    = bd_prog;
+        config->erase   = bd_erase;
+        config->sync    = bd_sync;
+    }
+
+private:
+    static int bd_read(const struct lfs2_config *c, lfs2_block_t block,
+                       lfs2_off_t off, void *buffer, lfs2_size_t size)
+    {
+        BD *bd = static_cast<BD *>(c->context);
+        return bd->BD::read(buffer,
+                            (bd_addr_t)block * c->block_size + off, size);
+    }
+
+    static int bd_prog(const struct lfs2_config *c, lfs2_block_t block,
+                       lfs2_off_t off, const void *buffer, lfs2_size_t size)
+    {
+        BD *bd = static_cast<BD *>(c->context);
+        return bd->BD::program(buffer,
+                               (bd_addr_t)block * c->block_size + off, size);
+    }
+
+    static int bd_erase(const struct lfs2_config *c, lfs2_block_t block)
+    {
+        BD *bd = static_cast<BD *>(c->context);
+        return bd->BD::erase((bd_addr_t)block * c->block_size,
+                             c->block_size);
+    }
+
+    static int bd_sync(const struct lfs2_config *c)
+    {
+        BD *bd = static_cast<BD *>(c->context);
+        return bd->BD::sync();
+    }
 };
 
 } // namespace mbed
@@ -301,6 +620,7 @@ private:
 // Added "using" for backwards compatibility
 #ifndef MBED_NO_GLOBAL_USING_DIRECTIVE
 using mbed::LittleFileSystem2;
+using mbed::LittleFileSystem2Direct;
 #endif
 
 #endif
@@ -0,0 +1,246 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2017 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "mbed.h"
+#include "greentea-client/test_env.h"
+#include "unity.h"
+#include "utest.h"
+#include <stdlib.h>
+#include <errno.h>
+
+using namespace utest::v1;
+
+// test configuration
+#ifndef MBED_TEST_FILESYSTEM
+#define MBED_TEST_FILESYSTEM LittleFileSystem2
+#endif
+
+#ifndef MBED_TEST_FILESYSTEM_DECL
+#define MBED_TEST_FILESYSTEM_DECL MBED_TEST_FILESYSTEM fs("fs")
+#endif
+
+#ifndef MBED_TEST_BLOCKDEVICE
+#error [NOT_SUPPORTED] Non-volatile block device required
+#endif
+
+#ifndef MBED_TEST_BLOCKDEVICE_DECL
+#define MBED_TEST_BLOCKDEVICE_DECL MBED_TEST_BLOCKDEVICE bd
+#endif
+
+#ifndef MBED_TEST_THREADS
+#define MBED_TEST_THREADS 3
+#endif
+
+#ifndef MBED_TEST_FILE_SIZE
+#define MBED_TEST_FILE_SIZE 8192
+#endif
+
+#ifndef MBED_TEST_CHUNK_SIZE
+#define MBED_TEST_CHUNK_SIZE 64
+#endif
+
+#ifndef MBED_TEST_DURATION
+#define MBED_TEST_DURATION 5
+#endif
+
+#ifndef MBED_TEST_TIMEOUT
+#define MBED_TEST_TIMEOUT 480
+#endif
+
+
+// declarations
+#define STRINGIZE(x) STRINGIZE2(x)
+#define STRINGIZE2(x) #x
+#define INCLUDE(x) STRINGIZE(x.h)
+
+#include INCLUDE(MBED_TEST_FILESYSTEM)
+#include INCLUDE(MBED_TEST_BLOCKDEVICE)
+
+MBED_TEST_FILESYSTEM_DECL;
+MBED_TEST_BLOCKDEVICE_DECL;
+
+static volatile bool running;
+static uint32_t read_bytes[MBED_TEST_THREADS];
+static uint32_t queries[MBED_TEST_THREADS];
+static uint32_t written_bytes;
+
+
+// workers
+static void reader(uint32_t *id)
+{
+    char path[16];
+    uint8_t buffer[MBED_TEST_CHUNK_SIZE];
+    sprintf(path, "read%lu", *id);
+
+    File f;
+    int res = f.open(&fs, path, O_RDONLY);
+    TEST_ASSERT_EQUAL(0, res);
+
+    while (running) {
+        res = f.read(buffer, sizeof(buffer));
+        TEST_ASSERT(res >= 0);
+        if (res == 0) {
+            f.rewind();
+            continue;
+        }
+
+        for (int i = 0; i < res; i++) {
+            TEST_ASSERT_EQUAL('a' + *id, buffer[i]);
+        }
+        read_bytes[*id] += res;
+
+        // in-RAM queries shouldn't stall behind the writer
+        TEST_ASSERT_EQUAL(MBED_TEST_FILE_SIZE, f.size());
+        TEST_ASSERT(f.tell() <= MBED_TEST_FILE_SIZE);
+        queries[*id] += 2;
+    }
+
+    res = f.close();
+    TEST_ASSERT_EQUAL(0, res);
+}
+
+static void writer()
+{
+    uint8_t buffer[MBED_TEST_CHUNK_SIZE];
+    memset(buffer, 'w', sizeof(buffer));
+
+    File f;
+    while (running) {
+        int res = f.open(&fs, "write", O_WRONLY | O_CREAT | O_TRUNC);
+        TEST_ASSERT_EQUAL(0, res);
+        for (int i = 0; i < MBED_TEST_FILE_SIZE && running;
+                i += MBED_TEST_CHUNK_SIZE) {
+            res = f.write(buffer, sizeof(buffer));
+            TEST_ASSERT_EQUAL(sizeof(buffer), res);
+            written_bytes += res;
+        }
+        res = f.close();
+        TEST_ASSERT_EQUAL(0, res);
+    }
+}
+
+
+// tests
+void test_setup_files()
+{
+    int res = bd.init();
+    TEST_ASSERT_EQUAL(0, res);
+
+    res = MBED_TEST_FILESYSTEM::format(&bd);
+    TEST_ASSERT_EQUAL(0, res);
+    res = fs.mount(&bd);
+    TEST_ASSERT_EQUAL(0, res);
+
+    uint8_t buffer[MBED_TEST_CHUNK_SIZE];
+    for (uint32_t i = 0; i < MBED_TEST_THREADS; i++) {
+        char path[16];
+        sprintf(path, "read%lu", i);
+        memset(buffer, 'a' + i, sizeof(buffer));
+
+        File f;
+        res = f.open(&fs, path, O_WRONLY | O_CREAT);
+        TEST_ASSERT_EQUAL(0, res);
+        for (int j = 0; j < MBED_TEST_FILE_SIZE; j += MBED_TEST_CHUNK_SIZE) {
+            res = f.write(buffer, sizeof(buffer));
+            TEST_ASSERT_EQUAL(sizeof(buffer), res);
+        }
+        res = f.close();
+        TEST_ASSERT_EQUAL(0, res);
+    }
+
+    res = fs.unmount();
+    TEST_ASSERT_EQUAL(0, res);
+    res = bd.deinit();
+    TEST_ASSERT_EQUAL(0, res);
+}
+
+template <bool with_writer>
+void test_throughput()
+{
+    int res = bd.init();
+    TEST_ASSERT_EQUAL(0, res);
+    res = fs.mount(&bd);
+    TEST_ASSERT_EQUAL(0, res);
+
+    memset(read_bytes, 0, sizeof(read_bytes));
+    memset(queries, 0, sizeof(queries));
+    written_bytes = 0;
+    running = true;
+
+    Thread readers[MBED_TEST_THREADS];
+    uint32_t ids[MBED_TEST_THREADS];
+    for (uint32_t i = 0; i < MBED_TEST_THREADS; i++) {
+        ids[i] = i;
+        res = readers[i].start(callback(reader, &ids[i]));
+        TEST_ASSERT_EQUAL(osOK, res);
+    }
+
+    Thread writes;
+    if (with_writer) {
+        res = writes.start(writer);
+        TEST_ASSERT_EQUAL(osOK, res);
+    }
+
+    ThisThread::sleep_for(MBED_TEST_DURATION * 1000);
+    running = false;
+
+    for (uint32_t i = 0; i < MBED_TEST_THREADS; i++) {
+        readers[i].join();
+    }
+    if (with_writer) {
+        writes.join();
+    }
+
+    uint32_t total = 0;
+    uint32_t total_queries = 0;
+    for (uint32_t i = 0; i < MBED_TEST_THREADS; i++) {
+        TEST_ASSERT(read_bytes[i] > 0);
+        total += read_bytes[i];
+        total_queries += queries[i];
+    }
+
+    printf("%d readers: %lu B/s read, %lu queries/s, %lu B/s written\n",
+           MBED_TEST_THREADS,
+           total / MBED_TEST_DURATION,
+           total_queries / MBED_TEST_DURATION,
+           written_bytes / MBED_TEST_DURATION);
+
+    res = fs.unmount();
+    TEST_ASSERT_EQUAL(0, res);
+    res = bd.deinit();
+    TEST_ASSERT_EQUAL(0, res);
+}
+
+
+
+// test setup
+utest::v1::status_t test_setup(const size_t number_of_cases)
+{
+    GREENTEA_SETUP(MBED_TEST_TIMEOUT, "default_auto");
+    return verbose_test_setup_handler(number_of_cases);
+}
+
+Case cases[] = {
+    Case("Setup files", test_setup_files),
+    Case("Concurrent readers", test_throughput<false>),
+    Case("Concurrent readers and writer", test_throughput<true>),
+};
+
+Specification specification(test_setup, cases);
+
+int main()
+{
+    return !Harness::run(specification);
+}
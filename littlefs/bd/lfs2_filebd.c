@@ -4,11 +4,58 @@
  * Copyright (c) 2017, Arm Limited. All rights reserved.
  * SPDX-License-Identifier: BSD-3-Clause
  */
+#define _POSIX_C_SOURCE 200809L
 #include "bd/lfs2_filebd.h"
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// pread/pwrite may be cut short, so loop until everything is transferred,
+// reads past the end of the file are left as-is
+static int lfs2_filebd_pread(lfs2_filebd_t *bd,
+        void *buffer, size_t size, off_t off) {
+    uint8_t *data = buffer;
+    while (size > 0) {
+        ssize_t res = pread(bd->fd, data, size, off);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        } else if (res == 0) {
+            break;
+        }
+
+        data += res;
+        off += res;
+        size -= res;
+    }
+
+    return 0;
+}
+
+static int lfs2_filebd_pwrite(lfs2_filebd_t *bd,
+        const void *buffer, size_t size, off_t off) {
+    const uint8_t *data = buffer;
+    while (size > 0) {
+        ssize_t res = pwrite(bd->fd, data, size, off);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+
+        data += res;
+        off += res;
+        size -= res;
+    }
+
+    return 0;
+}
 
 int lfs2_filebd_createcfg(const struct lfs2_config *cfg, const char *path,
         const struct lfs2_filebd_config *bdcfg) {
@@ -17,14 +64,16 @@ int lfs2_filebd_createcfg(const struct lfs2_config *cfg, const char *path,
                 ".read_size=%"PRIu32", .prog_size=%"PRIu32", "
                 ".block_size=%"PRIu32", .block_count=%"PRIu32"}, "
                 "\"%s\", "
-                "%p {.erase_value=%"PRId32"})",
+                "%p {.erase_value=%"PRId32", .use_mmap=%d})",
             (void*)cfg, cfg->context,
             (void*)(uintptr_t)cfg->read, (void*)(uintptr_t)cfg->prog,
             (void*)(uintptr_t)cfg->erase, (void*)(uintptr_t)cfg->sync,
             cfg->read_size, cfg->prog_size, cfg->block_size, cfg->block_count,
-            path, (void*)bdcfg, bdcfg->erase_value);
+            path, (void*)bdcfg, bdcfg->erase_value, bdcfg->use_mmap);
     lfs2_filebd_t *bd = cfg->context;
     bd->cfg = bdcfg;
+    bd->map = NULL;
+    bd->buffer = NULL;
 
     // open file
     bd->fd = open(path, O_RDWR | O_CREAT, 0666);
@@ -34,8 +83,50 @@ int lfs2_filebd_createcfg(const struct lfs2_config *cfg, const char *path,
         return err;
     }
 
+    int err;
+    if (bd->cfg->use_mmap) {
+        // grow the file to the full size of the block device, new space
+        // reads as erased for reproducability
+        off_t size = (off_t)cfg->block_size*cfg->block_count;
+        struct stat st;
+        if (fstat(bd->fd, &st) < 0) {
+            err = -errno;
+            goto cleanup;
+        }
+
+        if (st.st_size < size && ftruncate(bd->fd, size) < 0) {
+            err = -errno;
+            goto cleanup;
+        }
+
+        void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                bd->fd, 0);
+        if (map == MAP_FAILED) {
+            err = -errno;
+            goto cleanup;
+        }
+        bd->map = map;
+
+        if (st.st_size < size && bd->cfg->erase_value != -1) {
+            memset(&bd->map[st.st_size], bd->cfg->erase_value,
+                    size - st.st_size);
+        }
+    } else if (bd->cfg->erase_value != -1) {
+        // a block-sized buffer lets us erase or check a block in one go
+        bd->buffer = lfs2_malloc(cfg->block_size);
+        if (!bd->buffer) {
+            err = LFS2_ERR_NOMEM;
+            goto cleanup;
+        }
+    }
+
     LFS2_FILEBD_TRACE("lfs2_filebd_createcfg -> %d", 0);
     return 0;
+
+cleanup:
+    close(bd->fd);
+    LFS2_FILEBD_TRACE("lfs2_filebd_createcfg -> %d", err);
+    return err;
 }
 
 int lfs2_filebd_create(const struct lfs2_config *cfg, const char *path) {
@@ -58,6 +149,11 @@ int lfs2_filebd_create(const struct lfs2_config *cfg, const char *path) {
 int lfs2_filebd_destroy(const struct lfs2_config *cfg) {
     LFS2_FILEBD_TRACE("lfs2_filebd_destroy(%p)", (void*)cfg);
     lfs2_filebd_t *bd = cfg->context;
+    if (bd->map) {
+        munmap(bd->map, (size_t)cfg->block_size*cfg->block_count);
+    }
+    lfs2_free(bd->buffer);
+
     int err = close(bd->fd);
     if (err < 0) {
         err = -errno;
@@ -80,29 +176,22 @@ int lfs2_filebd_read(const struct lfs2_config *cfg, lfs2_block_t block,
     LFS2_ASSERT(size % cfg->read_size == 0);
     LFS2_ASSERT(block < cfg->block_count);
 
+    if (bd->map) {
+        memcpy(buffer, &bd->map[(size_t)block*cfg->block_size + off], size);
+        LFS2_FILEBD_TRACE("lfs2_filebd_read -> %d", 0);
+        return 0;
+    }
+
     // zero for reproducability (in case file is truncated)
     if (bd->cfg->erase_value != -1) {
         memset(buffer, bd->cfg->erase_value, size);
     }
 
     // read
-    off_t res1 = lseek(bd->fd,
-            (off_t)block*cfg->block_size + (off_t)off, SEEK_SET);
-    if (res1 < 0) {
-        int err = -errno;
-        LFS2_FILEBD_TRACE("lfs2_filebd_read -> %d", err);
-        return err;
-    }
-
-    ssize_t res2 = read(bd->fd, buffer, size);
-    if (res2 < 0) {
-        int err = -errno;
-        LFS2_FILEBD_TRACE("lfs2_filebd_read -> %d", err);
-        return err;
-    }
-
-    LFS2_FILEBD_TRACE("lfs2_filebd_read -> %d", 0);
-    return 0;
+    int err = lfs2_filebd_pread(bd, buffer, size,
+            (off_t)block*cfg->block_size + (off_t)off);
+    LFS2_FILEBD_TRACE("lfs2_filebd_read -> %d", err);
+    return err;
 }
 
 int lfs2_filebd_prog(const struct lfs2_config *cfg, lfs2_block_t block,
@@ -116,47 +205,40 @@ int lfs2_filebd_prog(const struct lfs2_config *cfg, lfs2_block_t block,
     LFS2_ASSERT(size % cfg->prog_size == 0);
     LFS2_ASSERT(block < cfg->block_count);
 
+    if (bd->map) {
+        uint8_t *data = &bd->map[(size_t)block*cfg->block_size + off];
+        // check that data was erased? only needed for testing
+        if (bd->cfg->erase_value != -1) {
+            for (lfs2_off_t i = 0; i < size; i++) {
+                LFS2_ASSERT(data[i] == bd->cfg->erase_value);
+            }
+        }
+
+        memcpy(data, buffer, size);
+        LFS2_FILEBD_TRACE("lfs2_filebd_prog -> %d", 0);
+        return 0;
+    }
+
     // check that data was erased? only needed for testing
     if (bd->cfg->erase_value != -1) {
-        off_t res1 = lseek(bd->fd,
-                (off_t)block*cfg->block_size + (off_t)off, SEEK_SET);
-        if (res1 < 0) {
-            int err = -errno;
+        memset(bd->buffer, bd->cfg->erase_value, size);
+        int err = lfs2_filebd_pread(bd, bd->buffer, size,
+                (off_t)block*cfg->block_size + (off_t)off);
+        if (err) {
             LFS2_FILEBD_TRACE("lfs2_filebd_prog -> %d", err);
             return err;
         }
 
         for (lfs2_off_t i = 0; i < size; i++) {
-            uint8_t c;
-            ssize_t res2 = read(bd->fd, &c, 1);
-            if (res2 < 0) {
-                int err = -errno;
-                LFS2_FILEBD_TRACE("lfs2_filebd_prog -> %d", err);
-                return err;
-            }
-
-            LFS2_ASSERT(c == bd->cfg->erase_value);
+            LFS2_ASSERT(bd->buffer[i] == bd->cfg->erase_value);
         }
     }
 
     // program data
-    off_t res1 = lseek(bd->fd,
-            (off_t)block*cfg->block_size + (off_t)off, SEEK_SET);
-    if (res1 < 0) {
-        int err = -errno;
-        LFS2_FILEBD_TRACE("lfs2_filebd_prog -> %d", err);
-        return err;
-    }
-
-    ssize_t res2 = write(bd->fd, buffer, size);
-    if (res2 < 0) {
-        int err = -errno;
-        LFS2_FILEBD_TRACE("lfs2_filebd_prog -> %d", err);
-        return err;
-    }
-
-    LFS2_FILEBD_TRACE("lfs2_filebd_prog -> %d", 0);
-    return 0;
+    int err = lfs2_filebd_pwrite(bd, buffer, size,
+            (off_t)block*cfg->block_size + (off_t)off);
+    LFS2_FILEBD_TRACE("lfs2_filebd_prog -> %d", err);
+    return err;
 }
 
 int lfs2_filebd_erase(const struct lfs2_config *cfg, lfs2_block_t block) {
@@ -168,17 +250,14 @@ int lfs2_filebd_erase(const struct lfs2_config *cfg, lfs2_block_t block) {
 
     // erase, only needed for testing
     if (bd->cfg->erase_value != -1) {
-        off_t res1 = lseek(bd->fd, (off_t)block*cfg->block_size, SEEK_SET);
-        if (res1 < 0) {
-            int err = -errno;
-            LFS2_FILEBD_TRACE("lfs2_filebd_erase -> %d", err);
-            return err;
-        }
-
-        for (lfs2_off_t i = 0; i < cfg->block_size; i++) {
-            ssize_t res2 = write(bd->fd, &(uint8_t){bd->cfg->erase_value}, 1);
-            if (res2 < 0) {
-                int err = -errno;
+        if (bd->map) {
+            memset(&bd->map[(size_t)block*cfg->block_size],
+                    bd->cfg->erase_value, cfg->block_size);
+        } else {
+            memset(bd->buffer, bd->cfg->erase_value, cfg->block_size);
+            int err = lfs2_filebd_pwrite(bd, bd->buffer, cfg->block_size,
+                    (off_t)block*cfg->block_size);
+            if (err) {
                 LFS2_FILEBD_TRACE("lfs2_filebd_erase -> %d", err);
                 return err;
             }
@@ -193,10 +272,12 @@ int lfs2_filebd_sync(const struct lfs2_config *cfg) {
     LFS2_FILEBD_TRACE("lfs2_filebd_sync(%p)", (void*)cfg);
     // file sync
     lfs2_filebd_t *bd = cfg->context;
-    int err = fsync(bd->fd);
+    int err = (bd->map)
+            ? msync(bd->map, (size_t)cfg->block_size*cfg->block_count, MS_SYNC)
+            : fsync(bd->fd);
     if (err) {
         err = -errno;
-        LFS2_FILEBD_TRACE("lfs2_filebd_sync -> %d", 0);
+        LFS2_FILEBD_TRACE("lfs2_filebd_sync -> %d", err);
         return err;
     }
 
@@ -18,7 +18,7 @@ extern "C"
 
 // Block device specific tracing
 #ifdef LFS2_FILEBD_YES_TRACE
-#define LFS2_FILEBD_TRACE(...) LFS2_TRACE(__VA_ARGS__)
+#define LFS2_FILEBD_TRACE(...) LFS2_TRACE_AT(LFS2_TRACE_FILEBD, __VA_ARGS__)
 #else
 #define LFS2_FILEBD_TRACE(...)
 #endif
@@ -29,11 +29,17 @@ struct lfs2_filebd_config {
     // erases, which can speed up testing by avoiding all the extra block-device
     // operations to store the erase value.
     int32_t erase_value;
+
+    // Map the file into memory instead of going through pread/pwrite. The
+    // file is grown to the full size of the block device on create.
+    bool use_mmap;
 };
 
 // filebd state
 typedef struct lfs2_filebd {
     int fd;
+    uint8_t *map;
+    uint8_t *buffer;
     const struct lfs2_filebd_config *cfg;
 } lfs2_filebd_t;
 
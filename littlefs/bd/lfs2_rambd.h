@@ -18,7 +18,7 @@ extern "C"
 
 // Block device specific tracing
 #ifdef LFS2_RAMBD_YES_TRACE
-#define LFS2_RAMBD_TRACE(...) LFS2_TRACE(__VA_ARGS__)
+#define LFS2_RAMBD_TRACE(...) LFS2_TRACE_AT(LFS2_TRACE_RAMBD, __VA_ARGS__)
 #else
 #define LFS2_RAMBD_TRACE(...)
 #endif
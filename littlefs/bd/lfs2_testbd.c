@@ -10,6 +10,30 @@
 #include <stdlib.h>
 
 
+const struct lfs2_testbd_timing lfs2_testbd_nor_timing = {
+    .read_setup     = 500,
+    .read_byte      = 20,
+    .prog_setup     = 500,
+    .prog_page      = 40000,
+    .erase          = 45000000,
+    .erase_suspend  = 20000,
+};
+
+const struct lfs2_testbd_timing lfs2_testbd_nand_timing = {
+    .read_setup     = 25000,
+    .read_byte      = 25,
+    .prog_setup     = 200000,
+    .prog_page      = 400,
+    .erase          = 2000000,
+};
+
+const struct lfs2_testbd_timing lfs2_testbd_sd_timing = {
+    .read_setup     = 100000,
+    .read_byte      = 40,
+    .prog_setup     = 250000,
+    .prog_page      = 1000,
+};
+
 int lfs2_testbd_createcfg(const struct lfs2_config *cfg, const char *path,
         const struct lfs2_testbd_config *bdcfg) {
     LFS2_TESTBD_TRACE("lfs2_testbd_createcfg(%p {.context=%p, "
@@ -19,20 +43,26 @@ int lfs2_testbd_createcfg(const struct lfs2_config *cfg, const char *path,
                 "\"%s\", "
                 "%p {.erase_value=%"PRId32", .erase_cycles=%"PRIu32", "
                 ".badblock_behavior=%"PRIu8", .power_cycles=%"PRIu32", "
-                ".buffer=%p, .wear_buffer=%p})",
+                ".buffer=%p, .wear_buffer=%p, .timing=%p, "
+                ".snapshots=%p})",
             (void*)cfg, cfg->context,
             (void*)(uintptr_t)cfg->read, (void*)(uintptr_t)cfg->prog,
             (void*)(uintptr_t)cfg->erase, (void*)(uintptr_t)cfg->sync,
             cfg->read_size, cfg->prog_size, cfg->block_size, cfg->block_count,
             path, (void*)bdcfg, bdcfg->erase_value, bdcfg->erase_cycles,
             bdcfg->badblock_behavior, bdcfg->power_cycles,
-            bdcfg->buffer, bdcfg->wear_buffer);
+            bdcfg->buffer, bdcfg->wear_buffer, (void*)bdcfg->timing,
+            (void*)bdcfg->snapshots);
     lfs2_testbd_t *bd = cfg->context;
     bd->cfg = bdcfg;
 
     // setup testing things
     bd->persist = path;
     bd->power_cycles = bd->cfg->power_cycles;
+    bd->time = 0;
+    bd->busy = 0;
+    memset(bd->latency, 0, sizeof(bd->latency));
+    bd->snapshots = NULL;
 
     if (bd->cfg->erase_cycles) {
         if (bd->cfg->wear_buffer) {
@@ -48,6 +78,9 @@ int lfs2_testbd_createcfg(const struct lfs2_config *cfg, const char *path,
         memset(bd->wear, 0, sizeof(lfs2_testbd_wear_t) * cfg->block_count);
     }
 
+    // snapshots need direct access to the disk
+    LFS2_ASSERT(!bd->cfg->snapshots || !bd->persist);
+
     // create underlying block device
     if (bd->persist) {
         bd->u.file.cfg = (struct lfs2_filebd_config){
@@ -62,8 +95,25 @@ int lfs2_testbd_createcfg(const struct lfs2_config *cfg, const char *path,
             .buffer = bd->cfg->buffer,
         };
         int err = lfs2_rambd_createcfg(cfg, &bd->u.ram.cfg);
-        LFS2_TESTBD_TRACE("lfs2_testbd_createcfg -> %d", err);
-        return err;
+        if (err) {
+            LFS2_TESTBD_TRACE("lfs2_testbd_createcfg -> %d", err);
+            return err;
+        }
+
+        lfs2_testbd_snapshots_t *snapshots = bd->cfg->snapshots;
+        if (snapshots && snapshots->disk) {
+            // start from the kept disk
+            LFS2_ASSERT(snapshots->disk_size
+                    == cfg->block_size*cfg->block_count);
+            memcpy(bd->u.ram.bd.buffer, snapshots->disk, snapshots->disk_size);
+        } else if (snapshots) {
+            // record every write
+            snapshots->block_size = cfg->block_size;
+            bd->snapshots = snapshots;
+        }
+
+        LFS2_TESTBD_TRACE("lfs2_testbd_createcfg -> %d", 0);
+        return 0;
     }
 }
 
@@ -91,6 +141,18 @@ int lfs2_testbd_destroy(const struct lfs2_config *cfg) {
         lfs2_free(bd->wear);
     }
 
+    // keep the final disk so recorded writes can be undone
+    if (bd->snapshots) {
+        lfs2_size_t size = cfg->block_size*cfg->block_count;
+        bd->snapshots->disk = lfs2_malloc(size);
+        if (!bd->snapshots->disk) {
+            LFS2_TESTBD_TRACE("lfs2_testbd_destroy -> %d", LFS2_ERR_NOMEM);
+            return LFS2_ERR_NOMEM;
+        }
+        memcpy(bd->snapshots->disk, bd->u.ram.bd.buffer, size);
+        bd->snapshots->disk_size = size;
+    }
+
     if (bd->persist) {
         int err = lfs2_filebd_destroy(cfg);
         LFS2_TESTBD_TRACE("lfs2_testbd_destroy -> %d", err);
@@ -142,6 +204,94 @@ static int lfs2_testbd_rawsync(const struct lfs2_config *cfg) {
     }
 }
 
+/// Snapshots for in-process power-loss ///
+static int lfs2_testbd_snapshot(const struct lfs2_config *cfg,
+        lfs2_block_t block, lfs2_off_t off, lfs2_size_t size) {
+    lfs2_testbd_t *bd = cfg->context;
+    lfs2_testbd_snapshots_t *snapshots = bd->snapshots;
+
+    // make room, growing geometrically since every write lands here
+    if (snapshots->count == snapshots->capacity) {
+        uint32_t capacity = lfs2_max(2*snapshots->capacity, 64);
+        struct lfs2_testbd_snapshot *nsnapshots = realloc(
+                snapshots->snapshots,
+                capacity*sizeof(struct lfs2_testbd_snapshot));
+        if (!nsnapshots) {
+            return LFS2_ERR_NOMEM;
+        }
+        snapshots->snapshots = nsnapshots;
+        snapshots->capacity = capacity;
+    }
+
+    if (snapshots->data_size + size > snapshots->data_capacity) {
+        size_t capacity = 2*snapshots->data_capacity;
+        if (capacity < snapshots->data_size + size) {
+            capacity = snapshots->data_size + size;
+        }
+        uint8_t *ndata = realloc(snapshots->data, capacity);
+        if (!ndata) {
+            return LFS2_ERR_NOMEM;
+        }
+        snapshots->data = ndata;
+        snapshots->data_capacity = capacity;
+    }
+
+    // only copy the bytes that are about to change
+    snapshots->snapshots[snapshots->count] = (struct lfs2_testbd_snapshot){
+        .block = block,
+        .off = off,
+        .size = size,
+        .data = snapshots->data_size,
+    };
+    memcpy(&snapshots->data[snapshots->data_size],
+            &bd->u.ram.bd.buffer[block*cfg->block_size + off], size);
+    snapshots->count += 1;
+    snapshots->data_size += size;
+    return 0;
+}
+
+
+/// Simulated timing ///
+static void lfs2_testbd_timeop(lfs2_testbd_t *bd, uint8_t op,
+        lfs2_testbd_time_t cost) {
+    const struct lfs2_testbd_timing *timing = bd->cfg->timing;
+    lfs2_testbd_time_t start = bd->time;
+    if (bd->busy > bd->time) {
+        if (op == LFS2_TESTBD_OP_READ) {
+            // suspend the pending erase while we read
+            cost += timing->erase_suspend;
+            bd->busy += cost;
+        } else {
+            // wait for the pending erase
+            bd->time = bd->busy;
+        }
+    }
+
+    if (op == LFS2_TESTBD_OP_ERASE && timing->erase_suspend) {
+        // erase in the background
+        bd->busy = bd->time + cost;
+    } else {
+        bd->time += cost;
+    }
+
+    lfs2_testbd_time_t latency = bd->time - start;
+    struct lfs2_testbd_latency *l = &bd->latency[op];
+    l->count += 1;
+    l->total += latency;
+    if (latency > l->max) {
+        l->max = latency;
+    }
+    uint32_t bucket = LFS2_TESTBD_LATENCY_BUCKETS-1;
+    if (latency == 0) {
+        bucket = 0;
+    } else if (latency < 0x80000000) {
+        bucket = lfs2_min(lfs2_npw2((uint32_t)latency + 1),
+                LFS2_TESTBD_LATENCY_BUCKETS-1);
+    }
+    l->buckets[bucket] += 1;
+}
+
+
 /// block device API ///
 int lfs2_testbd_read(const struct lfs2_config *cfg, lfs2_block_t block,
         lfs2_off_t off, void *buffer, lfs2_size_t size) {
@@ -155,6 +305,12 @@ int lfs2_testbd_read(const struct lfs2_config *cfg, lfs2_block_t block,
     LFS2_ASSERT(size % cfg->read_size == 0);
     LFS2_ASSERT(block < cfg->block_count);
 
+    if (bd->cfg->timing) {
+        lfs2_testbd_timeop(bd, LFS2_TESTBD_OP_READ,
+                bd->cfg->timing->read_setup
+                + (lfs2_testbd_time_t)bd->cfg->timing->read_byte*size);
+    }
+
     // block bad?
     if (bd->cfg->erase_cycles && bd->wear[block] >= bd->cfg->erase_cycles &&
             bd->cfg->badblock_behavior == LFS2_TESTBD_BADBLOCK_READERROR) {
@@ -180,6 +336,13 @@ int lfs2_testbd_prog(const struct lfs2_config *cfg, lfs2_block_t block,
     LFS2_ASSERT(size % cfg->prog_size == 0);
     LFS2_ASSERT(block < cfg->block_count);
 
+    if (bd->cfg->timing) {
+        lfs2_testbd_timeop(bd, LFS2_TESTBD_OP_PROG,
+                bd->cfg->timing->prog_setup
+                + (lfs2_testbd_time_t)bd->cfg->timing->prog_page
+                    * (size / cfg->prog_size));
+    }
+
     // block bad?
     if (bd->cfg->erase_cycles && bd->wear[block] >= bd->cfg->erase_cycles) {
         if (bd->cfg->badblock_behavior ==
@@ -195,6 +358,15 @@ int lfs2_testbd_prog(const struct lfs2_config *cfg, lfs2_block_t block,
         }
     }
 
+    // record what we're about to overwrite?
+    if (bd->snapshots) {
+        int err = lfs2_testbd_snapshot(cfg, block, off, size);
+        if (err) {
+            LFS2_TESTBD_TRACE("lfs2_testbd_prog -> %d", err);
+            return err;
+        }
+    }
+
     // prog
     int err = lfs2_testbd_rawprog(cfg, block, off, buffer, size);
     if (err) {
@@ -224,6 +396,10 @@ int lfs2_testbd_erase(const struct lfs2_config *cfg, lfs2_block_t block) {
     // check if erase is valid
     LFS2_ASSERT(block < cfg->block_count);
 
+    if (bd->cfg->timing) {
+        lfs2_testbd_timeop(bd, LFS2_TESTBD_OP_ERASE, bd->cfg->timing->erase);
+    }
+
     // block bad?
     if (bd->cfg->erase_cycles) {
         if (bd->wear[block] >= bd->cfg->erase_cycles) {
@@ -242,6 +418,15 @@ int lfs2_testbd_erase(const struct lfs2_config *cfg, lfs2_block_t block) {
         }
     }
 
+    // record what we're about to erase?
+    if (bd->snapshots) {
+        int err = lfs2_testbd_snapshot(cfg, block, 0, cfg->block_size);
+        if (err) {
+            LFS2_TESTBD_TRACE("lfs2_testbd_erase -> %d", err);
+            return err;
+        }
+    }
+
     // erase
     int err = lfs2_testbd_rawerase(cfg, block);
     if (err) {
@@ -266,6 +451,13 @@ int lfs2_testbd_erase(const struct lfs2_config *cfg, lfs2_block_t block) {
 
 int lfs2_testbd_sync(const struct lfs2_config *cfg) {
     LFS2_TESTBD_TRACE("lfs2_testbd_sync(%p)", (void*)cfg);
+    lfs2_testbd_t *bd = cfg->context;
+
+    // wait for any pending erase
+    if (bd->busy > bd->time) {
+        bd->time = bd->busy;
+    }
+
     int err = lfs2_testbd_rawsync(cfg);
     LFS2_TESTBD_TRACE("lfs2_testbd_sync -> %d", err);
     return err;
@@ -300,3 +492,71 @@ int lfs2_testbd_setwear(const struct lfs2_config *cfg,
     LFS2_TESTBD_TRACE("lfs2_testbd_setwear -> %d", 0);
     return 0;
 }
+
+
+/// simulated timing operations ///
+lfs2_testbd_time_t lfs2_testbd_gettime(const struct lfs2_config *cfg) {
+    LFS2_TESTBD_TRACE("lfs2_testbd_gettime(%p)", (void*)cfg);
+    lfs2_testbd_t *bd = cfg->context;
+    LFS2_TESTBD_TRACE("lfs2_testbd_gettime -> %"PRIu64, bd->time);
+    return bd->time;
+}
+
+int lfs2_testbd_getlatency(const struct lfs2_config *cfg,
+        uint8_t op, struct lfs2_testbd_latency *latency) {
+    LFS2_TESTBD_TRACE("lfs2_testbd_getlatency(%p, %"PRIu8", %p)",
+            (void*)cfg, op, (void*)latency);
+    lfs2_testbd_t *bd = cfg->context;
+
+    // check if op is valid
+    LFS2_ASSERT(op <= LFS2_TESTBD_OP_ERASE);
+
+    *latency = bd->latency[op];
+
+    LFS2_TESTBD_TRACE("lfs2_testbd_getlatency -> %d", 0);
+    return 0;
+}
+
+int lfs2_testbd_resettime(const struct lfs2_config *cfg) {
+    LFS2_TESTBD_TRACE("lfs2_testbd_resettime(%p)", (void*)cfg);
+    lfs2_testbd_t *bd = cfg->context;
+
+    // keep any pending erase relative to the new clock
+    bd->busy = (bd->busy > bd->time) ? bd->busy - bd->time : 0;
+    bd->time = 0;
+    memset(bd->latency, 0, sizeof(bd->latency));
+
+    LFS2_TESTBD_TRACE("lfs2_testbd_resettime -> %d", 0);
+    return 0;
+}
+
+
+/// snapshot operations ///
+bool lfs2_testbd_rewind(lfs2_testbd_snapshots_t *snapshots) {
+    LFS2_TESTBD_TRACE("lfs2_testbd_rewind(%p)", (void*)snapshots);
+    if (!snapshots->disk || snapshots->count == 0) {
+        LFS2_TESTBD_TRACE("lfs2_testbd_rewind -> %d", false);
+        return false;
+    }
+
+    // undo the most recent write
+    snapshots->count -= 1;
+    const struct lfs2_testbd_snapshot *snapshot =
+            &snapshots->snapshots[snapshots->count];
+    memcpy(&snapshots->disk[
+                snapshot->block*snapshots->block_size + snapshot->off],
+            &snapshots->data[snapshot->data], snapshot->size);
+    snapshots->data_size = snapshot->data;
+
+    LFS2_TESTBD_TRACE("lfs2_testbd_rewind -> %d", true);
+    return true;
+}
+
+void lfs2_testbd_freesnapshots(lfs2_testbd_snapshots_t *snapshots) {
+    LFS2_TESTBD_TRACE("lfs2_testbd_freesnapshots(%p)", (void*)snapshots);
+    free(snapshots->snapshots);
+    free(snapshots->data);
+    lfs2_free(snapshots->disk);
+    memset(snapshots, 0, sizeof(lfs2_testbd_snapshots_t));
+    LFS2_TESTBD_TRACE("lfs2_testbd_freesnapshots -> void");
+}
@@ -21,7 +21,7 @@ extern "C"
 
 // Block device specific tracing
 #ifdef LFS2_TESTBD_YES_TRACE
-#define LFS2_TESTBD_TRACE(...) LFS2_TRACE(__VA_ARGS__)
+#define LFS2_TESTBD_TRACE(...) LFS2_TRACE_AT(LFS2_TRACE_TESTBD, __VA_ARGS__)
 #else
 #define LFS2_TESTBD_TRACE(...)
 #endif
@@ -44,6 +44,85 @@ enum lfs2_testbd_badblock_behavior {
 typedef uint32_t lfs2_testbd_wear_t;
 typedef int32_t  lfs2_testbd_swear_t;
 
+// Type for simulated time in nanoseconds
+typedef uint64_t lfs2_testbd_time_t;
+
+// Types of operations tracked by the timing model
+enum lfs2_testbd_op {
+    LFS2_TESTBD_OP_READ,
+    LFS2_TESTBD_OP_PROG,
+    LFS2_TESTBD_OP_ERASE,
+};
+
+// Simulated cost of block device operations in nanoseconds, each operation
+// advances a virtual clock by its cost. This doesn't slow down testing,
+// but lets benchmarks estimate time on real devices.
+struct lfs2_testbd_timing {
+    // Cost of each read, plus the cost per byte read
+    uint32_t read_setup;
+    uint32_t read_byte;
+
+    // Cost of each prog, plus the cost per prog_size page
+    uint32_t prog_setup;
+    uint32_t prog_page;
+
+    // Cost of erasing a block
+    uint32_t erase;
+
+    // If non-zero, erases run in the background and a read during an erase
+    // suspends it at this extra cost instead of waiting for it. Progs, erases
+    // and syncs still wait for the pending erase.
+    uint32_t erase_suspend;
+};
+
+// Some rough device profiles, SPI NOR with suspendable 4KiB sector erases,
+// raw SLC NAND with large page reads, and an SD card with expensive progs
+// and implicit erases
+extern const struct lfs2_testbd_timing lfs2_testbd_nor_timing;
+extern const struct lfs2_testbd_timing lfs2_testbd_nand_timing;
+extern const struct lfs2_testbd_timing lfs2_testbd_sd_timing;
+
+// Latency distribution of one type of operation, where latency is the time
+// the caller is blocked. buckets[i] counts latencies in [2^(i-1), 2^i) ns,
+// buckets[0] counts operations that didn't block.
+#define LFS2_TESTBD_LATENCY_BUCKETS 32
+
+struct lfs2_testbd_latency {
+    uint32_t count;
+    lfs2_testbd_time_t total;
+    lfs2_testbd_time_t max;
+    uint32_t buckets[LFS2_TESTBD_LATENCY_BUCKETS];
+};
+
+// A snapshot of the bytes about to be overwritten by a prog/erase
+struct lfs2_testbd_snapshot {
+    lfs2_block_t block;
+    lfs2_off_t off;
+    lfs2_size_t size;
+    size_t data;
+};
+
+// Snapshots for testing power-loss in-process. When recording, testbd copies
+// the bytes about to change before every prog/erase, and the final disk is
+// kept when the block device is destroyed. Rewinding undoes one write at a
+// time, and any testbd created afterwards starts from the rewound disk,
+// simulating power-loss after each write without restarting the program.
+//
+// Only RAM-backed testbds support snapshots. Zero-initialize before use.
+typedef struct lfs2_testbd_snapshots {
+    struct lfs2_testbd_snapshot *snapshots;
+    uint32_t count;
+    uint32_t capacity;
+
+    uint8_t *data;
+    size_t data_size;
+    size_t data_capacity;
+
+    uint8_t *disk;
+    lfs2_size_t block_size;
+    lfs2_size_t disk_size;
+} lfs2_testbd_snapshots_t;
+
 // testbd config, this is required for testing
 struct lfs2_testbd_config {
     // 8-bit erase value to use for simulating erases. -1 does not simulate
@@ -67,6 +146,13 @@ struct lfs2_testbd_config {
 
     // Optional buffer for wear
     void *wear_buffer;
+
+    // Optional timing model, NULL makes every operation free
+    const struct lfs2_testbd_timing *timing;
+
+    // Optional snapshots, records every prog/erase if no disk has been
+    // kept yet, otherwise starts from the kept disk
+    lfs2_testbd_snapshots_t *snapshots;
 };
 
 // testbd state
@@ -86,6 +172,11 @@ typedef struct lfs2_testbd {
     uint32_t power_cycles;
     lfs2_testbd_wear_t *wear;
 
+    lfs2_testbd_time_t time;
+    lfs2_testbd_time_t busy;
+    struct lfs2_testbd_latency latency[3];
+    lfs2_testbd_snapshots_t *snapshots;
+
     const struct lfs2_testbd_config *cfg;
 } lfs2_testbd_t;
 
@@ -133,6 +224,23 @@ lfs2_testbd_swear_t lfs2_testbd_getwear(const struct lfs2_config *cfg,
 int lfs2_testbd_setwear(const struct lfs2_config *cfg,
         lfs2_block_t block, lfs2_testbd_wear_t wear);
 
+// Get the simulated time spent in the block device
+lfs2_testbd_time_t lfs2_testbd_gettime(const struct lfs2_config *cfg);
+
+// Get the latency distribution of a type of operation
+int lfs2_testbd_getlatency(const struct lfs2_config *cfg,
+        uint8_t op, struct lfs2_testbd_latency *latency);
+
+// Reset the simulated time and latency distributions
+int lfs2_testbd_resettime(const struct lfs2_config *cfg);
+
+// Undo the most recent write in the kept disk, returns true if there was
+// a write to undo. Testbds created afterwards start from the rewound disk.
+bool lfs2_testbd_rewind(lfs2_testbd_snapshots_t *snapshots);
+
+// Clean up memory associated with snapshots, leaving them ready to record
+void lfs2_testbd_freesnapshots(lfs2_testbd_snapshots_t *snapshots);
+
 
 #ifdef __cplusplus
 } /* extern "C" */
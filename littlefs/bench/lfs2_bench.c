@@ -0,0 +1,550 @@
+/*
+ * Host-side benchmarks, runs a set of standard workloads on top of testbd
+ * across a matrix of configurations and reports throughput, block device
+ * operation counts, and optionally simulated device time.
+ *
+ * Copyright (c) 2017, Arm Limited. All rights reserved.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#define _POSIX_C_SOURCE 199309L
+#include "lfs2.h"
+#include "bd/lfs2_testbd.h"
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+// Benchmark configuration
+#ifndef LFS2_BENCH_DISK_SIZE
+#define LFS2_BENCH_DISK_SIZE (1024*1024)
+#endif
+
+#ifndef LFS2_BENCH_READ_SIZE
+#define LFS2_BENCH_READ_SIZE 16
+#endif
+
+#ifndef LFS2_BENCH_PROG_SIZE
+#define LFS2_BENCH_PROG_SIZE 16
+#endif
+
+static const lfs2_size_t bench_block_sizes[] = {512, 4096};
+static const lfs2_size_t bench_cache_sizes[] = {16, 64, 512};
+static const lfs2_size_t bench_lookahead_sizes[] = {16, 128};
+
+#define BENCH_COUNT(a) (sizeof(a)/sizeof((a)[0]))
+
+
+/// Block device operation counting ///
+struct bench_counts {
+    uint64_t reads;
+    uint64_t progs;
+    uint64_t erases;
+    uint64_t read_bytes;
+    uint64_t prog_bytes;
+};
+
+static struct bench_counts bench_counts;
+
+static int bench_read(const struct lfs2_config *cfg, lfs2_block_t block,
+        lfs2_off_t off, void *buffer, lfs2_size_t size) {
+    bench_counts.reads += 1;
+    bench_counts.read_bytes += size;
+    return lfs2_testbd_read(cfg, block, off, buffer, size);
+}
+
+static int bench_prog(const struct lfs2_config *cfg, lfs2_block_t block,
+        lfs2_off_t off, const void *buffer, lfs2_size_t size) {
+    bench_counts.progs += 1;
+    bench_counts.prog_bytes += size;
+    return lfs2_testbd_prog(cfg, block, off, buffer, size);
+}
+
+static int bench_erase(const struct lfs2_config *cfg, lfs2_block_t block) {
+    bench_counts.erases += 1;
+    return lfs2_testbd_erase(cfg, block);
+}
+
+
+#define BENCH_CHECK(x) do { \
+        int _err = (x); \
+        if (_err < 0) { \
+            fprintf(stderr, "%s:%d: %s -> %d\n", \
+                    __FILE__, __LINE__, #x, _err); \
+            exit(-1); \
+        } \
+    } while (0)
+
+
+/// Measurement ///
+struct bench {
+    const char *name;
+    const struct lfs2_config *cfg;
+
+    struct timespec start;
+    struct bench_counts counts;
+
+    uint64_t ops;
+    uint64_t bytes;
+    double seconds;
+
+    // simulated time, if we have a timing model
+    lfs2_testbd_time_t sim_time;
+    struct lfs2_testbd_latency latency[3];
+};
+
+static FILE *bench_out;
+static bool bench_json;
+static bool bench_first = true;
+static const char *bench_profile = "none";
+static const struct lfs2_testbd_timing *bench_timing;
+
+static void bench_start(struct bench *b) {
+    b->counts = bench_counts;
+    BENCH_CHECK(lfs2_testbd_resettime(b->cfg));
+    clock_gettime(CLOCK_MONOTONIC, &b->start);
+}
+
+static void bench_stop(struct bench *b, uint64_t ops, uint64_t bytes) {
+    struct timespec stop;
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    b->seconds = (double)(stop.tv_sec - b->start.tv_sec)
+            + 1e-9*(double)(stop.tv_nsec - b->start.tv_nsec);
+    b->counts.reads      = bench_counts.reads      - b->counts.reads;
+    b->counts.progs      = bench_counts.progs      - b->counts.progs;
+    b->counts.erases     = bench_counts.erases     - b->counts.erases;
+    b->counts.read_bytes = bench_counts.read_bytes - b->counts.read_bytes;
+    b->counts.prog_bytes = bench_counts.prog_bytes - b->counts.prog_bytes;
+    b->ops = ops;
+    b->bytes = bytes;
+
+    // simulated time includes any erase still running in the background
+    BENCH_CHECK(lfs2_testbd_sync(b->cfg));
+    b->sim_time = lfs2_testbd_gettime(b->cfg);
+    for (uint8_t op = 0; op < 3; op++) {
+        BENCH_CHECK(lfs2_testbd_getlatency(b->cfg, op, &b->latency[op]));
+    }
+}
+
+
+/// Reporting ///
+struct bench_field {
+    const char *name;
+    bool quoted;
+    char value[32];
+};
+
+static struct bench_field bench_fields[32];
+static size_t bench_field_count;
+
+static void bench_field(const char *name, bool quoted, const char *fmt, ...) {
+    assert(bench_field_count < BENCH_COUNT(bench_fields));
+    struct bench_field *f = &bench_fields[bench_field_count++];
+    f->name = name;
+    f->quoted = quoted;
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(f->value, sizeof(f->value), fmt, va);
+    va_end(va);
+}
+
+static double bench_rate(double count, double seconds) {
+    return (seconds > 0) ? count/seconds : 0;
+}
+
+static unsigned long long bench_percentile(
+        const struct lfs2_testbd_latency *l, double p) {
+    // upper bound of the bucket containing the percentile
+    uint32_t seen = 0;
+    for (uint32_t i = 0; i < LFS2_TESTBD_LATENCY_BUCKETS; i++) {
+        seen += l->buckets[i];
+        if (seen >= p*l->count && seen > 0) {
+            unsigned long long bound = (i == 0) ? 0 : (1ULL << i) - 1;
+            return (bound < l->max) ? bound : l->max;
+        }
+    }
+    return 0;
+}
+
+static void bench_report(const struct bench *b) {
+    double sim_seconds = 1e-9*(double)b->sim_time;
+    bench_field_count = 0;
+    bench_field("workload", true, "%s", b->name);
+    bench_field("profile", true, "%s", bench_profile);
+    bench_field("block_size", false, "%"PRIu32, b->cfg->block_size);
+    bench_field("cache_size", false, "%"PRIu32, b->cfg->cache_size);
+    bench_field("lookahead_size", false, "%"PRIu32, b->cfg->lookahead_size);
+    bench_field("ops", false, "%llu", (unsigned long long)b->ops);
+    bench_field("bytes", false, "%llu", (unsigned long long)b->bytes);
+    bench_field("seconds", false, "%.6f", b->seconds);
+    bench_field("ops_per_s", false, "%.1f",
+            bench_rate(b->ops, b->seconds));
+    bench_field("bytes_per_s", false, "%.1f",
+            bench_rate(b->bytes, b->seconds));
+    bench_field("reads", false, "%llu",
+            (unsigned long long)b->counts.reads);
+    bench_field("progs", false, "%llu",
+            (unsigned long long)b->counts.progs);
+    bench_field("erases", false, "%llu",
+            (unsigned long long)b->counts.erases);
+    bench_field("read_bytes", false, "%llu",
+            (unsigned long long)b->counts.read_bytes);
+    bench_field("prog_bytes", false, "%llu",
+            (unsigned long long)b->counts.prog_bytes);
+    bench_field("sim_seconds", false, "%.6f", sim_seconds);
+    bench_field("sim_ops_per_s", false, "%.1f",
+            bench_rate(b->ops, sim_seconds));
+    bench_field("sim_bytes_per_s", false, "%.1f",
+            bench_rate(b->bytes, sim_seconds));
+
+    static const char *const names[3][3] = {
+        {"read_avg_ns",  "read_p99_ns",  "read_max_ns"},
+        {"prog_avg_ns",  "prog_p99_ns",  "prog_max_ns"},
+        {"erase_avg_ns", "erase_p99_ns", "erase_max_ns"},
+    };
+    for (int op = 0; op < 3; op++) {
+        const struct lfs2_testbd_latency *l = &b->latency[op];
+        bench_field(names[op][0], false, "%llu", (unsigned long long)
+                (l->count ? l->total / l->count : 0));
+        bench_field(names[op][1], false, "%llu", bench_percentile(l, 0.99));
+        bench_field(names[op][2], false, "%llu", (unsigned long long)l->max);
+    }
+
+    if (bench_json) {
+        fprintf(bench_out, "%s{", bench_first ? "[\n    " : ",\n    ");
+        for (size_t i = 0; i < bench_field_count; i++) {
+            const struct bench_field *f = &bench_fields[i];
+            fprintf(bench_out, "%s\"%s\": %s%s%s", (i == 0) ? "" : ", ",
+                    f->name, f->quoted ? "\"" : "", f->value,
+                    f->quoted ? "\"" : "");
+        }
+        fprintf(bench_out, "}");
+    } else {
+        if (bench_first) {
+            for (size_t i = 0; i < bench_field_count; i++) {
+                fprintf(bench_out, "%s%s", (i == 0) ? "" : ",",
+                        bench_fields[i].name);
+            }
+            fprintf(bench_out, "\n");
+        }
+        for (size_t i = 0; i < bench_field_count; i++) {
+            fprintf(bench_out, "%s%s", (i == 0) ? "" : ",",
+                    bench_fields[i].value);
+        }
+        fprintf(bench_out, "\n");
+    }
+    bench_first = false;
+}
+
+static uint32_t bench_prng(uint32_t *state) {
+    // xorshift32, we just want repeatable offsets
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+
+/// Workloads ///
+#define BENCH_FILE_SIZE (LFS2_BENCH_DISK_SIZE/4)
+#define BENCH_CHUNK_SIZE 512
+
+static uint8_t bench_buffer[4096];
+
+static void bench_write_file(lfs2_t *lfs2, const char *path, lfs2_size_t size,
+        uint64_t *ops) {
+    lfs2_file_t file;
+    BENCH_CHECK(lfs2_file_open(lfs2, &file, path,
+            LFS2_O_WRONLY | LFS2_O_CREAT | LFS2_O_TRUNC));
+    for (lfs2_size_t i = 0; i < size; i += BENCH_CHUNK_SIZE) {
+        memset(bench_buffer, (uint8_t)(i / BENCH_CHUNK_SIZE),
+                BENCH_CHUNK_SIZE);
+        BENCH_CHECK(lfs2_file_write(lfs2, &file,
+                bench_buffer, BENCH_CHUNK_SIZE));
+        *ops += 1;
+    }
+    BENCH_CHECK(lfs2_file_close(lfs2, &file));
+}
+
+static void bench_seqwrite(lfs2_t *lfs2, struct bench *b) {
+    uint64_t ops = 0;
+    bench_start(b);
+    bench_write_file(lfs2, "seq", BENCH_FILE_SIZE, &ops);
+    bench_stop(b, ops, BENCH_FILE_SIZE);
+}
+
+static void bench_seqread(lfs2_t *lfs2, struct bench *b) {
+    uint64_t ops = 0;
+    bench_write_file(lfs2, "seq", BENCH_FILE_SIZE, &ops);
+
+    ops = 0;
+    bench_start(b);
+    lfs2_file_t file;
+    BENCH_CHECK(lfs2_file_open(lfs2, &file, "seq", LFS2_O_RDONLY));
+    for (lfs2_size_t i = 0; i < BENCH_FILE_SIZE; i += BENCH_CHUNK_SIZE) {
+        BENCH_CHECK(lfs2_file_read(lfs2, &file,
+                bench_buffer, BENCH_CHUNK_SIZE));
+        ops += 1;
+    }
+    BENCH_CHECK(lfs2_file_close(lfs2, &file));
+    bench_stop(b, ops, BENCH_FILE_SIZE);
+}
+
+static void bench_randread(lfs2_t *lfs2, struct bench *b) {
+    uint64_t ops = 0;
+    bench_write_file(lfs2, "seq", BENCH_FILE_SIZE, &ops);
+
+    const lfs2_size_t count = 256;
+    uint32_t prng = 42;
+    bench_start(b);
+    lfs2_file_t file;
+    BENCH_CHECK(lfs2_file_open(lfs2, &file, "seq", LFS2_O_RDONLY));
+    for (lfs2_size_t i = 0; i < count; i++) {
+        lfs2_off_t off = (bench_prng(&prng) % (BENCH_FILE_SIZE/4096)) * 4096;
+        BENCH_CHECK(lfs2_file_seek(lfs2, &file, off, LFS2_SEEK_SET));
+        BENCH_CHECK(lfs2_file_read(lfs2, &file, bench_buffer, 4096));
+    }
+    BENCH_CHECK(lfs2_file_close(lfs2, &file));
+    bench_stop(b, count, count*4096);
+}
+
+static void bench_smallfiles(lfs2_t *lfs2, struct bench *b) {
+    const lfs2_size_t count = 100;
+    char path[32];
+    memset(bench_buffer, 's', 64);
+
+    bench_start(b);
+    for (lfs2_size_t i = 0; i < count; i++) {
+        sprintf(path, "small%03"PRIu32, i);
+        lfs2_file_t file;
+        BENCH_CHECK(lfs2_file_open(lfs2, &file, path,
+                LFS2_O_WRONLY | LFS2_O_CREAT | LFS2_O_EXCL));
+        BENCH_CHECK(lfs2_file_write(lfs2, &file, bench_buffer, 64));
+        BENCH_CHECK(lfs2_file_close(lfs2, &file));
+    }
+    for (lfs2_size_t i = 0; i < count; i++) {
+        sprintf(path, "small%03"PRIu32, i);
+        BENCH_CHECK(lfs2_remove(lfs2, path));
+    }
+    bench_stop(b, 2*count, count*64);
+}
+
+static void bench_deeppath(lfs2_t *lfs2, struct bench *b) {
+    const lfs2_size_t depth = 8;
+    const lfs2_size_t count = 200;
+    char path[128] = "";
+    for (lfs2_size_t i = 0; i < depth; i++) {
+        sprintf(path + strlen(path), "/dir%"PRIu32, i);
+        BENCH_CHECK(lfs2_mkdir(lfs2, path));
+        // give each level some siblings to search past
+        for (lfs2_size_t j = 0; j < 4; j++) {
+            char sibling[160];
+            sprintf(sibling, "%s/sibling%"PRIu32, path, j);
+            BENCH_CHECK(lfs2_mkdir(lfs2, sibling));
+        }
+    }
+
+    bench_start(b);
+    for (lfs2_size_t i = 0; i < count; i++) {
+        struct lfs2_info info;
+        BENCH_CHECK(lfs2_stat(lfs2, path, &info));
+    }
+    bench_stop(b, count, 0);
+}
+
+static void bench_mount(lfs2_t *lfs2, struct bench *b) {
+    const lfs2_size_t count = 100;
+    uint64_t ops = 0;
+    bench_write_file(lfs2, "seq", BENCH_FILE_SIZE/4, &ops);
+    BENCH_CHECK(lfs2_unmount(lfs2));
+
+    bench_start(b);
+    for (lfs2_size_t i = 0; i < count; i++) {
+        BENCH_CHECK(lfs2_mount(lfs2, b->cfg));
+        // the first allocation scans the filesystem
+        BENCH_CHECK(lfs2_fs_size(lfs2));
+        if (i != count-1) {
+            BENCH_CHECK(lfs2_unmount(lfs2));
+        }
+    }
+    bench_stop(b, count, 0);
+}
+
+static void bench_fill(lfs2_t *lfs2, struct bench *b) {
+    uint64_t ops = 0;
+    uint64_t bytes = 0;
+    memset(bench_buffer, 'f', BENCH_CHUNK_SIZE);
+
+    bench_start(b);
+    lfs2_file_t file;
+    BENCH_CHECK(lfs2_file_open(lfs2, &file, "fill",
+            LFS2_O_WRONLY | LFS2_O_CREAT));
+    while (true) {
+        lfs2_ssize_t res = lfs2_file_write(lfs2, &file,
+                bench_buffer, BENCH_CHUNK_SIZE);
+        if (res == LFS2_ERR_NOSPC) {
+            break;
+        }
+        BENCH_CHECK(res);
+        ops += 1;
+        bytes += res;
+    }
+    int err = lfs2_file_close(lfs2, &file);
+    if (err != LFS2_ERR_NOSPC) {
+        BENCH_CHECK(err);
+    }
+    bench_stop(b, ops, bytes);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(lfs2_t *lfs2, struct bench *b);
+} bench_workloads[] = {
+    {"seqwrite",   bench_seqwrite},
+    {"seqread",    bench_seqread},
+    {"randread",   bench_randread},
+    {"smallfiles", bench_smallfiles},
+    {"deeppath",   bench_deeppath},
+    {"mount",      bench_mount},
+    {"fill",       bench_fill},
+};
+
+
+/// Runner ///
+static void bench_run(const char *name,
+        void (*run)(lfs2_t *lfs2, struct bench *b),
+        lfs2_size_t block_size, lfs2_size_t cache_size,
+        lfs2_size_t lookahead_size) {
+    lfs2_testbd_t bd;
+    const struct lfs2_config cfg = {
+        .context        = &bd,
+        .read           = bench_read,
+        .prog           = bench_prog,
+        .erase          = bench_erase,
+        .sync           = lfs2_testbd_sync,
+        .read_size      = LFS2_BENCH_READ_SIZE,
+        .prog_size      = LFS2_BENCH_PROG_SIZE,
+        .block_size     = block_size,
+        .block_count    = LFS2_BENCH_DISK_SIZE / block_size,
+        .block_cycles   = -1,
+        .cache_size     = cache_size,
+        .lookahead_size = lookahead_size,
+    };
+    const struct lfs2_testbd_config bdcfg = {
+        .erase_value    = 0xff,
+        .timing         = bench_timing,
+    };
+
+    BENCH_CHECK(lfs2_testbd_createcfg(&cfg, NULL, &bdcfg));
+    lfs2_t lfs2;
+    BENCH_CHECK(lfs2_format(&lfs2, &cfg));
+    BENCH_CHECK(lfs2_mount(&lfs2, &cfg));
+
+    struct bench b = {.name = name, .cfg = &cfg};
+    run(&lfs2, &b);
+    bench_report(&b);
+
+    BENCH_CHECK(lfs2_unmount(&lfs2));
+    BENCH_CHECK(lfs2_testbd_destroy(&cfg));
+}
+
+static void bench_usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-j] [-o file] [-p profile] [workload...]\n",
+            argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -j          report JSON instead of CSV\n");
+    fprintf(stderr, "  -o file     write the report to file "
+            "instead of stdout\n");
+    fprintf(stderr, "  -p profile  simulate device timing, one of "
+            "nor, nand or sd\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "workloads:");
+    for (size_t i = 0; i < BENCH_COUNT(bench_workloads); i++) {
+        fprintf(stderr, " %s", bench_workloads[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+    // options come first, anything else is a workload name
+    bench_out = stdout;
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; first++) {
+        if (strcmp(argv[first], "-j") == 0) {
+            bench_json = true;
+        } else if (strcmp(argv[first], "-o") == 0 && first+1 < argc) {
+            first += 1;
+            bench_out = fopen(argv[first], "w");
+            if (!bench_out) {
+                perror(argv[first]);
+                return 1;
+            }
+        } else if (strcmp(argv[first], "-p") == 0 && first+1 < argc) {
+            first += 1;
+            bench_profile = argv[first];
+            if (strcmp(bench_profile, "nor") == 0) {
+                bench_timing = &lfs2_testbd_nor_timing;
+            } else if (strcmp(bench_profile, "nand") == 0) {
+                bench_timing = &lfs2_testbd_nand_timing;
+            } else if (strcmp(bench_profile, "sd") == 0) {
+                bench_timing = &lfs2_testbd_sd_timing;
+            } else {
+                bench_usage(argv[0]);
+                return 1;
+            }
+        } else {
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    for (int i = first; i < argc; i++) {
+        bool found = false;
+        for (size_t j = 0; j < BENCH_COUNT(bench_workloads); j++) {
+            found = found || strcmp(argv[i], bench_workloads[j].name) == 0;
+        }
+        if (!found) {
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    for (size_t w = 0; w < BENCH_COUNT(bench_workloads); w++) {
+        bool selected = (first == argc);
+        for (int i = first; i < argc; i++) {
+            selected = selected
+                    || strcmp(argv[i], bench_workloads[w].name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+
+        for (size_t i = 0; i < BENCH_COUNT(bench_block_sizes); i++) {
+            for (size_t j = 0; j < BENCH_COUNT(bench_cache_sizes); j++) {
+                for (size_t k = 0;
+                        k < BENCH_COUNT(bench_lookahead_sizes); k++) {
+                    if (bench_cache_sizes[j] > bench_block_sizes[i]) {
+                        continue;
+                    }
+
+                    bench_run(bench_workloads[w].name, bench_workloads[w].run,
+                            bench_block_sizes[i], bench_cache_sizes[j],
+                            bench_lookahead_sizes[k]);
+                }
+            }
+        }
+    }
+
+    if (bench_json && !bench_first) {
+        fprintf(bench_out, "\n]\n");
+    }
+    if (bench_out != stdout) {
+        fclose(bench_out);
+    }
+    return 0;
+}
@@ -20,10 +20,24 @@ static inline void lfs2_cache_drop(lfs2_t *lfs2, lfs2_cache_t *rcache) {
 
 static inline void lfs2_cache_zero(lfs2_t *lfs2, lfs2_cache_t *pcache) {
     // zero to avoid information leak
-    memset(pcache->buffer, 0xff, lfs2->cfg->cache_size);
+    (void)lfs2;
+    memset(pcache->buffer, 0xff, pcache->capacity);
     pcache->block = LFS2_BLOCK_NULL;
 }
 
+// operation counts, only if the config asks for them
+#define LFS2_STAT(lfs2, name, n) do { \
+        if ((lfs2)->cfg->stats) { \
+            (lfs2)->cfg->stats->name += (n); \
+        } \
+    } while (0)
+
+static inline lfs2_size_t lfs2_cache_filesize(lfs2_t *lfs2,
+        const lfs2_cache_t *cache) {
+    // file caches must be able to hold an entire inline file
+    return lfs2_max(cache->capacity, lfs2->inline_max);
+}
+
 static int lfs2_bd_read(lfs2_t *lfs2,
         const lfs2_cache_t *pcache, lfs2_cache_t *rcache, lfs2_size_t hint,
         lfs2_block_t block, lfs2_off_t off,
@@ -43,6 +57,7 @@ static int lfs2_bd_read(lfs2_t *lfs2,
                 // is already in pcache?
                 diff = lfs2_min(diff, pcache->size - (off-pcache->off));
                 memcpy(data, &pcache->buffer[off-pcache->off], diff);
+                LFS2_STAT(lfs2, pcache_hits, 1);
 
                 data += diff;
                 off += diff;
@@ -60,6 +75,7 @@ static int lfs2_bd_read(lfs2_t *lfs2,
                 // is already in rcache?
                 diff = lfs2_min(diff, rcache->size - (off-rcache->off));
                 memcpy(data, &rcache->buffer[off-rcache->off], diff);
+                LFS2_STAT(lfs2, rcache_hits, 1);
 
                 data += diff;
                 off += diff;
@@ -76,6 +92,9 @@ static int lfs2_bd_read(lfs2_t *lfs2,
             // bypass cache?
             diff = lfs2_aligndown(diff, lfs2->cfg->read_size);
             int err = lfs2->cfg->read(lfs2->cfg, block, off, data, diff);
+            LFS2_STAT(lfs2, rcache_bypasses, 1);
+            LFS2_STAT(lfs2, reads, 1);
+            LFS2_STAT(lfs2, read_bytes, diff);
             if (err) {
                 return err;
             }
@@ -95,9 +114,12 @@ static int lfs2_bd_read(lfs2_t *lfs2,
                     lfs2_alignup(off+hint, lfs2->cfg->read_size),
                     lfs2->cfg->block_size)
                 - rcache->off,
-                lfs2->cfg->cache_size);
+                rcache->capacity);
         int err = lfs2->cfg->read(lfs2->cfg, rcache->block,
                 rcache->off, rcache->buffer, rcache->size);
+        LFS2_STAT(lfs2, rcache_misses, 1);
+        LFS2_STAT(lfs2, reads, 1);
+        LFS2_STAT(lfs2, read_bytes, rcache->size);
         LFS2_ASSERT(err <= 0);
         if (err) {
             return err;
@@ -143,6 +165,8 @@ static int lfs2_bd_flush(lfs2_t *lfs2,
         lfs2_size_t diff = lfs2_alignup(pcache->size, lfs2->cfg->prog_size);
         int err = lfs2->cfg->prog(lfs2->cfg, pcache->block,
                 pcache->off, pcache->buffer, diff);
+        LFS2_STAT(lfs2, progs, 1);
+        LFS2_STAT(lfs2, prog_bytes, diff);
         LFS2_ASSERT(err <= 0);
         if (err) {
             return err;
@@ -179,6 +203,7 @@ static int lfs2_bd_sync(lfs2_t *lfs2,
     }
 
     err = lfs2->cfg->sync(lfs2->cfg);
+    LFS2_STAT(lfs2, syncs, 1);
     LFS2_ASSERT(err <= 0);
     return err;
 }
@@ -190,14 +215,17 @@ static int lfs2_bd_prog(lfs2_t *lfs2,
     const uint8_t *data = buffer;
     LFS2_ASSERT(block == LFS2_BLOCK_INLINE || block < lfs2->cfg->block_count);
     LFS2_ASSERT(off + size <= lfs2->cfg->block_size);
+    // inline files live in their file's cache, which may be larger
+    lfs2_size_t csize = (block == LFS2_BLOCK_INLINE)
+            ? lfs2_cache_filesize(lfs2, pcache)
+            : pcache->capacity;
 
     while (size > 0) {
         if (block == pcache->block &&
                 off >= pcache->off &&
-                off < pcache->off + lfs2->cfg->cache_size) {
+                off < pcache->off + csize) {
             // already fits in pcache?
-            lfs2_size_t diff = lfs2_min(size,
-                    lfs2->cfg->cache_size - (off-pcache->off));
+            lfs2_size_t diff = lfs2_min(size, csize - (off-pcache->off));
             memcpy(&pcache->buffer[off-pcache->off], data, diff);
 
             data += diff;
@@ -205,8 +233,10 @@ static int lfs2_bd_prog(lfs2_t *lfs2,
             size -= diff;
 
             pcache->size = lfs2_max(pcache->size, off - pcache->off);
-            if (pcache->size == lfs2->cfg->cache_size) {
-                // eagerly flush out pcache if we fill up
+            if (pcache->size == csize ||
+                    pcache->off + pcache->size == lfs2->cfg->block_size) {
+                // eagerly flush out pcache if we fill up, caches of different
+                // sizes may not line up with the end of the block
                 int err = lfs2_bd_flush(lfs2, pcache, rcache, validate);
                 if (err) {
                     return err;
@@ -229,9 +259,37 @@ static int lfs2_bd_prog(lfs2_t *lfs2,
     return 0;
 }
 
+// erase counts are kept per region, region r covers the blocks from
+// ceil(r*block_count/wear_regions) up to the start of the next region
+static inline lfs2_size_t lfs2_wear_region(lfs2_t *lfs2, lfs2_block_t block) {
+    return ((uint64_t)block * lfs2->cfg->wear_regions)
+            / lfs2->cfg->block_count;
+}
+
+static inline lfs2_block_t lfs2_wear_start(lfs2_t *lfs2, lfs2_size_t region) {
+    return ((uint64_t)region * lfs2->cfg->block_count
+            + lfs2->cfg->wear_regions-1) / lfs2->cfg->wear_regions;
+}
+
+// average erases per block in a region
+static inline uint32_t lfs2_wear_avg(lfs2_t *lfs2, lfs2_size_t region) {
+    return lfs2_fromle32(lfs2->wear[region]) / (
+            lfs2_wear_start(lfs2, region+1) - lfs2_wear_start(lfs2, region));
+}
+
+static inline void lfs2_wear_add(lfs2_t *lfs2,
+        lfs2_block_t block, uint32_t erases) {
+    uint32_t *count = &lfs2->wear[lfs2_wear_region(lfs2, block)];
+    *count = lfs2_tole32(lfs2_fromle32(*count) + erases);
+}
+
 static int lfs2_bd_erase(lfs2_t *lfs2, lfs2_block_t block) {
     LFS2_ASSERT(block < lfs2->cfg->block_count);
     int err = lfs2->cfg->erase(lfs2->cfg, block);
+    LFS2_STAT(lfs2, erases, 1);
+    if (lfs2->wear) {
+        lfs2_wear_add(lfs2, block, 1);
+    }
     LFS2_ASSERT(err <= 0);
     return err;
 }
@@ -322,12 +380,7 @@ static inline lfs2_size_t lfs2_tag_dsize(lfs2_tag_t tag) {
     return sizeof(tag) + lfs2_tag_size(tag + lfs2_tag_isdelete(tag));
 }
 
-// operations on attributes in attribute lists
-struct lfs2_mattr {
-    lfs2_tag_t tag;
-    const void *buffer;
-};
-
+// operations on attributes in attribute lists, see struct lfs2_mattr
 struct lfs2_diskoff {
     lfs2_block_t block;
     lfs2_off_t off;
@@ -433,6 +486,8 @@ int lfs2_fs_traverseraw(lfs2_t *lfs2,
         int (*cb)(void *data, lfs2_block_t block), void *data,
         bool includeorphans);
 static int lfs2_fs_forceconsistency(lfs2_t *lfs2);
+static int lfs2_fs_savebad(lfs2_t *lfs2);
+static int lfs2_fs_upgrade(lfs2_t *lfs2);
 static int lfs2_deinit(lfs2_t *lfs2);
 #ifdef LFS2_MIGRATE
 static int lfs21_traverse(lfs2_t *lfs2,
@@ -452,6 +507,26 @@ static int lfs2_alloc_lookahead(void *p, lfs2_block_t block) {
     return 0;
 }
 
+// remember a block that failed to erase or program, it is never allocated
+// again and is saved in the superblock on the next write
+static void lfs2_alloc_bad(lfs2_t *lfs2, lfs2_block_t block) {
+    for (lfs2_size_t i = 0; i < lfs2->bad.count; i++) {
+        if (lfs2->bad.blocks[i] == block) {
+            return;
+        }
+    }
+
+    if (lfs2->bad.count == LFS2_BADBLOCK_MAX) {
+        LFS2_DEBUG("Too many bad blocks to remember 0x%"PRIx32, block);
+        return;
+    }
+
+    lfs2->bad.blocks[lfs2->bad.count] = block;
+    lfs2->bad.count += 1;
+    lfs2->bad.dirty = true;
+    lfs2_alloc_lookahead(lfs2, block);
+}
+
 static void lfs2_alloc_ack(lfs2_t *lfs2) {
     lfs2->free.ack = lfs2->cfg->block_count;
 }
@@ -465,6 +540,49 @@ static void lfs2_alloc_reset(lfs2_t *lfs2) {
     lfs2_alloc_ack(lfs2);
 }
 
+// move the lookahead window past the blocks we have looked at and find
+// which of the next blocks are free
+static int lfs2_alloc_scan(lfs2_t *lfs2) {
+    lfs2->free.off = (lfs2->free.off + lfs2->free.size)
+            % lfs2->cfg->block_count;
+    lfs2->free.size = lfs2_min(8*lfs2->cfg->lookahead_size, lfs2->free.ack);
+    lfs2->free.i = 0;
+
+    // find mask of free blocks from tree
+    memset(lfs2->free.buffer, 0, lfs2->cfg->lookahead_size);
+    int err = lfs2_fs_traverseraw(lfs2, lfs2_alloc_lookahead, lfs2, true);
+    if (err) {
+        lfs2_alloc_reset(lfs2);
+        return err;
+    }
+
+    // known bad blocks are never free
+    for (lfs2_size_t i = 0; i < lfs2->bad.count; i++) {
+        lfs2_alloc_lookahead(lfs2, lfs2->bad.blocks[i]);
+    }
+
+    return 0;
+}
+
+// out of free blocks, take one back from a run an extent file set aside to
+// grow into, these are only a hint unlike blocks from lfs2_file_reserve
+static int lfs2_alloc_steal(lfs2_t *lfs2, lfs2_block_t *block) {
+    for (lfs2_file_t *f = (lfs2_file_t*)lfs2->mlist; f; f = f->next) {
+        if (f->type == LFS2_TYPE_REG && !(f->flags & LFS2_F_ERASED) &&
+                f->reserve.count > 0) {
+            f->reserve.count -= 1;
+            *block = f->reserve.block + f->reserve.count;
+            lfs2->allocs += 1;
+            LFS2_STAT(lfs2, allocs, 1);
+            return 0;
+        }
+    }
+
+    LFS2_ERROR("No more free space %"PRIu32,
+            lfs2->free.i + lfs2->free.off);
+    return LFS2_ERR_NOSPC;
+}
+
 static int lfs2_alloc(lfs2_t *lfs2, lfs2_block_t *block) {
     while (true) {
         while (lfs2->free.i != lfs2->free.size) {
@@ -475,6 +593,7 @@ static int lfs2_alloc(lfs2_t *lfs2, lfs2_block_t *block) {
             if (!(lfs2->free.buffer[off / 32] & (1U << (off % 32)))) {
                 // found a free block
                 *block = (lfs2->free.off + off) % lfs2->cfg->block_count;
+                lfs2->allocs += 1;
 
                 // eagerly find next off so an alloc ack can
                 // discredit old lookahead blocks
@@ -485,32 +604,148 @@ static int lfs2_alloc(lfs2_t *lfs2, lfs2_block_t *block) {
                     lfs2->free.ack -= 1;
                 }
 
+                LFS2_STAT(lfs2, allocs, 1);
                 return 0;
             }
         }
 
         // check if we have looked at all blocks since last ack
         if (lfs2->free.ack == 0) {
-            LFS2_ERROR("No more free space %"PRIu32,
-                    lfs2->free.i + lfs2->free.off);
-            return LFS2_ERR_NOSPC;
+            return lfs2_alloc_steal(lfs2, block);
         }
 
-        lfs2->free.off = (lfs2->free.off + lfs2->free.size)
-                % lfs2->cfg->block_count;
-        lfs2->free.size = lfs2_min(8*lfs2->cfg->lookahead_size, lfs2->free.ack);
-        lfs2->free.i = 0;
+        int err = lfs2_alloc_scan(lfs2);
+        if (err) {
+            return err;
+        }
+    }
+}
 
-        // find mask of free blocks from tree
-        memset(lfs2->free.buffer, 0, lfs2->cfg->lookahead_size);
-        int err = lfs2_fs_traverseraw(lfs2, lfs2_alloc_lookahead, lfs2, true);
+// Allocate a run of up to count consecutive free blocks. Takes the first
+// run of count blocks after the lookahead, or if there is none on the disk,
+// the longest run found. Runs never wrap around the end of the disk.
+static int lfs2_alloc_run(lfs2_t *lfs2, lfs2_block_t count,
+        lfs2_block_t *block, lfs2_block_t *size) {
+    lfs2_block_t best = LFS2_BLOCK_NULL;
+    lfs2_block_t bestsize = 0;
+    lfs2_block_t run = 0;
+    while (true) {
+        while (lfs2->free.i != lfs2->free.size) {
+            lfs2_block_t off = lfs2->free.i;
+            lfs2->free.i += 1;
+            lfs2->free.ack -= 1;
+
+            lfs2_block_t b = (lfs2->free.off + off) % lfs2->cfg->block_count;
+            if (b == 0 ||
+                    (lfs2->free.buffer[off / 32] & (1U << (off % 32)))) {
+                run = 0;
+            }
+
+            if (!(lfs2->free.buffer[off / 32] & (1U << (off % 32)))) {
+                run += 1;
+                if (run > bestsize) {
+                    best = b+1 - run;
+                    bestsize = run;
+                }
+
+                if (run == count) {
+                    break;
+                }
+            }
+        }
+
+        // found a full run, or looked at all blocks since last ack?
+        if (bestsize == count || lfs2->free.ack == 0) {
+            if (bestsize == 0) {
+                *size = 1;
+                return lfs2_alloc_steal(lfs2, block);
+            }
+
+            // blocks in the run are behind the lookahead, so they won't be
+            // handed out again until the caller is tracking them, they are
+            // only counted as allocated when the caller takes them
+            *block = best;
+            *size = bestsize;
+            return 0;
+        }
+
+        int err = lfs2_alloc_scan(lfs2);
         if (err) {
-            lfs2_alloc_reset(lfs2);
             return err;
         }
     }
 }
 
+// Allocate up to count free blocks starting at block, if the lookahead
+// knows they are free, so a run can grow in place. Blocks before the
+// lookahead may have been handed out already, so only blocks after it count
+static int lfs2_alloc_after(lfs2_t *lfs2, lfs2_block_t block,
+        lfs2_block_t count, lfs2_block_t *size) {
+    *size = 0;
+    while (*size < count && block + *size < lfs2->cfg->block_count) {
+        lfs2_block_t off = (block + *size
+                + lfs2->cfg->block_count - lfs2->free.off)
+                % lfs2->cfg->block_count;
+        if (off >= lfs2->free.size) {
+            // past the lookahead, if it needs a new scan anyway we can
+            // start it here, otherwise we don't know if the block is free
+            if (lfs2->free.i != lfs2->free.size || lfs2->free.ack == 0) {
+                break;
+            }
+
+            lfs2->free.off = block + *size;
+            lfs2->free.size = 0;
+            int err = lfs2_alloc_scan(lfs2);
+            if (err) {
+                return err;
+            }
+            continue;
+        }
+
+        if (off < lfs2->free.i ||
+                (lfs2->free.buffer[off / 32] & (1U << (off % 32)))) {
+            break;
+        }
+
+        if (off == lfs2->free.i) {
+            // next in line, move the lookahead past it
+            lfs2->free.i += 1;
+            lfs2->free.ack -= 1;
+        } else {
+            // otherwise mark it as in use so it isn't handed out again
+            lfs2->free.buffer[off / 32] |= 1U << (off % 32);
+        }
+        *size += 1;
+    }
+
+    return 0;
+}
+
+// Give back blocks that were set aside but never used, blocks the
+// lookahead hasn't reached yet, or just moved past, can be handed out
+// again right away
+static void lfs2_alloc_release(lfs2_t *lfs2, lfs2_block_t block,
+        lfs2_block_t count) {
+    if (count == 0) {
+        return;
+    }
+
+    lfs2_block_t off = (block + lfs2->cfg->block_count - lfs2->free.off)
+            % lfs2->cfg->block_count;
+    if (off + count == lfs2->free.i) {
+        lfs2->free.i -= count;
+        lfs2->free.ack = lfs2_min(lfs2->free.ack + count,
+                lfs2->cfg->block_count);
+        return;
+    }
+
+    for (lfs2_block_t i = 0; i < count; i++, off++) {
+        if (off >= lfs2->free.i && off < lfs2->free.size) {
+            lfs2->free.buffer[off / 32] &= ~(1U << (off % 32));
+        }
+    }
+}
+
 /// Metadata pair and directory operations ///
 static lfs2_stag_t lfs2_dir_getslice(lfs2_t *lfs2, const lfs2_mdir_t *dir,
         lfs2_tag_t gmask, lfs2_tag_t gtag,
@@ -599,6 +834,7 @@ static int lfs2_dir_getread(lfs2_t *lfs2, const lfs2_mdir_t *dir,
                 // is already in pcache?
                 diff = lfs2_min(diff, pcache->size - (off-pcache->off));
                 memcpy(data, &pcache->buffer[off-pcache->off], diff);
+                LFS2_STAT(lfs2, pcache_hits, 1);
 
                 data += diff;
                 off += diff;
@@ -631,7 +867,7 @@ static int lfs2_dir_getread(lfs2_t *lfs2, const lfs2_mdir_t *dir,
         rcache->block = LFS2_BLOCK_INLINE;
         rcache->off = lfs2_aligndown(off, lfs2->cfg->read_size);
         rcache->size = lfs2_min(lfs2_alignup(off+hint, lfs2->cfg->read_size),
-                lfs2->cfg->cache_size);
+                rcache->capacity);
         int err = lfs2_dir_getslice(lfs2, dir, gmask, gtag,
                 rcache->off, rcache->buffer, rcache->size);
         if (err < 0) {
@@ -1025,6 +1261,19 @@ static int lfs2_dir_getgstate(lfs2_t *lfs2, const lfs2_mdir_t *dir,
     return 0;
 }
 
+static bool lfs2_struct_isvalid(lfs2_t *lfs2, lfs2_tag_t tag) {
+    // extent and ring structs were added in v2.1, an older image
+    // claiming to have them is corrupt
+    if (lfs2_tag_type3(tag) == LFS2_TYPE_EXTSTRUCT ||
+            lfs2_tag_type3(tag) == LFS2_TYPE_RINGSTRUCT) {
+        return (0xffff & lfs2->disk_version) >= 1;
+    }
+
+    return lfs2_tag_type3(tag) == LFS2_TYPE_DIRSTRUCT ||
+            lfs2_tag_type3(tag) == LFS2_TYPE_INLINESTRUCT ||
+            lfs2_tag_type3(tag) == LFS2_TYPE_CTZSTRUCT;
+}
+
 static int lfs2_dir_getinfo(lfs2_t *lfs2, lfs2_mdir_t *dir,
         uint16_t id, struct lfs2_info *info) {
     if (id == 0x3ff) {
@@ -1050,10 +1299,20 @@ static int lfs2_dir_getinfo(lfs2_t *lfs2, lfs2_mdir_t *dir,
     }
     lfs2_ctz_fromle32(&ctz);
 
+    if (!lfs2_struct_isvalid(lfs2, tag)) {
+        LFS2_ERROR("Unsupported struct 0x%"PRIx16" for id %"PRIu16,
+                lfs2_tag_type3(tag), id);
+        return LFS2_ERR_CORRUPT;
+    }
+
     if (lfs2_tag_type3(tag) == LFS2_TYPE_CTZSTRUCT) {
         info->size = ctz.size;
     } else if (lfs2_tag_type3(tag) == LFS2_TYPE_INLINESTRUCT) {
         info->size = lfs2_tag_size(tag);
+    } else if (lfs2_tag_type3(tag) == LFS2_TYPE_EXTSTRUCT ||
+            lfs2_tag_type3(tag) == LFS2_TYPE_RINGSTRUCT) {
+        // extent lists lead with the file size
+        info->size = ctz.head;
     }
 
     return 0;
@@ -1089,18 +1348,21 @@ static int lfs2_dir_find_match(void *data,
     return LFS2_CMP_EQ;
 }
 
-static lfs2_stag_t lfs2_dir_find(lfs2_t *lfs2, lfs2_mdir_t *dir,
-        const char **path, uint16_t *id) {
+static lfs2_stag_t lfs2_dir_findat(lfs2_t *lfs2, lfs2_mdir_t *dir,
+        const lfs2_block_t base[2], const char **path, uint16_t *id) {
     // we reduce path to a single name if we can find it
     const char *name = *path;
     if (id) {
         *id = 0x3ff;
     }
 
-    // default to root dir
+    // default to root dir, relative paths start from base if we have one
+    if (!base || name[0] == '/' || lfs2_pair_cmp(base, lfs2->root) == 0) {
+        base = NULL;
+    }
     lfs2_stag_t tag = LFS2_MKTAG(LFS2_TYPE_DIR, 0x3ff, 0);
-    dir->tail[0] = lfs2->root[0];
-    dir->tail[1] = lfs2->root[1];
+    dir->tail[0] = base ? base[0] : lfs2->root[0];
+    dir->tail[1] = base ? base[1] : lfs2->root[1];
 
     while (true) {
 nextname:
@@ -1111,6 +1373,11 @@ nextname:
         // skip '.' and root '..'
         if ((namelen == 1 && memcmp(name, ".", 1) == 0) ||
             (namelen == 2 && memcmp(name, "..", 2) == 0)) {
+            if (namelen == 2 && base && lfs2_tag_id(tag) == 0x3ff) {
+                // we don't know base's parent
+                return LFS2_ERR_INVAL;
+            }
+
             name += namelen;
             goto nextname;
         }
@@ -1189,6 +1456,11 @@ nextname:
     }
 }
 
+static inline lfs2_stag_t lfs2_dir_find(lfs2_t *lfs2, lfs2_mdir_t *dir,
+        const char **path, uint16_t *id) {
+    return lfs2_dir_findat(lfs2, dir, NULL, path, id);
+}
+
 // commit logic
 struct lfs2_commit {
     lfs2_block_t block;
@@ -1413,6 +1685,7 @@ static int lfs2_dir_drop(lfs2_t *lfs2, lfs2_mdir_t *dir, lfs2_mdir_t *tail) {
 static int lfs2_dir_split(lfs2_t *lfs2,
         lfs2_mdir_t *dir, const struct lfs2_mattr *attrs, int attrcount,
         lfs2_mdir_t *source, uint16_t split, uint16_t end) {
+    LFS2_STAT(lfs2, splits, 1);
     // create tail directory
     lfs2_alloc_ack(lfs2);
     lfs2_mdir_t tail;
@@ -1464,6 +1737,7 @@ static int lfs2_dir_commit_commit(void *p, lfs2_tag_t tag, const void *buffer) {
 static int lfs2_dir_compact(lfs2_t *lfs2,
         lfs2_mdir_t *dir, const struct lfs2_mattr *attrs, int attrcount,
         lfs2_mdir_t *source, uint16_t begin, uint16_t end) {
+    LFS2_STAT(lfs2, compactions, 1);
     // save some state in case block is bad
     const lfs2_block_t oldpair[2] = {dir->pair[0], dir->pair[1]};
     bool relocated = false;
@@ -1483,6 +1757,17 @@ static int lfs2_dir_compact(lfs2_t *lfs2,
             return err;
         }
 
+        // and superblock state, see below
+        err = lfs2_dir_traverse(lfs2,
+                source, 0, 0xffffffff, attrs, attrcount,
+                LFS2_MKTAG(0x7fc, 0x3ff, 0),
+                LFS2_MKTAG(LFS2_TYPE_GLOBALS, 0, 0),
+                begin, end, -begin,
+                lfs2_dir_commit_size, &size);
+        if (err) {
+            return err;
+        }
+
         // space is complicated, we need room for tail, crc, gstate,
         // cleanup delete, and we cap at half a block to give room
         // for metadata updates.
@@ -1612,6 +1897,23 @@ static int lfs2_dir_compact(lfs2_t *lfs2,
                 return err;
             }
 
+            // superblock state (wear-state and bad-blocks) is in the
+            // globals, which aren't part of any file, so bring it over
+            // with the superblock's id
+            err = lfs2_dir_traverse(lfs2,
+                    source, 0, 0xffffffff, attrs, attrcount,
+                    LFS2_MKTAG(0x7fc, 0x3ff, 0),
+                    LFS2_MKTAG(LFS2_TYPE_GLOBALS, 0, 0),
+                    begin, end, -begin,
+                    lfs2_dir_commit_commit, &(struct lfs2_dir_commit_commit){
+                        lfs2, &commit});
+            if (err) {
+                if (err == LFS2_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+
             // commit tail, which may be new after last size check
             if (!lfs2_pair_isnull(dir->tail)) {
                 lfs2_pair_tole32(dir->tail);
@@ -1680,9 +1982,11 @@ static int lfs2_dir_compact(lfs2_t *lfs2,
 relocate:
         // commit was corrupted, drop caches and prepare to relocate block
         relocated = true;
+        LFS2_STAT(lfs2, relocations, 1);
         lfs2_cache_drop(lfs2, &lfs2->pcache);
         if (!tired) {
             LFS2_DEBUG("Bad block at 0x%"PRIx32, dir->pair[1]);
+            lfs2_alloc_bad(lfs2, dir->pair[1]);
         }
 
         // can't relocate superblock, filesystem is now frozen
@@ -1723,7 +2027,7 @@ static int lfs2_dir_commit(lfs2_t *lfs2, lfs2_mdir_t *dir,
     for (lfs2_file_t *f = (lfs2_file_t*)lfs2->mlist; f; f = f->next) {
         if (dir != &f->m && lfs2_pair_cmp(f->m.pair, dir->pair) == 0 &&
                 f->type == LFS2_TYPE_REG && (f->flags & LFS2_F_INLINE) &&
-                f->ctz.size > lfs2->cfg->cache_size) {
+                f->ctz.size > lfs2_cache_filesize(lfs2, &f->cache)) {
             int err = lfs2_file_outline(lfs2, f);
             if (err) {
                 return err;
@@ -1871,6 +2175,11 @@ compact:
                         d->id == lfs2_tag_id(attrs[i].tag)) {
                     d->m.pair[0] = LFS2_BLOCK_NULL;
                     d->m.pair[1] = LFS2_BLOCK_NULL;
+                    if (d->type == LFS2_TYPE_REG &&
+                            (((lfs2_file_t*)d)->flags & LFS2_F_PENDING)) {
+                        // deleted files have nothing left to commit
+                        ((lfs2_file_t*)d)->flags &= ~LFS2_F_PENDING;
+                    }
                 } else if (lfs2_tag_type3(attrs[i].tag) == LFS2_TYPE_DELETE &&
                         d->id > lfs2_tag_id(attrs[i].tag)) {
                     d->id -= 1;
@@ -2070,9 +2379,8 @@ int lfs2_dir_close(lfs2_t *lfs2, lfs2_dir_t *dir) {
     return 0;
 }
 
-int lfs2_dir_read(lfs2_t *lfs2, lfs2_dir_t *dir, struct lfs2_info *info) {
-    LFS2_TRACE("lfs2_dir_read(%p, %p, %p)",
-            (void*)lfs2, (void*)dir, (void*)info);
+static int lfs2_dir_rawread(lfs2_t *lfs2, lfs2_dir_t *dir,
+        struct lfs2_info *info) {
     memset(info, 0, sizeof(*info));
 
     // special offset for '.' and '..'
@@ -2080,26 +2388,26 @@ int lfs2_dir_read(lfs2_t *lfs2, lfs2_dir_t *dir, struct lfs2_info *info) {
         info->type = LFS2_TYPE_DIR;
         strcpy(info->name, ".");
         dir->pos += 1;
-        LFS2_TRACE("lfs2_dir_read -> %d", true);
         return true;
     } else if (dir->pos == 1) {
         info->type = LFS2_TYPE_DIR;
         strcpy(info->name, "..");
         dir->pos += 1;
-        LFS2_TRACE("lfs2_dir_read -> %d", true);
+        // skip superblock entry, keeping pos and id in step for seek
+        if (dir->id == 0 && lfs2_pair_cmp(dir->m.pair, lfs2->root) == 0) {
+            dir->id = 1;
+        }
         return true;
     }
 
     while (true) {
         if (dir->id == dir->m.count) {
             if (!dir->m.split) {
-                LFS2_TRACE("lfs2_dir_read -> %d", false);
                 return false;
             }
 
             int err = lfs2_dir_fetch(lfs2, &dir->m, dir->m.tail);
             if (err) {
-                LFS2_TRACE("lfs2_dir_read -> %d", err);
                 return err;
             }
 
@@ -2108,7 +2416,6 @@ int lfs2_dir_read(lfs2_t *lfs2, lfs2_dir_t *dir, struct lfs2_info *info) {
 
         int err = lfs2_dir_getinfo(lfs2, &dir->m, dir->id, info);
         if (err && err != LFS2_ERR_NOENT) {
-            LFS2_TRACE("lfs2_dir_read -> %d", err);
             return err;
         }
 
@@ -2119,26 +2426,228 @@ int lfs2_dir_read(lfs2_t *lfs2, lfs2_dir_t *dir, struct lfs2_info *info) {
     }
 
     dir->pos += 1;
-    LFS2_TRACE("lfs2_dir_read -> %d", true);
     return true;
 }
 
+int lfs2_dir_read(lfs2_t *lfs2, lfs2_dir_t *dir, struct lfs2_info *info) {
+    LFS2_TRACE("lfs2_dir_read(%p, %p, %p)",
+            (void*)lfs2, (void*)dir, (void*)info);
+    int res = lfs2_dir_rawread(lfs2, dir, info);
+    LFS2_TRACE("lfs2_dir_read -> %d", res);
+    return res;
+}
+
+lfs2_ssize_t lfs2_dir_readbatch(lfs2_t *lfs2, lfs2_dir_t *dir,
+        struct lfs2_info *info, lfs2_size_t count,
+        const struct lfs2_attr *attrs, lfs2_size_t attr_count) {
+    LFS2_TRACE("lfs2_dir_readbatch(%p, %p, %p, %"PRIu32", %p, %"PRIu32")",
+            (void*)lfs2, (void*)dir, (void*)info, count,
+            (void*)attrs, attr_count);
+    lfs2_size_t i = 0;
+    for (; i < count; i++) {
+        int res = lfs2_dir_rawread(lfs2, dir, &info[i]);
+        if (res < 0) {
+            LFS2_TRACE("lfs2_dir_readbatch -> %d", res);
+            return res;
+        }
+
+        if (!res) {
+            break;
+        }
+
+        // entry i's attributes come from the pair we just read it from
+        for (lfs2_size_t j = 0; j < attr_count; j++) {
+            uint8_t *buffer = (uint8_t*)attrs[j].buffer + i*attrs[j].size;
+            memset(buffer, 0, attrs[j].size);
+            if (dir->pos <= 2) {
+                // '.' and '..' have no attributes
+                continue;
+            }
+
+            lfs2_stag_t tag = lfs2_dir_get(lfs2, &dir->m,
+                    LFS2_MKTAG(0x7ff, 0x3ff, 0),
+                    LFS2_MKTAG(LFS2_TYPE_USERATTR + attrs[j].type,
+                        dir->id-1, lfs2_min(attrs[j].size, lfs2->attr_max)),
+                    buffer);
+            if (tag < 0 && tag != LFS2_ERR_NOENT) {
+                LFS2_TRACE("lfs2_dir_readbatch -> %"PRId32, tag);
+                return tag;
+            }
+        }
+    }
+
+    LFS2_TRACE("lfs2_dir_readbatch -> %"PRIu32, i);
+    return i;
+}
+
+// compare a name read from disk with a key as strcmp would
+static int lfs2_dir_namecmp(const char *name, lfs2_size_t size,
+        const char *key) {
+    lfs2_size_t keysize = strlen(key);
+    int res = memcmp(name, key, lfs2_min(size, keysize));
+    if (res) {
+        return res;
+    }
+
+    return (size < keysize) ? -1 : (size > keysize) ? 1 : 0;
+}
+
+// skip to the first id in the rest of a metadata pair whose name doesn't
+// sort before key in the order the pair keeps names, bytewise with longer
+// names before their prefixes, if prefix is set any name sharing a prefix
+// with key doesn't sort before it
+static int lfs2_dir_namesearch(lfs2_t *lfs2, lfs2_dir_t *dir,
+        const char *key, lfs2_size_t keysize, bool prefix, char *buffer) {
+    uint16_t lo = dir->id + 1;
+    uint16_t hi = dir->m.count;
+    while (lo < hi) {
+        uint16_t mid = lo + (hi-lo)/2;
+        lfs2_stag_t tag = lfs2_dir_get(lfs2, &dir->m,
+                LFS2_MKTAG(0x780, 0x3ff, 0),
+                LFS2_MKTAG(LFS2_TYPE_NAME, mid, lfs2->name_max+1),
+                buffer);
+        if (tag < 0 && tag != LFS2_ERR_NOENT) {
+            return tag;
+        }
+
+        // stop early at any id without a name
+        if (tag == LFS2_ERR_NOENT) {
+            break;
+        }
+
+        lfs2_size_t size = lfs2_tag_size(tag);
+        int res = memcmp(buffer, key, lfs2_min(size, keysize));
+        if (res < 0 || (res == 0 && !prefix && size > keysize)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    dir->pos += lo - dir->id;
+    dir->id = lo;
+    return 0;
+}
+
+int lfs2_dir_readrange(lfs2_t *lfs2, lfs2_dir_t *dir,
+        const char *start, const char *stop, struct lfs2_info *info) {
+    LFS2_TRACE("lfs2_dir_readrange(%p, %p, \"%s\", \"%s\", %p)",
+            (void*)lfs2, (void*)dir,
+            start ? start : "", stop ? stop : "", (void*)info);
+    memset(info, 0, sizeof(*info));
+
+    // '.' and '..' are never in range
+    if (dir->pos < 2) {
+        dir->pos = 2;
+        if (dir->id == 0 && lfs2_pair_cmp(dir->m.pair, lfs2->root) == 0) {
+            dir->id = 1;
+        }
+    }
+
+    while (true) {
+        if (dir->id == dir->m.count) {
+            if (!dir->m.split) {
+                LFS2_TRACE("lfs2_dir_readrange -> %d", false);
+                return false;
+            }
+
+            int err = lfs2_dir_fetch(lfs2, &dir->m, dir->m.tail);
+            if (err) {
+                LFS2_TRACE("lfs2_dir_readrange -> %d", err);
+                return err;
+            }
+
+            dir->id = 0;
+        }
+
+        lfs2_stag_t tag = lfs2_dir_get(lfs2, &dir->m,
+                LFS2_MKTAG(0x780, 0x3ff, 0),
+                LFS2_MKTAG(LFS2_TYPE_NAME, dir->id, lfs2->name_max+1),
+                info->name);
+        if (tag < 0 && tag != LFS2_ERR_NOENT) {
+            LFS2_TRACE("lfs2_dir_readrange -> %"PRId32, tag);
+            return tag;
+        }
+
+        if (tag == LFS2_ERR_NOENT) {
+            dir->id += 1;
+            continue;
+        }
+
+        lfs2_size_t size = lfs2_tag_size(tag);
+        if (start && lfs2_dir_namecmp(info->name, size, start) < 0) {
+            // names differing from start at a smaller byte come first in
+            // this pair, after these any prefixes of start are mixed in
+            // with names in range, so only skip the former
+            int err = lfs2_dir_namesearch(lfs2, dir,
+                    start, strlen(start), true, info->name);
+            if (err) {
+                LFS2_TRACE("lfs2_dir_readrange -> %d", err);
+                return err;
+            }
+            continue;
+        }
+
+        if (stop && lfs2_dir_namecmp(info->name, size, stop) >= 0) {
+            // the only names left in range in this pair are prefixes of
+            // stop no longer than what we share with it, these sort after
+            // the longest of them
+            lfs2_size_t keysize = 0;
+            while (keysize < size && stop[keysize] &&
+                    info->name[keysize] == stop[keysize]) {
+                keysize += 1;
+            }
+
+            int err = lfs2_dir_namesearch(lfs2, dir,
+                    stop, keysize, false, info->name);
+            if (err) {
+                LFS2_TRACE("lfs2_dir_readrange -> %d", err);
+                return err;
+            }
+            continue;
+        }
+
+        int err = lfs2_dir_getinfo(lfs2, &dir->m, dir->id, info);
+        if (err) {
+            LFS2_TRACE("lfs2_dir_readrange -> %d", err);
+            return err;
+        }
+
+        dir->id += 1;
+        dir->pos += 1;
+        LFS2_TRACE("lfs2_dir_readrange -> %d", true);
+        return true;
+    }
+}
+
 int lfs2_dir_seek(lfs2_t *lfs2, lfs2_dir_t *dir, lfs2_off_t off) {
     LFS2_TRACE("lfs2_dir_seek(%p, %p, %"PRIu32")",
             (void*)lfs2, (void*)dir, off);
-    // simply walk from head dir
-    int err = lfs2_dir_rewind(lfs2, dir);
-    if (err) {
-        LFS2_TRACE("lfs2_dir_seek -> %d", err);
-        return err;
-    }
+    // position of id 0 in the metadata pair we have loaded, this stays
+    // correct as commits shift our id and pos together
+    lfs2_off_t mpos = dir->pos - dir->id;
+    if (off >= 2 && dir->pos >= 2 && off >= mpos &&
+            !lfs2_pair_isnull(dir->m.pair)) {
+        // seeking into or past our pair, walk from here instead of from
+        // the head, so seeking to the result of tell is cheap
+        dir->id = 0;
+        dir->pos = mpos;
+        off -= mpos;
+    } else {
+        // walk from head dir
+        int err = lfs2_dir_rewind(lfs2, dir);
+        if (err) {
+            LFS2_TRACE("lfs2_dir_seek -> %d", err);
+            return err;
+        }
 
-    // first two for ./..
-    dir->pos = lfs2_min(2, off);
-    off -= dir->pos;
+        // first two for ./..
+        dir->pos = lfs2_min(2, off);
+        off -= dir->pos;
 
-    // skip superblock entry
-    dir->id = (off > 0 && lfs2_pair_cmp(dir->head, lfs2->root) == 0);
+        // skip superblock entry
+        dir->id = (off > 0 && lfs2_pair_cmp(dir->head, lfs2->root) == 0);
+    }
 
     while (off > 0) {
         int diff = lfs2_min(dir->m.count - dir->id, off);
@@ -2152,7 +2661,7 @@ int lfs2_dir_seek(lfs2_t *lfs2, lfs2_dir_t *dir, lfs2_off_t off) {
                 return LFS2_ERR_INVAL;
             }
 
-            err = lfs2_dir_fetch(lfs2, &dir->m, dir->m.tail);
+            int err = lfs2_dir_fetch(lfs2, &dir->m, dir->m.tail);
             if (err) {
                 LFS2_TRACE("lfs2_dir_seek -> %d", err);
                 return err;
@@ -2189,19 +2698,56 @@ int lfs2_dir_rewind(lfs2_t *lfs2, lfs2_dir_t *dir) {
 }
 
 
-/// File index list operations ///
-static int lfs2_ctz_index(lfs2_t *lfs2, lfs2_off_t *off) {
-    lfs2_off_t size = *off;
-    lfs2_off_t b = lfs2->cfg->block_size - 2*4;
-    lfs2_off_t i = size / b;
-    if (i == 0) {
-        return 0;
-    }
-
-    i = (size - 4*(lfs2_popc(i-1)+2)) / b;
-    *off = size - b*i - 4*lfs2_popc(i);
-    return i;
-}
+/// File block allocation ///
+static int lfs2_file_alloc(lfs2_t *lfs2, lfs2_file_t *file,
+        lfs2_block_t *block) {
+    while (true) {
+        // use up any blocks reserved for the file first, blocks from
+        // lfs2_file_reserve have already been erased
+        if (file->reserve.count > 0) {
+            *block = file->reserve.block;
+            file->reserve.block += 1;
+            file->reserve.count -= 1;
+            lfs2->allocs += 1;
+            LFS2_STAT(lfs2, allocs, 1);
+            if (file->flags & LFS2_F_ERASED) {
+                return 0;
+            }
+        } else {
+            int err = lfs2_alloc(lfs2, block);
+            if (err) {
+                return err;
+            }
+        }
+
+        int err = lfs2_bd_erase(lfs2, *block);
+        if (err) {
+            if (err == LFS2_ERR_CORRUPT) {
+                LFS2_DEBUG("Bad block at 0x%"PRIx32, *block);
+                lfs2_alloc_bad(lfs2, *block);
+                continue;
+            }
+            return err;
+        }
+
+        return 0;
+    }
+}
+
+
+/// File index list operations ///
+static int lfs2_ctz_index(lfs2_t *lfs2, lfs2_off_t *off) {
+    lfs2_off_t size = *off;
+    lfs2_off_t b = lfs2->cfg->block_size - 2*4;
+    lfs2_off_t i = size / b;
+    if (i == 0) {
+        return 0;
+    }
+
+    i = (size - 4*(lfs2_popc(i-1)+2)) / b;
+    *off = size - b*i - 4*lfs2_popc(i);
+    return i;
+}
 
 static int lfs2_ctz_find(lfs2_t *lfs2,
         const lfs2_cache_t *pcache, lfs2_cache_t *rcache,
@@ -2237,98 +2783,89 @@ static int lfs2_ctz_find(lfs2_t *lfs2,
     return 0;
 }
 
-static int lfs2_ctz_extend(lfs2_t *lfs2,
+static int lfs2_ctz_extend(lfs2_t *lfs2, lfs2_file_t *file,
         lfs2_cache_t *pcache, lfs2_cache_t *rcache,
         lfs2_block_t head, lfs2_size_t size,
         lfs2_block_t *block, lfs2_off_t *off) {
     while (true) {
-        // go ahead and grab a block
+        // go ahead and grab an erased block
         lfs2_block_t nblock;
-        int err = lfs2_alloc(lfs2, &nblock);
+        int err = lfs2_file_alloc(lfs2, file, &nblock);
         if (err) {
             return err;
         }
 
-        {
-            err = lfs2_bd_erase(lfs2, nblock);
-            if (err) {
-                if (err == LFS2_ERR_CORRUPT) {
-                    goto relocate;
-                }
-                return err;
-            }
-
-            if (size == 0) {
-                *block = nblock;
-                *off = 0;
-                return 0;
-            }
+        if (size == 0) {
+            *block = nblock;
+            *off = 0;
+            return 0;
+        }
 
-            lfs2_size_t noff = size - 1;
-            lfs2_off_t index = lfs2_ctz_index(lfs2, &noff);
-            noff = noff + 1;
+        lfs2_size_t noff = size - 1;
+        lfs2_off_t index = lfs2_ctz_index(lfs2, &noff);
+        noff = noff + 1;
+        lfs2_size_t skips = lfs2_ctz(index+1) + 1;
+        lfs2_block_t nhead = head;
 
-            // just copy out the last block if it is incomplete
-            if (noff != lfs2->cfg->block_size) {
-                for (lfs2_off_t i = 0; i < noff; i++) {
-                    uint8_t data;
-                    err = lfs2_bd_read(lfs2,
-                            NULL, rcache, noff-i,
-                            head, i, &data, 1);
-                    if (err) {
-                        return err;
-                    }
-
-                    err = lfs2_bd_prog(lfs2,
-                            pcache, rcache, true,
-                            nblock, i, &data, 1);
-                    if (err) {
-                        if (err == LFS2_ERR_CORRUPT) {
-                            goto relocate;
-                        }
-                        return err;
-                    }
+        // just copy out the last block if it is incomplete
+        if (noff != lfs2->cfg->block_size) {
+            for (lfs2_off_t i = 0; i < noff; i++) {
+                uint8_t data;
+                err = lfs2_bd_read(lfs2,
+                        NULL, rcache, noff-i,
+                        head, i, &data, 1);
+                if (err) {
+                    return err;
                 }
 
-                *block = nblock;
-                *off = noff;
-                return 0;
-            }
-
-            // append block
-            index += 1;
-            lfs2_size_t skips = lfs2_ctz(index) + 1;
-            lfs2_block_t nhead = head;
-            for (lfs2_off_t i = 0; i < skips; i++) {
-                nhead = lfs2_tole32(nhead);
-                err = lfs2_bd_prog(lfs2, pcache, rcache, true,
-                        nblock, 4*i, &nhead, 4);
-                nhead = lfs2_fromle32(nhead);
+                err = lfs2_bd_prog(lfs2,
+                        pcache, rcache, true,
+                        nblock, i, &data, 1);
                 if (err) {
                     if (err == LFS2_ERR_CORRUPT) {
                         goto relocate;
                     }
                     return err;
                 }
-
-                if (i != skips-1) {
-                    err = lfs2_bd_read(lfs2,
-                            NULL, rcache, sizeof(nhead),
-                            nhead, 4*i, &nhead, sizeof(nhead));
-                    nhead = lfs2_fromle32(nhead);
-                    if (err) {
-                        return err;
-                    }
-                }
             }
 
             *block = nblock;
-            *off = 4*skips;
+            *off = noff;
             return 0;
         }
 
+        // append block
+        for (lfs2_off_t i = 0; i < skips; i++) {
+            nhead = lfs2_tole32(nhead);
+            err = lfs2_bd_prog(lfs2, pcache, rcache, true,
+                    nblock, 4*i, &nhead, 4);
+            nhead = lfs2_fromle32(nhead);
+            if (err) {
+                if (err == LFS2_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+
+            if (i != skips-1) {
+                err = lfs2_bd_read(lfs2,
+                        NULL, rcache, sizeof(nhead),
+                        nhead, 4*i, &nhead, sizeof(nhead));
+                nhead = lfs2_fromle32(nhead);
+                if (err) {
+                    return err;
+                }
+            }
+        }
+
+        *block = nblock;
+        *off = 4*skips;
+        return 0;
+
 relocate:
         LFS2_DEBUG("Bad block at 0x%"PRIx32, nblock);
+        LFS2_STAT(lfs2, relocations, 1);
+        lfs2_alloc_bad(lfs2, nblock);
 
         // just clear cache and try a new block
         lfs2_cache_drop(lfs2, pcache);
@@ -2379,20 +2916,399 @@ static int lfs2_ctz_traverse(lfs2_t *lfs2,
 }
 
 
+/// File extent operations ///
+static int lfs2_extent_find(lfs2_t *lfs2,
+        const struct lfs2_extent *ext, lfs2_size_t count,
+        lfs2_size_t pos, lfs2_block_t *block, lfs2_off_t *off) {
+    lfs2_block_t index = pos / lfs2->cfg->block_size;
+    for (lfs2_size_t i = 0; i < count; i++) {
+        if (index < ext[i].count) {
+            *block = ext[i].block + index;
+            *off = pos % lfs2->cfg->block_size;
+            return 0;
+        }
+
+        index -= ext[i].count;
+    }
+
+    return LFS2_ERR_CORRUPT;
+}
+
+// block just past the last extent left after the next flush, where the
+// file can grow without a new extent, or LFS2_BLOCK_NULL if there is none
+static lfs2_block_t lfs2_extent_end(const lfs2_file_t *file) {
+    if (file->ext_count > file->ext_committed) {
+        const struct lfs2_extent *last = &file->ext[file->ext_count-1];
+        return last->block + last->count;
+    }
+
+    lfs2_block_t end = LFS2_BLOCK_NULL;
+    lfs2_block_t keep = file->ext_keep;
+    for (lfs2_size_t i = 0; keep > 0 && i < file->ext_committed; i++) {
+        end = file->ext[i].block + lfs2_min(file->ext[i].count, keep);
+        keep -= lfs2_min(file->ext[i].count, keep);
+    }
+
+    return end;
+}
+
+// number of extents and blocks left after the next flush, committed
+// extents past the blocks we keep are dropped, and a staged extent that
+// continues the last one we keep is merged with it
+static lfs2_size_t lfs2_extent_count(const lfs2_file_t *file,
+        lfs2_block_t *blocks) {
+    lfs2_size_t count = 0;
+    lfs2_block_t end = LFS2_BLOCK_NULL;
+    *blocks = 0;
+    lfs2_block_t keep = file->ext_keep;
+    for (lfs2_size_t i = 0; keep > 0 && i < file->ext_committed; i++) {
+        end = file->ext[i].block + lfs2_min(file->ext[i].count, keep);
+        *blocks += lfs2_min(file->ext[i].count, keep);
+        keep -= lfs2_min(file->ext[i].count, keep);
+        count += 1;
+    }
+
+    for (lfs2_size_t i = file->ext_committed; i < file->ext_count; i++) {
+        *blocks += file->ext[i].count;
+        if (i > file->ext_committed || file->ext[i].block != end) {
+            count += 1;
+        }
+    }
+
+    return count;
+}
+
+static int lfs2_extent_push(lfs2_file_t *file, lfs2_block_t block) {
+    // grow the last staged extent if we can
+    if (file->ext_count > file->ext_committed) {
+        struct lfs2_extent *last = &file->ext[file->ext_count-1];
+        if (last->block + last->count == block) {
+            last->count += 1;
+            return 0;
+        }
+    }
+
+    // a staged extent that continues the last committed one doesn't count,
+    // it is merged on flush
+    lfs2_block_t blocks;
+    lfs2_size_t count = lfs2_extent_count(file, &blocks);
+    if (file->ext_count >= LFS2_EXTENT_MAX+1 ||
+            (count >= LFS2_EXTENT_MAX && block != lfs2_extent_end(file))) {
+        return LFS2_ERR_NOSPC;
+    }
+
+    file->ext[file->ext_count].block = block;
+    file->ext[file->ext_count].count = 1;
+    file->ext_count += 1;
+    return 0;
+}
+
+static void lfs2_extent_pop(lfs2_file_t *file) {
+    file->ext[file->ext_count-1].count -= 1;
+    if (file->ext[file->ext_count-1].count == 0) {
+        file->ext_count -= 1;
+    }
+}
+
+static void lfs2_extent_flush(lfs2_file_t *file) {
+    // keep only the leading blocks of the committed extents
+    lfs2_block_t keep = file->ext_keep;
+    lfs2_size_t n = 0;
+    while (keep > 0 && n < file->ext_committed) {
+        file->ext[n].count = lfs2_min(file->ext[n].count, keep);
+        keep -= file->ext[n].count;
+        n += 1;
+    }
+
+    // and slide down any staged extents, merging where possible
+    for (lfs2_size_t i = file->ext_committed; i < file->ext_count; i++) {
+        if (n > 0 && file->ext[n-1].block + file->ext[n-1].count
+                == file->ext[i].block) {
+            file->ext[n-1].count += file->ext[i].count;
+        } else {
+            file->ext[n] = file->ext[i];
+            n += 1;
+        }
+    }
+
+    file->ext_count = n;
+    file->ext_committed = n;
+}
+
+static void lfs2_extent_trim(lfs2_t *lfs2, lfs2_file_t *file,
+        lfs2_size_t size, struct lfs2_extent *dropped) {
+    size = lfs2_min(size, file->ctz.size);
+
+    // drop any blocks we trimmed past from the front, reporting the oldest
+    // run we dropped if asked
+    lfs2_off_t off = file->ext_off + size;
+    lfs2_block_t drop = off / lfs2->cfg->block_size;
+    lfs2_size_t n = 0;
+    if (dropped) {
+        dropped->block = file->ext[0].block;
+        dropped->count = (file->ext_count > 0)
+                ? lfs2_min(file->ext[0].count, drop)
+                : 0;
+    }
+    while (drop > 0 && n < file->ext_count) {
+        lfs2_block_t diff = lfs2_min(file->ext[n].count, drop);
+        file->ext[n].block += diff;
+        file->ext[n].count -= diff;
+        drop -= diff;
+        if (file->ext[n].count == 0) {
+            n += 1;
+        }
+    }
+
+    memmove(file->ext, &file->ext[n],
+            (file->ext_count - n)*sizeof(struct lfs2_extent));
+    file->ext_count -= n;
+    file->ext_committed = file->ext_count;
+    file->ext_off = off % lfs2->cfg->block_size;
+
+    file->ctz.size -= size;
+    file->pos -= lfs2_min(file->pos, size);
+    if (file->ctz.size == 0) {
+        file->ext_count = 0;
+        file->ext_committed = 0;
+        file->ext_off = 0;
+    }
+
+    file->flags |= LFS2_F_DIRTY;
+}
+
+static int lfs2_extent_extend(lfs2_t *lfs2, lfs2_file_t *file,
+        lfs2_size_t size) {
+    if (!(file->flags & LFS2_F_WRITING)) {
+        // stage new extents after the committed ones until flushed
+        file->ext_committed = file->ext_count;
+        file->ext_keep = (file->ext_off + file->pos) / lfs2->cfg->block_size;
+    }
+
+    if (file->reserve.count == 0) {
+        // set aside a run of free blocks to grow into, so other files
+        // allocating in between don't break up our extents. Runs double
+        // the file each time, or cover the rest of the write if that's
+        // more, and circular files ask for the rest of their capacity
+        lfs2_block_t blocks;
+        lfs2_extent_count(file, &blocks);
+        lfs2_block_t want = lfs2_max(blocks, ((file->ext_off + file->pos)
+                    % lfs2->cfg->block_size
+                + size + lfs2->cfg->block_size-1) / lfs2->cfg->block_size);
+        if (file->flags & LFS2_F_CIRCULAR) {
+            lfs2_block_t capacity = (file->capacity
+                    + lfs2->cfg->block_size-1) / lfs2->cfg->block_size + 1;
+            want = capacity - lfs2_min(blocks, capacity-1);
+        }
+
+        // grow the last extent in place if the blocks after it are still
+        // free, otherwise take the first run that fits, or the longest
+        // we can find
+        file->reserve.block = lfs2_extent_end(file);
+        file->reserve.count = 0;
+        if (file->reserve.block != LFS2_BLOCK_NULL) {
+            int err = lfs2_alloc_after(lfs2, file->reserve.block, want,
+                    &file->reserve.count);
+            if (err) {
+                return err;
+            }
+        }
+
+        if (file->reserve.count == 0) {
+            int err = lfs2_alloc_run(lfs2, want,
+                    &file->reserve.block, &file->reserve.count);
+            if (err) {
+                return err;
+            }
+        }
+        file->flags &= ~LFS2_F_ERASED;
+    }
+
+    while (true) {
+        // go ahead and grab an erased block from our run
+        lfs2_block_t nblock;
+        int err = lfs2_file_alloc(lfs2, file, &nblock);
+        if (err) {
+            return err;
+        }
+
+        // copy out the block we are extending if it is incomplete
+        lfs2_off_t noff = (file->ext_off + file->pos)
+                % lfs2->cfg->block_size;
+        if (noff != 0) {
+            lfs2_block_t head;
+            lfs2_off_t hoff;
+            err = lfs2_extent_find(lfs2,
+                    file->ext, file->ext_committed,
+                    file->ext_off + file->pos-1, &head, &hoff);
+            if (err) {
+                return err;
+            }
+
+            for (lfs2_off_t i = 0; i < noff; i++) {
+                uint8_t data;
+                err = lfs2_bd_read(lfs2,
+                        NULL, &lfs2->rcache, noff-i,
+                        head, i, &data, 1);
+                if (err) {
+                    return err;
+                }
+
+                err = lfs2_bd_prog(lfs2,
+                        &file->cache, &lfs2->rcache, true,
+                        nblock, i, &data, 1);
+                if (err) {
+                    if (err == LFS2_ERR_CORRUPT) {
+                        goto relocate;
+                    }
+                    return err;
+                }
+            }
+        }
+
+        err = lfs2_extent_push(file, nblock);
+        if (err) {
+            // out of extents, give the block back
+            if (file->reserve.count == 0) {
+                file->reserve.block = nblock + 1;
+            }
+            if (file->reserve.block == nblock + 1) {
+                file->reserve.block -= 1;
+                file->reserve.count += 1;
+                lfs2->allocs -= 1;
+            }
+            return err;
+        }
+
+        file->block = nblock;
+        file->off = noff;
+        return 0;
+
+relocate:
+        LFS2_DEBUG("Bad block at 0x%"PRIx32, nblock);
+        LFS2_STAT(lfs2, relocations, 1);
+        lfs2_alloc_bad(lfs2, nblock);
+
+        // just clear cache and try a new block
+        lfs2_cache_drop(lfs2, &file->cache);
+    }
+}
+
+static int lfs2_extent_traverse(
+        const struct lfs2_extent *ext, lfs2_size_t count,
+        int (*cb)(void*, lfs2_block_t), void *data) {
+    for (lfs2_size_t i = 0; i < count; i++) {
+        for (lfs2_block_t j = 0; j < ext[i].count; j++) {
+            int err = cb(data, ext[i].block + j);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
 /// Top level file operations ///
-int lfs2_file_opencfg(lfs2_t *lfs2, lfs2_file_t *file,
-        const char *path, int flags,
-        const struct lfs2_file_config *cfg) {
-    LFS2_TRACE("lfs2_file_opencfg(%p, %p, \"%s\", %x, %p {"
-                 ".buffer=%p, .attrs=%p, .attr_count=%"PRIu32"})",
-            (void*)lfs2, (void*)file, path, flags,
-            (void*)cfg, cfg->buffer, (void*)cfg->attrs, cfg->attr_count);
+static int lfs2_file_fetch(lfs2_t *lfs2, lfs2_file_t *file, lfs2_tag_t tag) {
+    // zero to avoid information leak
+    lfs2_cache_zero(lfs2, &file->cache);
+    file->ext_count = 0;
+    file->ext_committed = 0;
+    file->ext_off = 0;
+    file->capacity = 0;
+    file->flags &= ~(LFS2_F_INLINE | LFS2_F_EXTENT | LFS2_F_CIRCULAR);
+
+    if (!lfs2_struct_isvalid(lfs2, tag) ||
+            lfs2_tag_type3(tag) == LFS2_TYPE_DIRSTRUCT) {
+        LFS2_ERROR("Unsupported file struct 0x%"PRIx16" for id %"PRIu16,
+                lfs2_tag_type3(tag), file->id);
+        return LFS2_ERR_CORRUPT;
+    }
 
+    if (lfs2_tag_type3(tag) == LFS2_TYPE_INLINESTRUCT) {
+        // load inline files
+        file->ctz.head = LFS2_BLOCK_INLINE;
+        file->ctz.size = lfs2_tag_size(tag);
+        file->flags |= LFS2_F_INLINE;
+        file->cache.block = file->ctz.head;
+        file->cache.off = 0;
+        file->cache.size = lfs2_cache_filesize(lfs2, &file->cache);
+
+        // don't always read (may be new/trunc file)
+        if (file->ctz.size > 0) {
+            lfs2_stag_t res = lfs2_dir_get(lfs2, &file->m,
+                    LFS2_MKTAG(0x700, 0x3ff, 0),
+                    LFS2_MKTAG(LFS2_TYPE_STRUCT, file->id,
+                        lfs2_min(file->cache.size, 0x3fe)),
+                    file->cache.buffer);
+            if (res < 0) {
+                return res;
+            }
+        }
+
+        // extent layout is picked when the file leaves its inline state
+        if (file->flags & LFS2_O_CIRCULAR) {
+            if (file->cfg->circular_size == 0) {
+                return LFS2_ERR_INVAL;
+            }
+
+            file->capacity = file->cfg->circular_size;
+            file->flags |= LFS2_F_EXTENT | LFS2_F_CIRCULAR;
+        } else if (file->flags & LFS2_O_EXTENT) {
+            file->flags |= LFS2_F_EXTENT;
+        }
+    } else if (lfs2_tag_type3(tag) == LFS2_TYPE_EXTSTRUCT ||
+            lfs2_tag_type3(tag) == LFS2_TYPE_RINGSTRUCT) {
+        // load extent files, circular files also store their capacity
+        // and how much of the first extent has been trimmed
+        lfs2_size_t header = 4;
+        if (lfs2_tag_type3(tag) == LFS2_TYPE_RINGSTRUCT) {
+            header = 12;
+        }
+
+        if (lfs2_tag_size(tag) > header + 8*LFS2_EXTENT_MAX) {
+            return LFS2_ERR_INVAL;
+        }
+
+        uint32_t buffer[3 + 2*LFS2_EXTENT_MAX];
+        lfs2_stag_t res = lfs2_dir_get(lfs2, &file->m,
+                LFS2_MKTAG(0x700, 0x3ff, 0),
+                LFS2_MKTAG(LFS2_TYPE_STRUCT, file->id, lfs2_tag_size(tag)),
+                buffer);
+        if (res < 0) {
+            return res;
+        }
+
+        file->ctz.head = LFS2_BLOCK_NULL;
+        file->ctz.size = lfs2_fromle32(buffer[0]);
+        if (lfs2_tag_type3(tag) == LFS2_TYPE_RINGSTRUCT) {
+            file->capacity = lfs2_fromle32(buffer[1]);
+            file->ext_off = lfs2_fromle32(buffer[2]);
+            file->flags |= LFS2_F_CIRCULAR;
+        }
+
+        uint32_t *ext = &buffer[header/4];
+        file->ext_count = (lfs2_tag_size(tag) - header) / 8;
+        file->ext_committed = file->ext_count;
+        for (lfs2_size_t i = 0; i < file->ext_count; i++) {
+            file->ext[i].block = lfs2_fromle32(ext[2*i+0]);
+            file->ext[i].count = lfs2_fromle32(ext[2*i+1]);
+        }
+        file->flags |= LFS2_F_EXTENT;
+    }
+
+    return 0;
+}
+
+static int lfs2_file_rawopencfg(lfs2_t *lfs2, lfs2_file_t *file,
+        const lfs2_block_t base[2], const char *path, int flags,
+        const struct lfs2_file_config *cfg) {
     // deorphan if we haven't yet, needed at most once after poweron
     if ((flags & 3) != LFS2_O_RDONLY) {
         int err = lfs2_fs_forceconsistency(lfs2);
         if (err) {
-            LFS2_TRACE("lfs2_file_opencfg -> %d", err);
             return err;
         }
     }
@@ -2404,9 +3320,16 @@ int lfs2_file_opencfg(lfs2_t *lfs2, lfs2_file_t *file,
     file->pos = 0;
     file->off = 0;
     file->cache.buffer = NULL;
+    file->ext_count = 0;
+    file->ext_committed = 0;
+    file->ext_off = 0;
+    file->capacity = 0;
+    file->reserve.block = LFS2_BLOCK_NULL;
+    file->reserve.count = 0;
 
     // allocate entry for file if it doesn't exist
-    lfs2_stag_t tag = lfs2_dir_find(lfs2, &file->m, &path, &file->id);
+    lfs2_stag_t tag = lfs2_dir_findat(lfs2, &file->m, base, &path,
+            &file->id);
     if (tag < 0 && !(tag == LFS2_ERR_NOENT && file->id != 0x3ff)) {
         err = tag;
         goto cleanup;
@@ -2486,54 +3409,83 @@ int lfs2_file_opencfg(lfs2_t *lfs2, lfs2_file_t *file,
         }
     }
 
+    // check that the file's cache size is sane
+    file->cache.capacity = lfs2->cfg->cache_size;
+    if (file->cfg->cache_size) {
+        if (file->cfg->cache_size % lfs2->cfg->read_size != 0 ||
+                file->cfg->cache_size % lfs2->cfg->prog_size != 0 ||
+                lfs2->cfg->block_size % file->cfg->cache_size != 0) {
+            err = LFS2_ERR_INVAL;
+            goto cleanup;
+        }
+
+        file->cache.capacity = file->cfg->cache_size;
+    }
+
     // allocate buffer if needed
     if (file->cfg->buffer) {
         file->cache.buffer = file->cfg->buffer;
     } else {
-        file->cache.buffer = lfs2_malloc(lfs2->cfg->cache_size);
+        file->cache.buffer = lfs2_malloc(
+                lfs2_cache_filesize(lfs2, &file->cache));
         if (!file->cache.buffer) {
             err = LFS2_ERR_NOMEM;
             goto cleanup;
         }
     }
 
-    // zero to avoid information leak
-    lfs2_cache_zero(lfs2, &file->cache);
-
-    if (lfs2_tag_type3(tag) == LFS2_TYPE_INLINESTRUCT) {
-        // load inline files
-        file->ctz.head = LFS2_BLOCK_INLINE;
-        file->ctz.size = lfs2_tag_size(tag);
-        file->flags |= LFS2_F_INLINE;
-        file->cache.block = file->ctz.head;
-        file->cache.off = 0;
-        file->cache.size = lfs2->cfg->cache_size;
+    // load inline data or extents, ctz files were loaded above
+    err = lfs2_file_fetch(lfs2, file, tag);
+    if (err) {
+        goto cleanup;
+    }
 
-        // don't always read (may be new/trunc file)
-        if (file->ctz.size > 0) {
-            lfs2_stag_t res = lfs2_dir_get(lfs2, &file->m,
-                    LFS2_MKTAG(0x700, 0x3ff, 0),
-                    LFS2_MKTAG(LFS2_TYPE_STRUCT, file->id,
-                        lfs2_min(file->cache.size, 0x3fe)),
-                    file->cache.buffer);
-            if (res < 0) {
-                err = res;
-                goto cleanup;
-            }
+    // extent files need a v2.1 superblock before they can be written
+    if ((file->flags & 3) != LFS2_O_RDONLY &&
+            (file->flags & LFS2_F_EXTENT)) {
+        err = lfs2_fs_upgrade(lfs2);
+        if (err) {
+            goto cleanup;
         }
     }
 
-    LFS2_TRACE("lfs2_file_opencfg -> %d", 0);
     return 0;
 
 cleanup:
     // clean up lingering resources
     file->flags |= LFS2_F_ERRED;
     lfs2_file_close(lfs2, file);
+    return err;
+}
+
+int lfs2_file_opencfg(lfs2_t *lfs2, lfs2_file_t *file,
+        const char *path, int flags,
+        const struct lfs2_file_config *cfg) {
+    LFS2_TRACE("lfs2_file_opencfg(%p, %p, \"%s\", %x, %p {"
+                 ".buffer=%p, .attrs=%p, .attr_count=%"PRIu32", "
+                 ".circular_size=%"PRIu32"})",
+            (void*)lfs2, (void*)file, path, flags,
+            (void*)cfg, cfg->buffer, (void*)cfg->attrs, cfg->attr_count,
+            cfg->circular_size);
+    int err = lfs2_file_rawopencfg(lfs2, file, NULL, path, flags, cfg);
     LFS2_TRACE("lfs2_file_opencfg -> %d", err);
     return err;
 }
 
+int lfs2_file_opencfgat(lfs2_t *lfs2, lfs2_dir_t *dir, lfs2_file_t *file,
+        const char *path, int flags,
+        const struct lfs2_file_config *cfg) {
+    LFS2_TRACE("lfs2_file_opencfgat(%p, %p, %p, \"%s\", %x, %p {"
+                 ".buffer=%p, .attrs=%p, .attr_count=%"PRIu32", "
+                 ".circular_size=%"PRIu32"})",
+            (void*)lfs2, (void*)dir, (void*)file, path, flags,
+            (void*)cfg, cfg->buffer, (void*)cfg->attrs, cfg->attr_count,
+            cfg->circular_size);
+    int err = lfs2_file_rawopencfg(lfs2, file, dir->head, path, flags, cfg);
+    LFS2_TRACE("lfs2_file_opencfgat -> %d", err);
+    return err;
+}
+
 int lfs2_file_open(lfs2_t *lfs2, lfs2_file_t *file,
         const char *path, int flags) {
     LFS2_TRACE("lfs2_file_open(%p, %p, \"%s\", %x)",
@@ -2544,11 +3496,30 @@ int lfs2_file_open(lfs2_t *lfs2, lfs2_file_t *file,
     return err;
 }
 
+int lfs2_file_openat(lfs2_t *lfs2, lfs2_dir_t *dir, lfs2_file_t *file,
+        const char *path, int flags) {
+    LFS2_TRACE("lfs2_file_openat(%p, %p, %p, \"%s\", %x)",
+            (void*)lfs2, (void*)dir, (void*)file, path, flags);
+    static const struct lfs2_file_config defaults = {0};
+    int err = lfs2_file_opencfgat(lfs2, dir, file, path, flags, &defaults);
+    LFS2_TRACE("lfs2_file_openat -> %d", err);
+    return err;
+}
+
 int lfs2_file_close(lfs2_t *lfs2, lfs2_file_t *file) {
     LFS2_TRACE("lfs2_file_close(%p, %p)", (void*)lfs2, (void*)file);
     LFS2_ASSERT(file->flags & LFS2_F_OPENED);
 
+    // closed files can't wait for lfs2_fs_batchsync, commit them now
+    lfs2_batch_t *batch = lfs2->batch;
+    lfs2->batch = NULL;
     int err = lfs2_file_sync(lfs2, file);
+    lfs2->batch = batch;
+    file->flags &= ~LFS2_F_PENDING;
+
+    // give back any blocks we set aside but didn't use
+    lfs2_alloc_release(lfs2, file->reserve.block, file->reserve.count);
+    file->reserve.count = 0;
 
     // remove from list of mdirs
     for (struct lfs2_mlist **p = &lfs2->mlist; *p; p = &(*p)->next) {
@@ -2574,16 +3545,8 @@ static int lfs2_file_relocate(lfs2_t *lfs2, lfs2_file_t *file) {
     while (true) {
         // just relocate what exists into new block
         lfs2_block_t nblock;
-        int err = lfs2_alloc(lfs2, &nblock);
-        if (err) {
-            return err;
-        }
-
-        err = lfs2_bd_erase(lfs2, nblock);
+        int err = lfs2_file_alloc(lfs2, file, &nblock);
         if (err) {
-            if (err == LFS2_ERR_CORRUPT) {
-                goto relocate;
-            }
             return err;
         }
 
@@ -2620,8 +3583,46 @@ static int lfs2_file_relocate(lfs2_t *lfs2, lfs2_file_t *file) {
             }
         }
 
+        if (file->flags & LFS2_F_EXTENT) {
+            // replace the bad block in our staged extents
+            if (!(file->flags & LFS2_F_INLINE)) {
+                lfs2_extent_pop(file);
+            }
+
+            err = lfs2_extent_push(file, nblock);
+            if (err) {
+                return err;
+            }
+        }
+
+        if (lfs2->pcache.block == LFS2_BLOCK_NULL) {
+            // nothing left in the pcache, either there was nothing to copy
+            // or it was just flushed, its size may be stale
+            lfs2->pcache.size = 0;
+        }
+
+        if (lfs2->pcache.size > file->cache.capacity) {
+            // the file's cache is smaller than ours, program all but the
+            // last partial prog unit now, only zeroing what we program
+            lfs2_cache_t head = lfs2->pcache;
+            head.size = lfs2_aligndown(head.size, lfs2->cfg->prog_size);
+            head.capacity = head.size;
+            err = lfs2_bd_flush(lfs2, &head, &lfs2->rcache, true);
+            if (err) {
+                if (err == LFS2_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+
+            lfs2->pcache.off += head.size;
+            lfs2->pcache.size -= head.size;
+            memmove(lfs2->pcache.buffer,
+                    &lfs2->pcache.buffer[head.size], lfs2->pcache.size);
+        }
+
         // copy over new state of file
-        memcpy(file->cache.buffer, lfs2->pcache.buffer, lfs2->cfg->cache_size);
+        memcpy(file->cache.buffer, lfs2->pcache.buffer, lfs2->pcache.size);
         file->cache.block = lfs2->pcache.block;
         file->cache.off = lfs2->pcache.off;
         file->cache.size = lfs2->pcache.size;
@@ -2633,6 +3634,8 @@ static int lfs2_file_relocate(lfs2_t *lfs2, lfs2_file_t *file) {
 
 relocate:
         LFS2_DEBUG("Bad block at 0x%"PRIx32, nblock);
+        LFS2_STAT(lfs2, relocations, 1);
+        lfs2_alloc_bad(lfs2, nblock);
 
         // just clear cache and try a new block
         lfs2_cache_drop(lfs2, &lfs2->pcache);
@@ -2641,6 +3644,10 @@ relocate:
 
 static int lfs2_file_outline(lfs2_t *lfs2, lfs2_file_t *file) {
     file->off = file->pos;
+    file->ext_count = 0;
+    file->ext_committed = 0;
+    file->ext_keep = 0;
+    file->ext_off = 0;
     lfs2_alloc_ack(lfs2);
     int err = lfs2_file_relocate(lfs2, file);
     if (err) {
@@ -2669,10 +3676,17 @@ static int lfs2_file_flush(lfs2_t *lfs2, lfs2_file_t *file) {
             lfs2_file_t orig = {
                 .ctz.head = file->ctz.head,
                 .ctz.size = file->ctz.size,
-                .flags = LFS2_O_RDONLY | LFS2_F_OPENED,
+                .flags = LFS2_O_RDONLY | LFS2_F_OPENED |
+                    (file->flags & LFS2_F_EXTENT),
                 .pos = file->pos,
                 .cache = lfs2->rcache,
             };
+            if (file->flags & LFS2_F_EXTENT) {
+                memcpy(orig.ext, file->ext,
+                        file->ext_committed*sizeof(struct lfs2_extent));
+                orig.ext_count = file->ext_committed;
+                orig.ext_off = file->ext_off;
+            }
             lfs2_cache_drop(lfs2, &lfs2->rcache);
 
             while (file->pos < file->ctz.size) {
@@ -2710,11 +3724,17 @@ static int lfs2_file_flush(lfs2_t *lfs2, lfs2_file_t *file) {
 
 relocate:
                 LFS2_DEBUG("Bad block at 0x%"PRIx32, file->block);
+                LFS2_STAT(lfs2, relocations, 1);
+                lfs2_alloc_bad(lfs2, file->block);
                 err = lfs2_file_relocate(lfs2, file);
                 if (err) {
                     return err;
                 }
             }
+
+            if (file->flags & LFS2_F_EXTENT) {
+                lfs2_extent_flush(file);
+            }
         } else {
             file->pos = lfs2_max(file->pos, file->ctz.size);
         }
@@ -2731,6 +3751,42 @@ relocate:
     return 0;
 }
 
+static lfs2_tag_t lfs2_file_struct(lfs2_file_t *file,
+        uint32_t *buffer, const void **data) {
+    // build the dir entry's struct, buffer must fit 3 + 2*LFS2_EXTENT_MAX
+    // words and is only used for non-inline files
+    if (file->flags & LFS2_F_INLINE) {
+        // inline the whole file
+        *data = file->cache.buffer;
+        return LFS2_MKTAG(LFS2_TYPE_INLINESTRUCT, file->id, file->ctz.size);
+    } else if (file->flags & LFS2_F_EXTENT) {
+        // update the extent list, prefixed with the file size
+        uint16_t type = LFS2_TYPE_EXTSTRUCT;
+        lfs2_size_t size = 0;
+        buffer[size++] = lfs2_tole32(file->ctz.size);
+        if (file->flags & LFS2_F_CIRCULAR) {
+            type = LFS2_TYPE_RINGSTRUCT;
+            buffer[size++] = lfs2_tole32(file->capacity);
+            buffer[size++] = lfs2_tole32(file->ext_off);
+        }
+
+        for (lfs2_size_t i = 0; i < file->ext_count; i++) {
+            buffer[size++] = lfs2_tole32(file->ext[i].block);
+            buffer[size++] = lfs2_tole32(file->ext[i].count);
+        }
+        *data = buffer;
+        return LFS2_MKTAG(type, file->id, 4*size);
+    } else {
+        // update the ctz reference
+        // copy ctz so alloc will work during a relocate
+        struct lfs2_ctz ctz = file->ctz;
+        lfs2_ctz_tole32(&ctz);
+        memcpy(buffer, &ctz, sizeof(ctz));
+        *data = buffer;
+        return LFS2_MKTAG(LFS2_TYPE_CTZSTRUCT, file->id, sizeof(ctz));
+    }
+}
+
 int lfs2_file_sync(lfs2_t *lfs2, lfs2_file_t *file) {
     LFS2_TRACE("lfs2_file_sync(%p, %p)", (void*)lfs2, (void*)file);
     LFS2_ASSERT(file->flags & LFS2_F_OPENED);
@@ -2748,31 +3804,41 @@ int lfs2_file_sync(lfs2_t *lfs2, lfs2_file_t *file) {
         return err;
     }
 
+    if ((file->flags & LFS2_F_INLINE) && (file->flags & LFS2_F_CIRCULAR) &&
+            (file->flags & 3) != LFS2_O_RDONLY &&
+            !lfs2_pair_isnull(file->m.pair)) {
+        // circular files store their capacity in their struct, which
+        // inline files don't have, so outline files that were never
+        // written to
+        lfs2_off_t pos = file->pos;
+        file->pos = file->ctz.size;
+        err = lfs2_file_outline(lfs2, file);
+        if (!err) {
+            err = lfs2_file_flush(lfs2, file);
+        }
+        file->pos = pos;
+        if (err) {
+            file->flags |= LFS2_F_ERRED;
+            LFS2_TRACE("lfs2_file_sync -> %d", err);
+            return err;
+        }
+    }
+
     if ((file->flags & LFS2_F_DIRTY) &&
             !lfs2_pair_isnull(file->m.pair)) {
-        // update dir entry
-        uint16_t type;
-        const void *buffer;
-        lfs2_size_t size;
-        struct lfs2_ctz ctz;
-        if (file->flags & LFS2_F_INLINE) {
-            // inline the whole file
-            type = LFS2_TYPE_INLINESTRUCT;
-            buffer = file->cache.buffer;
-            size = file->ctz.size;
-        } else {
-            // update the ctz reference
-            type = LFS2_TYPE_CTZSTRUCT;
-            // copy ctz so alloc will work during a relocate
-            ctz = file->ctz;
-            lfs2_ctz_tole32(&ctz);
-            buffer = &ctz;
-            size = sizeof(ctz);
+        if (lfs2->batch) {
+            // leave the commit to lfs2_fs_batchsync
+            file->flags |= LFS2_F_PENDING;
+            LFS2_TRACE("lfs2_file_sync -> %d", 0);
+            return 0;
         }
 
         // commit file data and attributes
+        uint32_t buffer[3 + 2*LFS2_EXTENT_MAX];
+        const void *data;
+        lfs2_tag_t tag = lfs2_file_struct(file, buffer, &data);
         err = lfs2_dir_commit(lfs2, &file->m, LFS2_MKATTRS(
-                {LFS2_MKTAG(type, file->id, size), buffer},
+                {tag, data},
                 {LFS2_MKTAG(LFS2_FROM_USERATTRS, file->id,
                     file->cfg->attr_count), file->cfg->attrs}));
         if (err) {
@@ -2782,6 +3848,13 @@ int lfs2_file_sync(lfs2_t *lfs2, lfs2_file_t *file) {
         }
 
         file->flags &= ~LFS2_F_DIRTY;
+
+        // and any bad blocks found writing it
+        err = lfs2_fs_savebad(lfs2);
+        if (err) {
+            LFS2_TRACE("lfs2_file_sync -> %d", err);
+            return err;
+        }
     }
 
     LFS2_TRACE("lfs2_file_sync -> %d", 0);
@@ -2820,7 +3893,18 @@ lfs2_ssize_t lfs2_file_read(lfs2_t *lfs2, lfs2_file_t *file,
         // check if we need a new block
         if (!(file->flags & LFS2_F_READING) ||
                 file->off == lfs2->cfg->block_size) {
-            if (!(file->flags & LFS2_F_INLINE)) {
+            if (file->flags & LFS2_F_INLINE) {
+                file->block = LFS2_BLOCK_INLINE;
+                file->off = file->pos;
+            } else if (file->flags & LFS2_F_EXTENT) {
+                int err = lfs2_extent_find(lfs2,
+                        file->ext, file->ext_count,
+                        file->ext_off + file->pos, &file->block, &file->off);
+                if (err) {
+                    LFS2_TRACE("lfs2_file_read -> %d", err);
+                    return err;
+                }
+            } else {
                 int err = lfs2_ctz_find(lfs2, NULL, &file->cache,
                         file->ctz.head, file->ctz.size,
                         file->pos, &file->block, &file->off);
@@ -2828,9 +3912,6 @@ lfs2_ssize_t lfs2_file_read(lfs2_t *lfs2, lfs2_file_t *file,
                     LFS2_TRACE("lfs2_file_read -> %d", err);
                     return err;
                 }
-            } else {
-                file->block = LFS2_BLOCK_INLINE;
-                file->off = file->pos;
             }
 
             file->flags |= LFS2_F_READING;
@@ -2849,8 +3930,12 @@ lfs2_ssize_t lfs2_file_read(lfs2_t *lfs2, lfs2_file_t *file,
                 return err;
             }
         } else {
+            // random reads only fetch what is asked for, sequential reads
+            // fill the cache with the rest of the block
+            lfs2_size_t hint = (file->flags & LFS2_O_RANDOM)
+                    ? diff : lfs2->cfg->block_size;
             int err = lfs2_bd_read(lfs2,
-                    NULL, &file->cache, lfs2->cfg->block_size,
+                    NULL, &file->cache, hint,
                     file->block, file->off, data, diff);
             if (err) {
                 LFS2_TRACE("lfs2_file_read -> %d", err);
@@ -2897,6 +3982,46 @@ lfs2_ssize_t lfs2_file_write(lfs2_t *lfs2, lfs2_file_t *file,
         return LFS2_ERR_FBIG;
     }
 
+    if ((file->flags & LFS2_F_CIRCULAR) &&
+            lfs2_max(file->pos+nsize, file->ctz.size) > file->capacity) {
+        if (nsize > file->capacity) {
+            // Larger than the circular file?
+            LFS2_TRACE("lfs2_file_write -> %d", LFS2_ERR_FBIG);
+            return LFS2_ERR_FBIG;
+        }
+
+        int err = lfs2_file_flush(lfs2, file);
+        if (err) {
+            file->flags |= LFS2_F_ERRED;
+            LFS2_TRACE("lfs2_file_write -> %d", err);
+            return err;
+        }
+
+        // discard the oldest data up to a block boundary, so this only
+        // happens once per block of appends
+        lfs2_off_t trim = lfs2_max(file->pos+nsize, file->ctz.size)
+                - file->capacity;
+        trim = lfs2_alignup(file->ext_off + trim, lfs2->cfg->block_size)
+                - file->ext_off;
+        struct lfs2_extent dropped;
+        lfs2_extent_trim(lfs2, file, trim, &dropped);
+
+        if (file->reserve.count == 0 && dropped.count > 0 &&
+                !lfs2->batch && !lfs2_pair_isnull(file->m.pair)) {
+            // nothing left to grow into, commit the trim so we can wrap
+            // around into the oldest blocks, keeping the file to a couple
+            // of extents no matter who else is allocating
+            err = lfs2_file_sync(lfs2, file);
+            if (err) {
+                LFS2_TRACE("lfs2_file_write -> %d", err);
+                return err;
+            }
+
+            file->reserve = dropped;
+            file->flags &= ~LFS2_F_ERASED;
+        }
+    }
+
     if (!(file->flags & LFS2_F_WRITING) && file->pos > file->ctz.size) {
         // fill with zeros
         lfs2_off_t pos = file->pos;
@@ -2912,10 +4037,9 @@ lfs2_ssize_t lfs2_file_write(lfs2_t *lfs2, lfs2_file_t *file,
     }
 
     if ((file->flags & LFS2_F_INLINE) &&
-            lfs2_max(file->pos+nsize, file->ctz.size) >
-            lfs2_min(0x3fe, lfs2_min(
-                lfs2->cfg->cache_size, lfs2->cfg->block_size/8))) {
-        // inline file doesn't fit anymore
+            ((file->flags & LFS2_F_CIRCULAR) ||
+             lfs2_max(file->pos+nsize, file->ctz.size) > lfs2->inline_max)) {
+        // inline file doesn't fit anymore, circular files are never inlined
         int err = lfs2_file_outline(lfs2, file);
         if (err) {
             file->flags |= LFS2_F_ERRED;
@@ -2928,7 +4052,19 @@ lfs2_ssize_t lfs2_file_write(lfs2_t *lfs2, lfs2_file_t *file,
         // check if we need a new block
         if (!(file->flags & LFS2_F_WRITING) ||
                 file->off == lfs2->cfg->block_size) {
-            if (!(file->flags & LFS2_F_INLINE)) {
+            if (file->flags & LFS2_F_INLINE) {
+                file->block = LFS2_BLOCK_INLINE;
+                file->off = file->pos;
+            } else if (file->flags & LFS2_F_EXTENT) {
+                // extend file with the next contiguous block if we can
+                lfs2_alloc_ack(lfs2);
+                int err = lfs2_extent_extend(lfs2, file, nsize);
+                if (err) {
+                    file->flags |= LFS2_F_ERRED;
+                    LFS2_TRACE("lfs2_file_write -> %d", err);
+                    return err;
+                }
+            } else {
                 if (!(file->flags & LFS2_F_WRITING) && file->pos > 0) {
                     // find out which block we're extending from
                     int err = lfs2_ctz_find(lfs2, NULL, &file->cache,
@@ -2946,7 +4082,8 @@ lfs2_ssize_t lfs2_file_write(lfs2_t *lfs2, lfs2_file_t *file,
 
                 // extend file with new blocks
                 lfs2_alloc_ack(lfs2);
-                int err = lfs2_ctz_extend(lfs2, &file->cache, &lfs2->rcache,
+                int err = lfs2_ctz_extend(lfs2, file,
+                        &file->cache, &lfs2->rcache,
                         file->block, file->pos,
                         &file->block, &file->off);
                 if (err) {
@@ -2954,9 +4091,6 @@ lfs2_ssize_t lfs2_file_write(lfs2_t *lfs2, lfs2_file_t *file,
                     LFS2_TRACE("lfs2_file_write -> %d", err);
                     return err;
                 }
-            } else {
-                file->block = LFS2_BLOCK_INLINE;
-                file->off = file->pos;
             }
 
             file->flags |= LFS2_F_WRITING;
@@ -2978,6 +4112,7 @@ lfs2_ssize_t lfs2_file_write(lfs2_t *lfs2, lfs2_file_t *file,
 
             break;
 relocate:
+            LFS2_STAT(lfs2, relocations, 1);
             err = lfs2_file_relocate(lfs2, file);
             if (err) {
                 file->flags |= LFS2_F_ERRED;
@@ -3055,13 +4190,25 @@ int lfs2_file_truncate(lfs2_t *lfs2, lfs2_file_t *file, lfs2_off_t size) {
             return err;
         }
 
-        // lookup new head in ctz skip list
-        err = lfs2_ctz_find(lfs2, NULL, &file->cache,
-                file->ctz.head, file->ctz.size,
-                size, &file->block, &file->off);
-        if (err) {
-            LFS2_TRACE("lfs2_file_truncate -> %d", err);
-            return err;
+        if (file->flags & LFS2_F_EXTENT) {
+            // drop any extents past the new size
+            if (size == 0) {
+                file->ext_off = 0;
+            }
+            file->ext_keep = (file->ext_off + size + lfs2->cfg->block_size-1)
+                    / lfs2->cfg->block_size;
+            lfs2_extent_flush(file);
+            file->block = LFS2_BLOCK_NULL;
+            file->off = 0;
+        } else {
+            // lookup new head in ctz skip list
+            err = lfs2_ctz_find(lfs2, NULL, &file->cache,
+                    file->ctz.head, file->ctz.size,
+                    size, &file->block, &file->off);
+            if (err) {
+                LFS2_TRACE("lfs2_file_truncate -> %d", err);
+                return err;
+            }
         }
 
         file->ctz.head = file->block;
@@ -3098,6 +4245,114 @@ int lfs2_file_truncate(lfs2_t *lfs2, lfs2_file_t *file, lfs2_off_t size) {
     return 0;
 }
 
+int lfs2_file_trim(lfs2_t *lfs2, lfs2_file_t *file, lfs2_off_t size) {
+    LFS2_TRACE("lfs2_file_trim(%p, %p, %"PRIu32")",
+            (void*)lfs2, (void*)file, size);
+    LFS2_ASSERT(file->flags & LFS2_F_OPENED);
+    LFS2_ASSERT((file->flags & 3) != LFS2_O_RDONLY);
+
+    if (!(file->flags & LFS2_F_CIRCULAR)) {
+        LFS2_TRACE("lfs2_file_trim -> %d", LFS2_ERR_INVAL);
+        return LFS2_ERR_INVAL;
+    }
+
+    // need to flush since directly changing metadata
+    int err = lfs2_file_flush(lfs2, file);
+    if (err) {
+        LFS2_TRACE("lfs2_file_trim -> %d", err);
+        return err;
+    }
+
+    lfs2_extent_trim(lfs2, file, size, NULL);
+    LFS2_TRACE("lfs2_file_trim -> %d", 0);
+    return 0;
+}
+
+static lfs2_block_t lfs2_file_blocks(lfs2_t *lfs2, lfs2_file_t *file,
+        lfs2_off_t size) {
+    if (size == 0) {
+        return 0;
+    } else if (file->flags & LFS2_F_EXTENT) {
+        return (size + lfs2->cfg->block_size-1) / lfs2->cfg->block_size;
+    } else {
+        return lfs2_ctz_index(lfs2, &(lfs2_off_t){size-1}) + 1;
+    }
+}
+
+int lfs2_file_reserve(lfs2_t *lfs2, lfs2_file_t *file, lfs2_off_t size) {
+    LFS2_TRACE("lfs2_file_reserve(%p, %p, %"PRIu32")",
+            (void*)lfs2, (void*)file, size);
+    LFS2_ASSERT(file->flags & LFS2_F_OPENED);
+    LFS2_ASSERT((file->flags & 3) != LFS2_O_RDONLY);
+
+    if (size > lfs2->file_max) {
+        LFS2_TRACE("lfs2_file_reserve -> %d", LFS2_ERR_FBIG);
+        return LFS2_ERR_FBIG;
+    }
+
+    // release any previous reservation
+    lfs2_alloc_release(lfs2, file->reserve.block, file->reserve.count);
+    file->reserve.count = 0;
+
+    lfs2_off_t oldsize = lfs2_file_size(lfs2, file);
+    if (size <= oldsize) {
+        LFS2_TRACE("lfs2_file_reserve -> %d", 0);
+        return 0;
+    }
+
+    // the last block may be copied on write, so leave room for it
+    lfs2_block_t count = lfs2_file_blocks(lfs2, file, size)
+            - lfs2_file_blocks(lfs2, file, oldsize)
+            + (oldsize > 0 ? 1 : 0);
+
+    // find a run in the lookahead first, and only erase the blocks we keep
+    lfs2_alloc_ack(lfs2);
+    while (true) {
+        lfs2_block_t block;
+        lfs2_block_t found;
+        int err = lfs2_alloc_run(lfs2, count, &block, &found);
+        if (err) {
+            LFS2_TRACE("lfs2_file_reserve -> %d", err);
+            return err;
+        }
+
+        if (found < count) {
+            LFS2_DEBUG("No run of %"PRIu32" free blocks", count);
+            LFS2_TRACE("lfs2_file_reserve -> %d", LFS2_ERR_NOSPC);
+            return LFS2_ERR_NOSPC;
+        }
+
+        lfs2_block_t i = 0;
+        for (; i < count; i++) {
+            err = lfs2_bd_erase(lfs2, block+i);
+            if (err) {
+                break;
+            }
+        }
+
+        if (err) {
+            if (err == LFS2_ERR_CORRUPT) {
+                // try another run, the rest of this one is free again
+                // next time the lookahead comes around
+                LFS2_DEBUG("Bad block at 0x%"PRIx32, block+i);
+                lfs2_alloc_bad(lfs2, block+i);
+                continue;
+            }
+
+            LFS2_TRACE("lfs2_file_reserve -> %d", err);
+            return err;
+        }
+
+        file->reserve.block = block;
+        file->reserve.count = count;
+        file->flags |= LFS2_F_ERASED;
+        break;
+    }
+
+    LFS2_TRACE("lfs2_file_reserve -> %d", 0);
+    return 0;
+}
+
 lfs2_soff_t lfs2_file_tell(lfs2_t *lfs2, lfs2_file_t *file) {
     LFS2_TRACE("lfs2_file_tell(%p, %p)", (void*)lfs2, (void*)file);
     LFS2_ASSERT(file->flags & LFS2_F_OPENED);
@@ -3134,33 +4389,44 @@ lfs2_soff_t lfs2_file_size(lfs2_t *lfs2, lfs2_file_t *file) {
 
 
 /// General fs operations ///
-int lfs2_stat(lfs2_t *lfs2, const char *path, struct lfs2_info *info) {
-    LFS2_TRACE("lfs2_stat(%p, \"%s\", %p)", (void*)lfs2, path, (void*)info);
+static int lfs2_rawstat(lfs2_t *lfs2, const lfs2_block_t base[2],
+        const char *path, struct lfs2_info *info) {
     lfs2_mdir_t cwd;
-    lfs2_stag_t tag = lfs2_dir_find(lfs2, &cwd, &path, NULL);
+    lfs2_stag_t tag = lfs2_dir_findat(lfs2, &cwd, base, &path, NULL);
     if (tag < 0) {
-        LFS2_TRACE("lfs2_stat -> %"PRId32, tag);
         return (int)tag;
     }
 
-    int err = lfs2_dir_getinfo(lfs2, &cwd, lfs2_tag_id(tag), info);
+    return lfs2_dir_getinfo(lfs2, &cwd, lfs2_tag_id(tag), info);
+}
+
+int lfs2_stat(lfs2_t *lfs2, const char *path, struct lfs2_info *info) {
+    LFS2_TRACE("lfs2_stat(%p, \"%s\", %p)", (void*)lfs2, path, (void*)info);
+    int err = lfs2_rawstat(lfs2, NULL, path, info);
     LFS2_TRACE("lfs2_stat -> %d", err);
     return err;
 }
 
-int lfs2_remove(lfs2_t *lfs2, const char *path) {
-    LFS2_TRACE("lfs2_remove(%p, \"%s\")", (void*)lfs2, path);
+int lfs2_statat(lfs2_t *lfs2, lfs2_dir_t *dir,
+        const char *path, struct lfs2_info *info) {
+    LFS2_TRACE("lfs2_statat(%p, %p, \"%s\", %p)",
+            (void*)lfs2, (void*)dir, path, (void*)info);
+    int err = lfs2_rawstat(lfs2, dir->head, path, info);
+    LFS2_TRACE("lfs2_statat -> %d", err);
+    return err;
+}
+
+static int lfs2_rawremove(lfs2_t *lfs2, const lfs2_block_t base[2],
+        const char *path) {
     // deorphan if we haven't yet, needed at most once after poweron
     int err = lfs2_fs_forceconsistency(lfs2);
     if (err) {
-        LFS2_TRACE("lfs2_remove -> %d", err);
         return err;
     }
 
     lfs2_mdir_t cwd;
-    lfs2_stag_t tag = lfs2_dir_find(lfs2, &cwd, &path, NULL);
+    lfs2_stag_t tag = lfs2_dir_findat(lfs2, &cwd, base, &path, NULL);
     if (tag < 0 || lfs2_tag_id(tag) == 0x3ff) {
-        LFS2_TRACE("lfs2_remove -> %"PRId32, (tag < 0) ? tag : LFS2_ERR_INVAL);
         return (tag < 0) ? (int)tag : LFS2_ERR_INVAL;
     }
 
@@ -3172,19 +4438,16 @@ int lfs2_remove(lfs2_t *lfs2, const char *path) {
         lfs2_stag_t res = lfs2_dir_get(lfs2, &cwd, LFS2_MKTAG(0x700, 0x3ff, 0),
                 LFS2_MKTAG(LFS2_TYPE_STRUCT, lfs2_tag_id(tag), 8), pair);
         if (res < 0) {
-            LFS2_TRACE("lfs2_remove -> %"PRId32, res);
             return (int)res;
         }
         lfs2_pair_fromle32(pair);
 
         err = lfs2_dir_fetch(lfs2, &dir.m, pair);
         if (err) {
-            LFS2_TRACE("lfs2_remove -> %d", err);
             return err;
         }
 
         if (dir.m.count > 0 || dir.m.split) {
-            LFS2_TRACE("lfs2_remove -> %d", LFS2_ERR_NOTEMPTY);
             return LFS2_ERR_NOTEMPTY;
         }
 
@@ -3203,7 +4466,6 @@ int lfs2_remove(lfs2_t *lfs2, const char *path) {
             {LFS2_MKTAG(LFS2_TYPE_DELETE, lfs2_tag_id(tag), 0)}));
     if (err) {
         lfs2->mlist = dir.next;
-        LFS2_TRACE("lfs2_remove -> %d", err);
         return err;
     }
 
@@ -3214,21 +4476,33 @@ int lfs2_remove(lfs2_t *lfs2, const char *path) {
 
         err = lfs2_fs_pred(lfs2, dir.m.pair, &cwd);
         if (err) {
-            LFS2_TRACE("lfs2_remove -> %d", err);
             return err;
         }
 
         err = lfs2_dir_drop(lfs2, &cwd, &dir.m);
         if (err) {
-            LFS2_TRACE("lfs2_remove -> %d", err);
             return err;
         }
     }
 
-    LFS2_TRACE("lfs2_remove -> %d", 0);
     return 0;
 }
 
+int lfs2_remove(lfs2_t *lfs2, const char *path) {
+    LFS2_TRACE("lfs2_remove(%p, \"%s\")", (void*)lfs2, path);
+    int err = lfs2_rawremove(lfs2, NULL, path);
+    LFS2_TRACE("lfs2_remove -> %d", err);
+    return err;
+}
+
+int lfs2_removeat(lfs2_t *lfs2, lfs2_dir_t *dir, const char *path) {
+    LFS2_TRACE("lfs2_removeat(%p, %p, \"%s\")",
+            (void*)lfs2, (void*)dir, path);
+    int err = lfs2_rawremove(lfs2, dir->head, path);
+    LFS2_TRACE("lfs2_removeat -> %d", err);
+    return err;
+}
+
 int lfs2_rename(lfs2_t *lfs2, const char *oldpath, const char *newpath) {
     LFS2_TRACE("lfs2_rename(%p, \"%s\", \"%s\")", (void*)lfs2, oldpath, newpath);
 
@@ -3490,6 +4764,7 @@ static int lfs2_init(lfs2_t *lfs2, const struct lfs2_config *cfg) {
 
 
     // setup read cache
+    lfs2->rcache.capacity = lfs2->cfg->cache_size;
     if (lfs2->cfg->read_buffer) {
         lfs2->rcache.buffer = lfs2->cfg->read_buffer;
     } else {
@@ -3501,6 +4776,7 @@ static int lfs2_init(lfs2_t *lfs2, const struct lfs2_config *cfg) {
     }
 
     // setup program cache
+    lfs2->pcache.capacity = lfs2->cfg->cache_size;
     if (lfs2->cfg->prog_buffer) {
         lfs2->pcache.buffer = lfs2->cfg->prog_buffer;
     } else {
@@ -3529,6 +4805,31 @@ static int lfs2_init(lfs2_t *lfs2, const struct lfs2_config *cfg) {
         }
     }
 
+    // setup erase counts, must be 32-bit aligned and fit in the superblock
+    lfs2->wear = NULL;
+    if (lfs2->cfg->wear_regions) {
+        LFS2_ASSERT(lfs2->cfg->wear_regions <= lfs2->cfg->block_count &&
+                lfs2->cfg->wear_regions <= 255 &&
+                lfs2->cfg->wear_regions <= lfs2->cfg->block_size/32);
+        LFS2_ASSERT((uintptr_t)lfs2->cfg->wear_buffer % 4 == 0);
+        if (lfs2->cfg->wear_buffer) {
+            lfs2->wear = lfs2->cfg->wear_buffer;
+        } else {
+            lfs2->wear = lfs2_malloc(4*lfs2->cfg->wear_regions);
+            if (!lfs2->wear) {
+                err = LFS2_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+
+        memset(lfs2->wear, 0, 4*lfs2->cfg->wear_regions);
+    }
+
+    // no known bad blocks until mount
+    LFS2_ASSERT(LFS2_BADBLOCK_MAX <= 255);
+    lfs2->bad.count = 0;
+    lfs2->bad.dirty = false;
+
     // check that the size limits are sane
     LFS2_ASSERT(lfs2->cfg->name_max <= LFS2_NAME_MAX);
     lfs2->name_max = lfs2->cfg->name_max;
@@ -3548,11 +4849,27 @@ static int lfs2_init(lfs2_t *lfs2, const struct lfs2_config *cfg) {
         lfs2->attr_max = LFS2_ATTR_MAX;
     }
 
+    LFS2_ASSERT(lfs2->cfg->inline_max == (lfs2_size_t)-1 ||
+            (lfs2->cfg->inline_max <= LFS2_ATTR_MAX &&
+             lfs2->cfg->inline_max <= lfs2->cfg->block_size/4));
+    lfs2->inline_max = lfs2->cfg->inline_max;
+    if (lfs2->inline_max == (lfs2_size_t)-1) {
+        lfs2->inline_max = 0;
+    } else if (!lfs2->inline_max) {
+        lfs2->inline_max = lfs2_min(LFS2_ATTR_MAX, lfs2_min(
+                lfs2->cfg->cache_size, lfs2->cfg->block_size/8));
+    }
+
+    // new filesystems are formatted with the current version
+    lfs2->disk_version = LFS2_DISK_VERSION;
+
     // setup default state
     lfs2->root[0] = LFS2_BLOCK_NULL;
     lfs2->root[1] = LFS2_BLOCK_NULL;
     lfs2->mlist = NULL;
     lfs2->seed = 0;
+    lfs2->batch = NULL;
+    lfs2->allocs = 0;
     lfs2->gdisk = (lfs2_gstate_t){0};
     lfs2->gstate = (lfs2_gstate_t){0};
     lfs2->gdelta = (lfs2_gstate_t){0};
@@ -3581,6 +4898,10 @@ static int lfs2_deinit(lfs2_t *lfs2) {
         lfs2_free(lfs2->free.buffer);
     }
 
+    if (!lfs2->cfg->wear_buffer) {
+        lfs2_free(lfs2->wear);
+    }
+
     return 0;
 }
 
@@ -3593,14 +4914,14 @@ int lfs2_format(lfs2_t *lfs2, const struct lfs2_config *cfg) {
                 ".lookahead_size=%"PRIu32", .read_buffer=%p, "
                 ".prog_buffer=%p, .lookahead_buffer=%p, "
                 ".name_max=%"PRIu32", .file_max=%"PRIu32", "
-                ".attr_max=%"PRIu32"})",
+                ".attr_max=%"PRIu32", .inline_max=%"PRIu32"})",
             (void*)lfs2, (void*)cfg, cfg->context,
             (void*)(uintptr_t)cfg->read, (void*)(uintptr_t)cfg->prog,
             (void*)(uintptr_t)cfg->erase, (void*)(uintptr_t)cfg->sync,
             cfg->read_size, cfg->prog_size, cfg->block_size, cfg->block_count,
             cfg->block_cycles, cfg->cache_size, cfg->lookahead_size,
             cfg->read_buffer, cfg->prog_buffer, cfg->lookahead_buffer,
-            cfg->name_max, cfg->file_max, cfg->attr_max);
+            cfg->name_max, cfg->file_max, cfg->attr_max, cfg->inline_max);
     int err = 0;
     {
         err = lfs2_init(lfs2, cfg);
@@ -3651,9 +4972,13 @@ int lfs2_format(lfs2_t *lfs2, const struct lfs2_config *cfg) {
         }
 
         // force compaction to prevent accidentally mounting any
-        // older version of littlefs that may live on disk
+        // older version of littlefs that may live on disk, erases are
+        // counted from here if we're counting them
         root.erased = false;
-        err = lfs2_dir_commit(lfs2, &root, NULL, 0);
+        err = lfs2_dir_commit(lfs2, &root, (struct lfs2_mattr[]){
+                {LFS2_MKTAG(LFS2_TYPE_WEARSTATE, 0,
+                    4*lfs2->cfg->wear_regions), lfs2->wear}},
+                (lfs2->wear) ? 1 : 0);
         if (err) {
             goto cleanup;
         }
@@ -3674,14 +4999,14 @@ int lfs2_mount(lfs2_t *lfs2, const struct lfs2_config *cfg) {
                 ".lookahead_size=%"PRIu32", .read_buffer=%p, "
                 ".prog_buffer=%p, .lookahead_buffer=%p, "
                 ".name_max=%"PRIu32", .file_max=%"PRIu32", "
-                ".attr_max=%"PRIu32"})",
+                ".attr_max=%"PRIu32", .inline_max=%"PRIu32"})",
             (void*)lfs2, (void*)cfg, cfg->context,
             (void*)(uintptr_t)cfg->read, (void*)(uintptr_t)cfg->prog,
             (void*)(uintptr_t)cfg->erase, (void*)(uintptr_t)cfg->sync,
             cfg->read_size, cfg->prog_size, cfg->block_size, cfg->block_count,
             cfg->block_cycles, cfg->cache_size, cfg->lookahead_size,
             cfg->read_buffer, cfg->prog_buffer, cfg->lookahead_buffer,
-            cfg->name_max, cfg->file_max, cfg->attr_max);
+            cfg->name_max, cfg->file_max, cfg->attr_max, cfg->inline_max);
     int err = lfs2_init(lfs2, cfg);
     if (err) {
         LFS2_TRACE("lfs2_mount -> %d", err);
@@ -3691,6 +5016,7 @@ int lfs2_mount(lfs2_t *lfs2, const struct lfs2_config *cfg) {
     // scan directory blocks for superblock and any global updates
     lfs2_mdir_t dir = {.tail = {0, 1}};
     lfs2_block_t cycle = 0;
+    bool estimate = false;
     while (!lfs2_pair_isnull(dir.tail)) {
         if (cycle >= lfs2->cfg->block_count/2) {
             // loop detected
@@ -3738,6 +5064,7 @@ int lfs2_mount(lfs2_t *lfs2, const struct lfs2_config *cfg) {
                 err = LFS2_ERR_INVAL;
                 goto cleanup;
             }
+            lfs2->disk_version = superblock.version;
 
             // check superblock configuration
             if (superblock.name_max) {
@@ -3770,10 +5097,54 @@ int lfs2_mount(lfs2_t *lfs2, const struct lfs2_config *cfg) {
                     goto cleanup;
                 }
 
-                lfs2->attr_max = superblock.attr_max;
+                lfs2->attr_max = superblock.attr_max;
+            }
+
+            // grab erase counts, these are only valid if they were
+            // counted with the same number of regions
+            if (lfs2->wear) {
+                tag = lfs2_dir_get(lfs2, &dir, LFS2_MKTAG(0x7ff, 0x3ff, 0),
+                        LFS2_MKTAG(LFS2_TYPE_WEARSTATE, 0,
+                            4*lfs2->cfg->wear_regions),
+                        lfs2->wear);
+                if (tag < 0 && tag != LFS2_ERR_NOENT) {
+                    err = tag;
+                    goto cleanup;
+                }
+
+                if (tag < 0 ||
+                        lfs2_tag_size(tag) != 4*lfs2->cfg->wear_regions) {
+                    memset(lfs2->wear, 0, 4*lfs2->cfg->wear_regions);
+                    estimate = true;
+                }
+            }
+
+            // grab known bad blocks
+            uint32_t bad[LFS2_BADBLOCK_MAX];
+            tag = lfs2_dir_get(lfs2, &dir, LFS2_MKTAG(0x7ff, 0x3ff, 0),
+                    LFS2_MKTAG(LFS2_TYPE_BADBLOCKS, 0, sizeof(bad)), bad);
+            if (tag < 0 && tag != LFS2_ERR_NOENT) {
+                err = tag;
+                goto cleanup;
+            }
+
+            lfs2->bad.count = 0;
+            if (tag >= 0) {
+                lfs2->bad.count = lfs2_min(lfs2_tag_size(tag)/4,
+                        LFS2_BADBLOCK_MAX);
+                for (lfs2_size_t i = 0; i < lfs2->bad.count; i++) {
+                    lfs2->bad.blocks[i] = lfs2_fromle32(bad[i]);
+                }
             }
         }
 
+        // without saved erase counts, estimate them from metadata
+        // revision counts, each compaction erases one block of the pair
+        if (estimate) {
+            lfs2_wear_add(lfs2, dir.pair[0], dir.rev - dir.rev/2);
+            lfs2_wear_add(lfs2, dir.pair[1], dir.rev/2);
+        }
+
         // has gstate?
         err = lfs2_dir_getgstate(lfs2, &dir, &lfs2->gstate);
         if (err) {
@@ -3821,6 +5192,7 @@ int lfs2_unmount(lfs2_t *lfs2) {
 int lfs2_fs_traverseraw(lfs2_t *lfs2,
         int (*cb)(void *data, lfs2_block_t block), void *data,
         bool includeorphans) {
+    LFS2_STAT(lfs2, traversals, 1);
     // iterate over metadata pairs
     lfs2_mdir_t dir = {.tail = {0, 1}};
 
@@ -3870,12 +5242,44 @@ int lfs2_fs_traverseraw(lfs2_t *lfs2,
             }
             lfs2_ctz_fromle32(&ctz);
 
+            if (!lfs2_struct_isvalid(lfs2, tag)) {
+                LFS2_ERROR("Unsupported struct 0x%"PRIx16" "
+                        "in {0x%"PRIx32", 0x%"PRIx32"}",
+                        lfs2_tag_type3(tag), dir.pair[0], dir.pair[1]);
+                return LFS2_ERR_CORRUPT;
+            }
+
             if (lfs2_tag_type3(tag) == LFS2_TYPE_CTZSTRUCT) {
                 err = lfs2_ctz_traverse(lfs2, NULL, &lfs2->rcache,
                         ctz.head, ctz.size, cb, data);
                 if (err) {
                     return err;
                 }
+            } else if (lfs2_tag_type3(tag) == LFS2_TYPE_EXTSTRUCT ||
+                    lfs2_tag_type3(tag) == LFS2_TYPE_RINGSTRUCT) {
+                lfs2_off_t header = 4;
+                if (lfs2_tag_type3(tag) == LFS2_TYPE_RINGSTRUCT) {
+                    header = 12;
+                }
+
+                for (lfs2_off_t off = header;
+                        off < lfs2_tag_size(tag); off += 8) {
+                    struct lfs2_extent ext;
+                    lfs2_stag_t res = lfs2_dir_getslice(lfs2, &dir,
+                            LFS2_MKTAG(0x700, 0x3ff, 0),
+                            LFS2_MKTAG(LFS2_TYPE_STRUCT, id, sizeof(ext)),
+                            off, &ext, sizeof(ext));
+                    if (res < 0) {
+                        return res;
+                    }
+                    ext.block = lfs2_fromle32(ext.block);
+                    ext.count = lfs2_fromle32(ext.count);
+
+                    err = lfs2_extent_traverse(&ext, 1, cb, data);
+                    if (err) {
+                        return err;
+                    }
+                }
             } else if (includeorphans && 
                     lfs2_tag_type3(tag) == LFS2_TYPE_DIRSTRUCT) {
                 for (int i = 0; i < 2; i++) {
@@ -3894,8 +5298,25 @@ int lfs2_fs_traverseraw(lfs2_t *lfs2,
             continue;
         }
 
+        // reserved blocks are in use until written or released
+        int err = lfs2_extent_traverse(&f->reserve, 1, cb, data);
+        if (err) {
+            return err;
+        }
+
+        if ((f->flags & LFS2_F_EXTENT) && !(f->flags & LFS2_F_INLINE)) {
+            // committed and staged extents are tracked together
+            err = lfs2_extent_traverse(
+                    f->ext, f->ext_count, cb, data);
+            if (err) {
+                return err;
+            }
+
+            continue;
+        }
+
         if ((f->flags & LFS2_F_DIRTY) && !(f->flags & LFS2_F_INLINE)) {
-            int err = lfs2_ctz_traverse(lfs2, &f->cache, &lfs2->rcache,
+            err = lfs2_ctz_traverse(lfs2, &f->cache, &lfs2->rcache,
                     f->ctz.head, f->ctz.size, cb, data);
             if (err) {
                 return err;
@@ -3903,7 +5324,7 @@ int lfs2_fs_traverseraw(lfs2_t *lfs2,
         }
 
         if ((f->flags & LFS2_F_WRITING) && !(f->flags & LFS2_F_INLINE)) {
-            int err = lfs2_ctz_traverse(lfs2, &f->cache, &lfs2->rcache,
+            err = lfs2_ctz_traverse(lfs2, &f->cache, &lfs2->rcache,
                     f->block, f->pos, cb, data);
             if (err) {
                 return err;
@@ -3923,6 +5344,266 @@ int lfs2_fs_traverse(lfs2_t *lfs2,
     return err;
 }
 
+int lfs2_fs_stats(lfs2_t *lfs2, struct lfs2_stats *stats) {
+    LFS2_TRACE("lfs2_fs_stats(%p, %p)", (void*)lfs2, (void*)stats);
+    if (!lfs2->cfg->stats) {
+        LFS2_TRACE("lfs2_fs_stats -> %d", LFS2_ERR_INVAL);
+        return LFS2_ERR_INVAL;
+    }
+
+    *stats = *lfs2->cfg->stats;
+    LFS2_TRACE("lfs2_fs_stats -> %d", 0);
+    return 0;
+}
+
+int lfs2_fs_resetstats(lfs2_t *lfs2) {
+    LFS2_TRACE("lfs2_fs_resetstats(%p)", (void*)lfs2);
+    if (!lfs2->cfg->stats) {
+        LFS2_TRACE("lfs2_fs_resetstats -> %d", LFS2_ERR_INVAL);
+        return LFS2_ERR_INVAL;
+    }
+
+    memset(lfs2->cfg->stats, 0, sizeof(struct lfs2_stats));
+    LFS2_TRACE("lfs2_fs_resetstats -> %d", 0);
+    return 0;
+}
+
+struct lfs2_fs_wearlevel_cold {
+    lfs2_t *lfs2;
+    lfs2_size_t region;
+    lfs2_block_t count;
+};
+
+static int lfs2_fs_wearlevel_count(void *p, lfs2_block_t block) {
+    struct lfs2_fs_wearlevel_cold *cold = p;
+    cold->count += (lfs2_wear_region(cold->lfs2, block) == cold->region);
+    return 0;
+}
+
+static int lfs2_fs_wearlevel_cold(void *p, lfs2_block_t block) {
+    struct lfs2_fs_wearlevel_cold *cold = p;
+    return lfs2_wear_region(cold->lfs2, block) == cold->region;
+}
+
+// point the allocator at a region, the lookahead is scanned from there
+static void lfs2_fs_wearlevel_alloc(lfs2_t *lfs2, lfs2_size_t region) {
+    lfs2->free.off = lfs2_wear_start(lfs2, region);
+    lfs2->free.size = 0;
+    lfs2->free.i = 0;
+    lfs2_alloc_ack(lfs2);
+}
+
+static int lfs2_fs_wearlevel_move(lfs2_t *lfs2, const lfs2_block_t pair[2],
+        const char *name, lfs2_size_t hot) {
+    static const struct lfs2_file_config defaults = {0};
+    lfs2_file_t file;
+    int err = lfs2_file_rawopencfg(lfs2, &file, pair, name,
+            LFS2_O_RDWR, &defaults);
+    if (err) {
+        return err;
+    }
+
+    // writing back the first byte copies the rest of the file after it,
+    // with new blocks taken from the worn region
+    lfs2_fs_wearlevel_alloc(lfs2, hot);
+    uint8_t c;
+    lfs2_ssize_t res = lfs2_file_read(lfs2, &file, &c, 1);
+    if (res == 1) {
+        res = lfs2_file_seek(lfs2, &file, 0, LFS2_SEEK_SET);
+    }
+    if (res == 0) {
+        res = lfs2_file_write(lfs2, &file, &c, 1);
+    }
+
+    err = lfs2_file_close(lfs2, &file);
+    if (res < 0) {
+        return res;
+    }
+    return err;
+}
+
+// move one file with data in the least worn region, only ctz files are
+// moved, extent files keep the layout they were given
+static int lfs2_fs_wearlevel_evict(lfs2_t *lfs2,
+        struct lfs2_fs_wearlevel_cold *c, lfs2_size_t hot) {
+    lfs2_mdir_t dir = {.tail = {0, 1}};
+    lfs2_block_t cycle = 0;
+    while (!lfs2_pair_isnull(dir.tail)) {
+        if (cycle >= lfs2->cfg->block_count/2) {
+            // loop detected
+            return LFS2_ERR_CORRUPT;
+        }
+        cycle += 1;
+
+        int err = lfs2_dir_fetch(lfs2, &dir, dir.tail);
+        if (err) {
+            return err;
+        }
+
+        for (uint16_t id = 0; id < dir.count; id++) {
+            struct lfs2_ctz ctz;
+            lfs2_stag_t tag = lfs2_dir_get(lfs2, &dir,
+                    LFS2_MKTAG(0x700, 0x3ff, 0),
+                    LFS2_MKTAG(LFS2_TYPE_STRUCT, id, sizeof(ctz)), &ctz);
+            if (tag < 0 && tag != LFS2_ERR_NOENT) {
+                return tag;
+            }
+
+            if (tag < 0 || lfs2_tag_type3(tag) != LFS2_TYPE_CTZSTRUCT) {
+                continue;
+            }
+            lfs2_ctz_fromle32(&ctz);
+
+            // moving an open file would pull blocks out from under it
+            bool opened = false;
+            for (struct lfs2_mlist *m = lfs2->mlist; m; m = m->next) {
+                if (m->type == LFS2_TYPE_REG && m->id == id &&
+                        lfs2_pair_cmp(m->m.pair, dir.pair) == 0) {
+                    opened = true;
+                }
+            }
+
+            if (opened) {
+                continue;
+            }
+
+            int res = lfs2_ctz_traverse(lfs2, NULL, &lfs2->rcache,
+                    ctz.head, ctz.size, lfs2_fs_wearlevel_cold, c);
+            if (res < 0) {
+                return res;
+            }
+
+            if (!res) {
+                continue;
+            }
+
+            char name[LFS2_NAME_MAX+1];
+            tag = lfs2_dir_get(lfs2, &dir, LFS2_MKTAG(0x780, 0x3ff, 0),
+                    LFS2_MKTAG(LFS2_TYPE_NAME, id, lfs2->name_max), name);
+            if (tag < 0) {
+                return tag;
+            }
+            name[lfs2_tag_size(tag)] = '\0';
+
+            // a file too big to copy is left for later
+            err = lfs2_fs_wearlevel_move(lfs2, dir.pair, name, hot);
+            if (err && err != LFS2_ERR_NOSPC) {
+                return err;
+            }
+
+            if (!err) {
+                return 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int lfs2_fs_wearlevel(lfs2_t *lfs2) {
+    LFS2_TRACE("lfs2_fs_wearlevel(%p)", (void*)lfs2);
+    if (!lfs2->wear) {
+        LFS2_TRACE("lfs2_fs_wearlevel -> %d", 0);
+        return 0;
+    }
+
+    int err = lfs2_fs_forceconsistency(lfs2);
+    if (err) {
+        LFS2_TRACE("lfs2_fs_wearlevel -> %d", err);
+        return err;
+    }
+
+    // save erase counts next to the superblock
+    lfs2_mdir_t root;
+    err = lfs2_dir_fetch(lfs2, &root, lfs2->root);
+    if (err) {
+        LFS2_TRACE("lfs2_fs_wearlevel -> %d", err);
+        return err;
+    }
+
+    err = lfs2_dir_commit(lfs2, &root, LFS2_MKATTRS(
+            {LFS2_MKTAG(LFS2_TYPE_WEARSTATE, 0, 4*lfs2->cfg->wear_regions),
+                lfs2->wear}));
+    if (err) {
+        LFS2_TRACE("lfs2_fs_wearlevel -> %d", err);
+        return err;
+    }
+
+    // find the most and least worn regions
+    lfs2_size_t hot = 0;
+    lfs2_size_t cold = 0;
+    for (lfs2_size_t r = 1; r < lfs2->cfg->wear_regions; r++) {
+        if (lfs2_wear_avg(lfs2, r) > lfs2_wear_avg(lfs2, hot)) {
+            hot = r;
+        }
+
+        if (lfs2_wear_avg(lfs2, r) < lfs2_wear_avg(lfs2, cold)) {
+            cold = r;
+        }
+    }
+
+    if (!lfs2->cfg->wear_threshold ||
+            lfs2_wear_avg(lfs2, hot) - lfs2_wear_avg(lfs2, cold)
+                <= lfs2->cfg->wear_threshold) {
+        LFS2_TRACE("lfs2_fs_wearlevel -> %d", 0);
+        return 0;
+    }
+
+    // if the least worn region is mostly free, sending new writes there is
+    // enough, otherwise it is holding data that doesn't change
+    struct lfs2_fs_wearlevel_cold c = {lfs2, cold, 0};
+    err = lfs2_fs_traverseraw(lfs2, lfs2_fs_wearlevel_count, &c, true);
+    if (err) {
+        LFS2_TRACE("lfs2_fs_wearlevel -> %d", err);
+        return err;
+    }
+
+    if (c.count > (lfs2_wear_start(lfs2, cold+1)
+            - lfs2_wear_start(lfs2, cold)) / 2) {
+        err = lfs2_fs_wearlevel_evict(lfs2, &c, hot);
+        if (err) {
+            LFS2_TRACE("lfs2_fs_wearlevel -> %d", err);
+            return err;
+        }
+    }
+
+    // new writes pick up from the least worn region
+    lfs2_fs_wearlevel_alloc(lfs2, cold);
+    LFS2_TRACE("lfs2_fs_wearlevel -> %d", 0);
+    return 0;
+}
+
+int lfs2_fs_wear(lfs2_t *lfs2, struct lfs2_wear *wear) {
+    LFS2_TRACE("lfs2_fs_wear(%p, %p)", (void*)lfs2, (void*)wear);
+    if (!lfs2->wear) {
+        LFS2_TRACE("lfs2_fs_wear -> %d", LFS2_ERR_INVAL);
+        return LFS2_ERR_INVAL;
+    }
+
+    memset(wear, 0, sizeof(struct lfs2_wear));
+    wear->min = (uint32_t)-1;
+    for (lfs2_size_t r = 0; r < lfs2->cfg->wear_regions; r++) {
+        wear->min = lfs2_min(wear->min, lfs2_wear_avg(lfs2, r));
+        wear->max = lfs2_max(wear->max, lfs2_wear_avg(lfs2, r));
+        wear->erases += lfs2_fromle32(lfs2->wear[r]);
+    }
+    wear->avg = wear->erases / lfs2->cfg->block_count;
+
+    // each region goes in the bucket nearest its wear, so the least and
+    // most worn regions land in the first and last buckets
+    uint32_t range = wear->max - wear->min;
+    for (lfs2_size_t r = 0; r < lfs2->cfg->wear_regions; r++) {
+        lfs2_size_t bucket = (range == 0) ? 0
+                : (((uint64_t)(lfs2_wear_avg(lfs2, r) - wear->min)
+                    * (LFS2_WEAR_BUCKETS-1)) + range/2) / range;
+        wear->histogram[bucket] += lfs2_wear_start(lfs2, r+1)
+                - lfs2_wear_start(lfs2, r);
+    }
+
+    LFS2_TRACE("lfs2_fs_wear -> %d", 0);
+    return 0;
+}
+
 static int lfs2_fs_pred(lfs2_t *lfs2,
         const lfs2_block_t pair[2], lfs2_mdir_t *pdir) {
     // iterate over all directory directory entries
@@ -4214,6 +5895,71 @@ static int lfs2_fs_deorphan(lfs2_t *lfs2) {
     return 0;
 }
 
+static int lfs2_fs_savebad(lfs2_t *lfs2) {
+    if (!lfs2->bad.dirty) {
+        return 0;
+    }
+
+    // save known bad blocks next to the superblock, if this finds
+    // more bad blocks they are saved on the next write
+    uint32_t bad[LFS2_BADBLOCK_MAX];
+    lfs2_size_t count = lfs2->bad.count;
+    for (lfs2_size_t i = 0; i < count; i++) {
+        bad[i] = lfs2_tole32(lfs2->bad.blocks[i]);
+    }
+
+    lfs2_mdir_t root;
+    int err = lfs2_dir_fetch(lfs2, &root, lfs2->root);
+    if (err) {
+        return err;
+    }
+
+    lfs2->bad.dirty = false;
+    err = lfs2_dir_commit(lfs2, &root, LFS2_MKATTRS(
+            {LFS2_MKTAG(LFS2_TYPE_BADBLOCKS, 0, 4*count), bad}));
+    if (err) {
+        lfs2->bad.dirty = true;
+        return err;
+    }
+
+    return 0;
+}
+
+static int lfs2_fs_upgrade(lfs2_t *lfs2) {
+    if ((0xffff & lfs2->disk_version) >= LFS2_DISK_VERSION_MINOR) {
+        return 0;
+    }
+
+    // bump the minor version in the superblock before writing any
+    // structs an older littlefs wouldn't understand
+    lfs2_mdir_t root;
+    int err = lfs2_dir_fetch(lfs2, &root, lfs2->root);
+    if (err) {
+        return err;
+    }
+
+    lfs2_superblock_t superblock;
+    lfs2_stag_t tag = lfs2_dir_get(lfs2, &root, LFS2_MKTAG(0x7ff, 0x3ff, 0),
+            LFS2_MKTAG(LFS2_TYPE_INLINESTRUCT, 0, sizeof(superblock)),
+            &superblock);
+    if (tag < 0) {
+        return tag;
+    }
+
+    lfs2_superblock_fromle32(&superblock);
+    superblock.version = LFS2_DISK_VERSION;
+    lfs2_superblock_tole32(&superblock);
+    err = lfs2_dir_commit(lfs2, &root, LFS2_MKATTRS(
+            {LFS2_MKTAG(LFS2_TYPE_INLINESTRUCT, 0, sizeof(superblock)),
+                &superblock}));
+    if (err) {
+        return err;
+    }
+
+    lfs2->disk_version = LFS2_DISK_VERSION;
+    return 0;
+}
+
 static int lfs2_fs_forceconsistency(lfs2_t *lfs2) {
     int err = lfs2_fs_demove(lfs2);
     if (err) {
@@ -4225,6 +5971,11 @@ static int lfs2_fs_forceconsistency(lfs2_t *lfs2) {
         return err;
     }
 
+    err = lfs2_fs_savebad(lfs2);
+    if (err) {
+        return err;
+    }
+
     return 0;
 }
 
@@ -4248,6 +5999,123 @@ lfs2_ssize_t lfs2_fs_size(lfs2_t *lfs2) {
     return size;
 }
 
+int lfs2_fs_batchbegin(lfs2_t *lfs2, lfs2_batch_t *batch) {
+    LFS2_TRACE("lfs2_fs_batchbegin(%p, %p)", (void*)lfs2, (void*)batch);
+    LFS2_ASSERT(!lfs2->batch);
+    lfs2->batch = batch;
+    LFS2_TRACE("lfs2_fs_batchbegin -> %d", 0);
+    return 0;
+}
+
+int lfs2_fs_batchsync(lfs2_t *lfs2) {
+    LFS2_TRACE("lfs2_fs_batchsync(%p)", (void*)lfs2);
+    LFS2_ASSERT(lfs2->batch);
+    lfs2_batch_t *batch = lfs2->batch;
+    lfs2->batch = NULL;
+
+    int err = 0;
+    while (true) {
+        // find the next metadata pair with pending files
+        lfs2_file_t *first = NULL;
+        for (lfs2_file_t *f = (lfs2_file_t*)lfs2->mlist; f; f = f->next) {
+            if (f->type == LFS2_TYPE_REG && (f->flags & LFS2_F_PENDING) &&
+                    !lfs2_pair_isnull(f->m.pair)) {
+                first = f;
+                break;
+            }
+        }
+
+        if (!first) {
+            break;
+        }
+
+        // gather the pair's pending files into a single commit
+        lfs2_size_t count = 0;
+        for (lfs2_file_t *f = first; f && count < LFS2_BATCH_MAX;
+                f = f->next) {
+            if (f->type == LFS2_TYPE_REG && (f->flags & LFS2_F_PENDING) &&
+                    lfs2_pair_cmp(f->m.pair, first->m.pair) == 0) {
+                const void *data;
+                batch->attrs[2*count+0].tag = lfs2_file_struct(f,
+                        batch->buffers[count], &data);
+                batch->attrs[2*count+0].buffer = data;
+                batch->attrs[2*count+1].tag = LFS2_MKTAG(LFS2_FROM_USERATTRS,
+                        f->id, f->cfg->attr_count);
+                batch->attrs[2*count+1].buffer = f->cfg->attrs;
+                batch->files[count] = f;
+                count += 1;
+            }
+        }
+
+        err = lfs2_dir_commit(lfs2, &first->m, batch->attrs, 2*count);
+        for (lfs2_size_t i = 0; i < count; i++) {
+            batch->files[i]->flags &= ~LFS2_F_PENDING;
+            if (err) {
+                batch->files[i]->flags |= LFS2_F_ERRED;
+            } else {
+                batch->files[i]->flags &= ~LFS2_F_DIRTY;
+            }
+        }
+
+        if (err) {
+            break;
+        }
+    }
+
+    if (err) {
+        // anything left is committed by the next sync
+        for (lfs2_file_t *f = (lfs2_file_t*)lfs2->mlist; f; f = f->next) {
+            if (f->type == LFS2_TYPE_REG && (f->flags & LFS2_F_PENDING)) {
+                f->flags &= ~LFS2_F_PENDING;
+            }
+        }
+    }
+
+    LFS2_TRACE("lfs2_fs_batchsync -> %d", err);
+    return err;
+}
+
+int lfs2_fs_batchabort(lfs2_t *lfs2) {
+    LFS2_TRACE("lfs2_fs_batchabort(%p)", (void*)lfs2);
+    LFS2_ASSERT(lfs2->batch);
+    lfs2->batch = NULL;
+
+    int err = 0;
+    for (lfs2_file_t *f = (lfs2_file_t*)lfs2->mlist; f; f = f->next) {
+        if (f->type != LFS2_TYPE_REG || !(f->flags & LFS2_F_PENDING) ||
+                lfs2_pair_isnull(f->m.pair)) {
+            continue;
+        }
+
+        // drop the file's changes and reload what's on disk, the blocks
+        // it wrote are unreferenced and will be found by the allocator
+        f->flags &= ~(LFS2_F_PENDING | LFS2_F_DIRTY |
+                LFS2_F_WRITING | LFS2_F_READING);
+        lfs2_stag_t tag = lfs2_dir_get(lfs2, &f->m,
+                LFS2_MKTAG(0x700, 0x3ff, 0),
+                LFS2_MKTAG(LFS2_TYPE_STRUCT, f->id, 8), &f->ctz);
+        if (tag < 0) {
+            f->flags |= LFS2_F_ERRED;
+            err = tag;
+            continue;
+        }
+        lfs2_ctz_fromle32(&f->ctz);
+
+        int res = lfs2_file_fetch(lfs2, f, tag);
+        if (res) {
+            f->flags |= LFS2_F_ERRED;
+            err = res;
+            continue;
+        }
+
+        // and don't leave the position past the end we reloaded
+        f->pos = lfs2_min(f->pos, f->ctz.size);
+    }
+
+    LFS2_TRACE("lfs2_fs_batchabort -> %d", err);
+    return err;
+}
+
 #ifdef LFS2_MIGRATE
 ////// Migration from littelfs v1 below this //////
 
@@ -4678,14 +6546,14 @@ int lfs2_migrate(lfs2_t *lfs2, const struct lfs2_config *cfg) {
                 ".lookahead_size=%"PRIu32", .read_buffer=%p, "
                 ".prog_buffer=%p, .lookahead_buffer=%p, "
                 ".name_max=%"PRIu32", .file_max=%"PRIu32", "
-                ".attr_max=%"PRIu32"})",
+                ".attr_max=%"PRIu32", .inline_max=%"PRIu32"})",
             (void*)lfs2, (void*)cfg, cfg->context,
             (void*)(uintptr_t)cfg->read, (void*)(uintptr_t)cfg->prog,
             (void*)(uintptr_t)cfg->erase, (void*)(uintptr_t)cfg->sync,
             cfg->read_size, cfg->prog_size, cfg->block_size, cfg->block_count,
             cfg->block_cycles, cfg->cache_size, cfg->lookahead_size,
             cfg->read_buffer, cfg->prog_buffer, cfg->lookahead_buffer,
-            cfg->name_max, cfg->file_max, cfg->attr_max);
+            cfg->name_max, cfg->file_max, cfg->attr_max, cfg->inline_max);
     struct lfs21 lfs21;
     int err = lfs21_mount(lfs2, &lfs21, cfg);
     if (err) {
@@ -28,7 +28,7 @@ extern "C"
 // Version of On-disk data structures
 // Major (top-nibble), incremented on backwards incompatible changes
 // Minor (bottom-nibble), incremented on feature additions
-#define LFS2_DISK_VERSION 0x00020000
+#define LFS2_DISK_VERSION 0x00020001
 #define LFS2_DISK_VERSION_MAJOR (0xffff & (LFS2_DISK_VERSION >> 16))
 #define LFS2_DISK_VERSION_MINOR (0xffff & (LFS2_DISK_VERSION >>  0))
 
@@ -66,6 +66,33 @@ typedef uint32_t lfs2_block_t;
 #define LFS2_ATTR_MAX 1022
 #endif
 
+// Maximum number of extents in a file opened with LFS2_O_EXTENT, may be
+// redefined to trade RAM in the file struct for tolerance to fragmentation.
+// Files with more extents than this limit can not be opened.
+#ifndef LFS2_EXTENT_MAX
+#define LFS2_EXTENT_MAX 4
+#endif
+
+// Number of buckets in the wear histogram reported by lfs2_fs_wear, may be
+// redefined to trade stack for a finer histogram. Must be >= 2.
+#ifndef LFS2_WEAR_BUCKETS
+#define LFS2_WEAR_BUCKETS 8
+#endif
+
+// Maximum number of bad blocks remembered in the superblock so the allocator
+// never hands them out again, may be redefined. Blocks that go bad past this
+// limit are still relocated around, but may be retried. Limited to <= 255.
+#ifndef LFS2_BADBLOCK_MAX
+#define LFS2_BADBLOCK_MAX 8
+#endif
+
+// Maximum number of files in the same metadata pair that lfs2_fs_batchsync
+// writes in a single commit, sets the size of lfs2_batch_t. Additional files
+// are committed in further commits.
+#ifndef LFS2_BATCH_MAX
+#define LFS2_BATCH_MAX 8
+#endif
+
 // Possible error codes, these are negative to allow
 // valid positive return values
 enum lfs2_error {
@@ -109,9 +136,13 @@ enum lfs2_type {
     LFS2_TYPE_DIRSTRUCT      = 0x200,
     LFS2_TYPE_CTZSTRUCT      = 0x202,
     LFS2_TYPE_INLINESTRUCT   = 0x201,
+    LFS2_TYPE_EXTSTRUCT      = 0x203,
+    LFS2_TYPE_RINGSTRUCT     = 0x204,
     LFS2_TYPE_SOFTTAIL       = 0x600,
     LFS2_TYPE_HARDTAIL       = 0x601,
     LFS2_TYPE_MOVESTATE      = 0x7ff,
+    LFS2_TYPE_WEARSTATE      = 0x701,
+    LFS2_TYPE_BADBLOCKS      = 0x702,
 
     // internal chip sources
     LFS2_FROM_NOOP           = 0x000,
@@ -129,6 +160,9 @@ enum lfs2_open_flags {
     LFS2_O_EXCL   = 0x0200,    // Fail if a file already exists
     LFS2_O_TRUNC  = 0x0400,    // Truncate the existing file to zero size
     LFS2_O_APPEND = 0x0800,    // Move to end of file on every write
+    LFS2_O_EXTENT = 0x1000,    // Store new data in contiguous extents
+    LFS2_O_CIRCULAR = 0x2000,  // Store new data as a circular log
+    LFS2_O_RANDOM = 0x4000,    // Hint that reads are random, don't read ahead
 
     // internally used flags
     LFS2_F_DIRTY   = 0x010000, // File does not match storage
@@ -137,6 +171,10 @@ enum lfs2_open_flags {
     LFS2_F_ERRED   = 0x080000, // An error occured during write
     LFS2_F_INLINE  = 0x100000, // Currently inlined in directory entry
     LFS2_F_OPENED  = 0x200000, // File has been opened
+    LFS2_F_EXTENT  = 0x400000, // File is stored as a list of extents
+    LFS2_F_CIRCULAR = 0x800000, // File discards data past its capacity
+    LFS2_F_PENDING = 0x1000000, // File is waiting on lfs2_fs_batchsync
+    LFS2_F_ERASED  = 0x2000000, // Reserved blocks are already erased
 };
 
 // File seek flags
@@ -147,6 +185,53 @@ enum lfs2_whence_flags {
 };
 
 
+// Counts of block device and internal operations
+struct lfs2_stats {
+    // Block device operations and the bytes they transferred
+    uint32_t reads;
+    uint32_t progs;
+    uint32_t erases;
+    uint32_t syncs;
+    uint32_t read_bytes;
+    uint32_t prog_bytes;
+
+    // Block device reads served from the pcache or a read cache, reads that
+    // had to fill a read cache, and reads large enough to bypass the
+    // caches. Inline files read through the file cache are only counted by
+    // the reads that fill it
+    uint32_t pcache_hits;
+    uint32_t rcache_hits;
+    uint32_t rcache_misses;
+    uint32_t rcache_bypasses;
+
+    // Filesystem traversals, mostly to find free blocks, and blocks
+    // allocated
+    uint32_t traversals;
+    uint32_t allocs;
+
+    // Metadata compactions and splits, and blocks relocated because they
+    // went bad or were worn past block_cycles
+    uint32_t compactions;
+    uint32_t splits;
+    uint32_t relocations;
+};
+
+// Approximate erases per block, see lfs2_fs_wear
+struct lfs2_wear {
+    // Erases per block of the least and most worn regions, and over the
+    // whole disk
+    uint32_t min;
+    uint32_t max;
+    uint32_t avg;
+
+    // Total erases counted
+    uint32_t erases;
+
+    // Number of blocks in each bucket of erases per block, bucket i holds
+    // the blocks nearest min + i*(max-min)/(LFS2_WEAR_BUCKETS-1)
+    lfs2_size_t histogram[LFS2_WEAR_BUCKETS];
+};
+
 // Configuration provided during initialization of the littlefs
 struct lfs2_config {
     // Opaque user provided context that can be used to pass
@@ -240,6 +325,37 @@ struct lfs2_config {
     // larger attributes size but must be <= LFS2_ATTR_MAX. Defaults to
     // LFS2_ATTR_MAX when zero.
     lfs2_size_t attr_max;
+
+    // Optional upper limit on the size of files stored inline in their
+    // metadata pair. Inline files avoid allocating a block, but are held
+    // entirely in their file's buffer, so each file buffer grows to the
+    // larger of cache_size and inline_max. Must be <= LFS2_ATTR_MAX and
+    // <= block_size/4. Defaults to the smaller of cache_size and
+    // block_size/8 when zero. Set to -1 to disable inline files.
+    lfs2_size_t inline_max;
+
+    // Optional counters for block device and internal operations, see
+    // lfs2_fs_stats. Must stay allocated while the filesystem is mounted.
+    // Counting is disabled when NULL.
+    struct lfs2_stats *stats;
+
+    // Optional number of regions to count erases in for static
+    // wear-leveling, see lfs2_fs_wearlevel. Blocks are split evenly between
+    // the regions, and each region costs 4 bytes of RAM and 4 bytes in the
+    // superblock. Must be <= block_count, <= 255, and <= block_size/32.
+    // Erases are not counted when zero.
+    lfs2_size_t wear_regions;
+
+    // Optional statically allocated buffer for the erase counts. Must be
+    // 4*wear_regions and aligned to a 32-bit boundary. By default lfs2_malloc
+    // is used to allocate this buffer.
+    void *wear_buffer;
+
+    // Number of erases per block a region may fall behind the most worn
+    // region before lfs2_fs_wearlevel moves file data out of it. Smaller
+    // values give more even wear at the cost of moving data more often.
+    // Zero only counts erases.
+    uint32_t wear_threshold;
 };
 
 // File info structure
@@ -273,8 +389,9 @@ struct lfs2_attr {
 
 // Optional configuration provided during lfs2_file_opencfg
 struct lfs2_file_config {
-    // Optional statically allocated file buffer. Must be cache_size.
-    // By default lfs2_malloc is used to allocate this buffer.
+    // Optional statically allocated file buffer. Must be the larger of
+    // the file's cache_size and inline_max. By default lfs2_malloc is used
+    // to allocate this buffer.
     void *buffer;
 
     // Optional list of custom attributes related to the file. If the file
@@ -292,6 +409,18 @@ struct lfs2_file_config {
 
     // Number of custom attributes in the list
     lfs2_size_t attr_count;
+
+    // Capacity of a circular file in bytes, required when LFS2_O_CIRCULAR
+    // creates or truncates a file. Stored with the file, so reopening an
+    // existing circular file uses its stored capacity.
+    lfs2_size_t circular_size;
+
+    // Optional size of this file's cache in bytes. Smaller caches save RAM
+    // for small files, larger caches coalesce more data per program for
+    // large sequential files. Must be a multiple of the read and program
+    // sizes, and a factor of the block size. Defaults to the filesystem's
+    // cache_size when zero.
+    lfs2_size_t cache_size;
 };
 
 
@@ -300,6 +429,7 @@ typedef struct lfs2_cache {
     lfs2_block_t block;
     lfs2_off_t off;
     lfs2_size_t size;
+    lfs2_size_t capacity;
     uint8_t *buffer;
 } lfs2_cache_t;
 
@@ -337,6 +467,23 @@ typedef struct lfs2_file {
         lfs2_size_t size;
     } ctz;
 
+    // runs of contiguous blocks for extent files, new extents are staged
+    // after the committed extents until the next flush, with one spare for
+    // staging a copy of a partial block before its extent is dropped
+    struct lfs2_extent {
+        lfs2_block_t block;
+        lfs2_block_t count;
+    } ext[LFS2_EXTENT_MAX+1];
+    lfs2_size_t ext_count;
+    lfs2_size_t ext_committed;
+    lfs2_block_t ext_keep;
+    lfs2_off_t ext_off;
+    lfs2_size_t capacity;
+
+    // blocks set aside for the file, by lfs2_file_reserve or as the rest of
+    // the run an extent file is growing into
+    struct lfs2_extent reserve;
+
     uint32_t flags;
     lfs2_off_t pos;
     lfs2_block_t block;
@@ -346,6 +493,16 @@ typedef struct lfs2_file {
     const struct lfs2_file_config *cfg;
 } lfs2_file_t;
 
+// littlefs batch type, scratch space for committing batched file syncs
+typedef struct lfs2_batch {
+    lfs2_file_t *files[LFS2_BATCH_MAX];
+    struct lfs2_mattr {
+        uint32_t tag;
+        const void *buffer;
+    } attrs[2*LFS2_BATCH_MAX];
+    uint32_t buffers[LFS2_BATCH_MAX][3 + 2*LFS2_EXTENT_MAX];
+} lfs2_batch_t;
+
 typedef struct lfs2_superblock {
     uint32_t version;
     lfs2_size_t block_size;
@@ -373,6 +530,7 @@ typedef struct lfs2 {
         lfs2_mdir_t m;
     } *mlist;
     uint32_t seed;
+    lfs2_batch_t *batch;
 
     lfs2_gstate_t gstate;
     lfs2_gstate_t gdisk;
@@ -385,11 +543,22 @@ typedef struct lfs2 {
         lfs2_block_t ack;
         uint32_t *buffer;
     } free;
+    uint32_t allocs;
+    // erase counts per region, kept little-endian so they can be committed
+    // as they are
+    uint32_t *wear;
+    struct lfs2_bad {
+        lfs2_size_t count;
+        bool dirty;
+        lfs2_block_t blocks[LFS2_BADBLOCK_MAX];
+    } bad;
 
     const struct lfs2_config *cfg;
     lfs2_size_t name_max;
     lfs2_size_t file_max;
     lfs2_size_t attr_max;
+    lfs2_size_t inline_max;
+    uint32_t disk_version;
 
 #ifdef LFS2_MIGRATE
     struct lfs21 *lfs21;
@@ -432,6 +601,15 @@ int lfs2_unmount(lfs2_t *lfs2);
 // Returns a negative error code on failure.
 int lfs2_remove(lfs2_t *lfs2, const char *path);
 
+// Removes a file or directory relative to an open directory
+//
+// Relative paths are looked up starting from dir instead of the root, so
+// none of dir's ancestors are walked. Absolute paths still start from the
+// root, and a leading ".." that would leave dir returns LFS2_ERR_INVAL.
+//
+// Returns a negative error code on failure.
+int lfs2_removeat(lfs2_t *lfs2, lfs2_dir_t *dir, const char *path);
+
 // Rename or move a file or directory
 //
 // If the destination exists, it must match the source in type.
@@ -446,6 +624,14 @@ int lfs2_rename(lfs2_t *lfs2, const char *oldpath, const char *newpath);
 // Returns a negative error code on failure.
 int lfs2_stat(lfs2_t *lfs2, const char *path, struct lfs2_info *info);
 
+// Find info about a file or directory relative to an open directory
+//
+// Paths are looked up the same as in lfs2_removeat.
+//
+// Returns a negative error code on failure.
+int lfs2_statat(lfs2_t *lfs2, lfs2_dir_t *dir,
+        const char *path, struct lfs2_info *info);
+
 // Get a custom attribute
 //
 // Custom attributes are uniquely identified by an 8-bit type and limited
@@ -495,6 +681,27 @@ int lfs2_file_open(lfs2_t *lfs2, lfs2_file_t *file,
 // The mode that the file is opened in is determined by the flags, which
 // are values from the enum lfs2_open_flags that are bitwise-ored together.
 //
+// If LFS2_O_EXTENT is provided, a new or truncated file is stored as up to
+// LFS2_EXTENT_MAX runs of consecutive blocks instead of a CTZ skip-list.
+// Extent files have no per-block pointers and seek in constant time. A file
+// grows in place into the free blocks after its last run if it can, and
+// otherwise sets aside a new run the size of the file so far or of the
+// write, whichever is larger. The unused tail of a run stays set aside for
+// the file until it is closed or other allocations need it. Writes fail with
+// LFS2_ERR_NOSPC if the data can not be laid out in that many runs, which
+// can happen early if other files allocate the blocks after the last run.
+// Existing files keep their layout.
+//
+// If LFS2_O_CIRCULAR is provided, a new or truncated file is stored as a
+// circular log of extents with the capacity in the config's circular_size.
+// Circular files are never inlined, so even an empty one takes a block once
+// it is synced. Writes past the capacity discard the oldest data in whole
+// blocks, and lfs2_file_trim can discard data from the front of the file.
+// When there is no run left to grow into, writes wrap around into the oldest
+// blocks, which commits the file's metadata as if by lfs2_file_sync. While
+// syncs are batched by lfs2_fs_batchbegin, writes don't wrap and may fail
+// with LFS2_ERR_NOSPC instead.
+//
 // The config struct provides additional config options per file as described
 // above. The config struct must be allocated while the file is open, and the
 // config struct must be zeroed for defaults and backwards compatibility.
@@ -504,6 +711,25 @@ int lfs2_file_opencfg(lfs2_t *lfs2, lfs2_file_t *file,
         const char *path, int flags,
         const struct lfs2_file_config *config);
 
+// Open a file relative to an open directory
+//
+// Paths are looked up the same as in lfs2_removeat. The directory only
+// needs to stay open for the call, the file does not depend on it after.
+//
+// Returns a negative error code on failure.
+int lfs2_file_openat(lfs2_t *lfs2, lfs2_dir_t *dir, lfs2_file_t *file,
+        const char *path, int flags);
+
+// Open a file relative to an open directory with extra configuration
+//
+// Paths are looked up the same as in lfs2_removeat, the config is the same
+// as in lfs2_file_opencfg.
+//
+// Returns a negative error code on failure.
+int lfs2_file_opencfgat(lfs2_t *lfs2, lfs2_dir_t *dir, lfs2_file_t *file,
+        const char *path, int flags,
+        const struct lfs2_file_config *cfg);
+
 // Close a file
 //
 // Any pending writes are written out to storage as though
@@ -546,6 +772,27 @@ lfs2_soff_t lfs2_file_seek(lfs2_t *lfs2, lfs2_file_t *file,
 // Returns a negative error code on failure.
 int lfs2_file_truncate(lfs2_t *lfs2, lfs2_file_t *file, lfs2_off_t size);
 
+// Discards data from the front of a circular file
+//
+// Drops the first size bytes of the file and moves the file position back
+// by the same amount. Only the file's metadata is updated, and any blocks
+// that no longer contain file data are released on the next sync.
+//
+// Returns a negative error code on failure.
+int lfs2_file_trim(lfs2_t *lfs2, lfs2_file_t *file, lfs2_off_t size);
+
+// Reserves storage for the file to grow to the specified size
+//
+// Allocates and erases a contiguous run of blocks large enough for the file
+// to be written up to size bytes. Writes use up these blocks before searching
+// for free blocks, and skip erasing them, making the cost and failure point
+// of streaming writes predictable. Reserved blocks are released when the file
+// is closed, and reserving again replaces the previous reservation.
+//
+// Returns LFS2_ERR_NOSPC if no contiguous run is available, or a negative
+// error code on failure.
+int lfs2_file_reserve(lfs2_t *lfs2, lfs2_file_t *file, lfs2_off_t size);
+
 // Return the position of the file
 //
 // Equivalent to lfs2_file_seek(lfs2, file, 0, LFS2_SEEK_CUR)
@@ -591,10 +838,46 @@ int lfs2_dir_close(lfs2_t *lfs2, lfs2_dir_t *dir);
 // or a negative error code on failure.
 int lfs2_dir_read(lfs2_t *lfs2, lfs2_dir_t *dir, struct lfs2_info *info);
 
+// Read a batch of entries in the directory
+//
+// Fills out up to count info structures with the next entries, reading
+// each metadata pair of the directory once. If attr_count is nonzero, each
+// attr's buffer must hold count attributes of the attr's size, and entry
+// i's custom attribute is written at offset i*size. Attributes that are
+// missing or smaller than size are padded with zeros.
+//
+// Returns the number of entries read, 0 at the end of directory,
+// or a negative error code on failure.
+lfs2_ssize_t lfs2_dir_readbatch(lfs2_t *lfs2, lfs2_dir_t *dir,
+        struct lfs2_info *info, lfs2_size_t count,
+        const struct lfs2_attr *attrs, lfs2_size_t attr_count);
+
+// Read the next entry in the directory with a name in a range
+//
+// Only entries with names >= start and < stop are read, comparing names
+// as strcmp does, so a name sorts before any longer name it is a prefix
+// of. Either bound may be NULL. '.' and '..' are never read. A prefix query
+// can use the prefix as start and the prefix with its last byte
+// incremented as stop.
+//
+// Names are kept sorted within each metadata pair, so metadata pairs are
+// skipped over with a binary search instead of reading every entry.
+// Entries come out in directory order, which is not the order above:
+// metadata pairs keep longer names before their prefixes, and names are
+// not sorted across metadata pairs.
+//
+// Returns a positive value on success, 0 at the end of directory,
+// or a negative error code on failure.
+int lfs2_dir_readrange(lfs2_t *lfs2, lfs2_dir_t *dir,
+        const char *start, const char *stop, struct lfs2_info *info);
+
 // Change the position of the directory
 //
 // The new off must be a value previous returned from tell and specifies
-// an absolute offset in the directory seek.
+// an absolute offset in the directory seek. Seeking forward from the
+// metadata pair the directory is currently reading, such as to a value
+// just returned from tell, continues from that pair instead of walking the
+// directory from the start.
 //
 // Returns a negative error code on failure.
 int lfs2_dir_seek(lfs2_t *lfs2, lfs2_dir_t *dir, lfs2_off_t off);
@@ -632,6 +915,85 @@ lfs2_ssize_t lfs2_fs_size(lfs2_t *lfs2);
 // Returns a negative error code on failure.
 int lfs2_fs_traverse(lfs2_t *lfs2, int (*cb)(void*, lfs2_block_t), void *data);
 
+// Get the operation counts in the stats struct provided in the config
+//
+// Counts accumulate from when the struct is zeroed or lfs2_fs_resetstats is
+// called. To find out what a single call did, reset before the call and
+// read the counts after it.
+//
+// Returns a negative error code on failure, LFS2_ERR_INVAL if the config
+// does not provide a stats struct.
+int lfs2_fs_stats(lfs2_t *lfs2, struct lfs2_stats *stats);
+
+// Reset the operation counts in the stats struct provided in the config
+//
+// Returns a negative error code on failure, LFS2_ERR_INVAL if the config
+// does not provide a stats struct.
+int lfs2_fs_resetstats(lfs2_t *lfs2);
+
+// Saves the erase counts and moves cold data onto worn blocks
+//
+// Dynamic wear-leveling only moves data that is rewritten, so files that
+// never change pin their blocks and the remaining blocks wear faster. With
+// wear_regions set, littlefs counts erases in each region of the disk. This
+// writes the counts to the superblock, and if a region has fallen more than
+// wear_threshold erases per block behind the most worn region, rewrites one
+// file with data in that region onto the most worn region. Open files are
+// left alone.
+//
+// Erases since the last call are lost on power-loss or unmount, so call this
+// periodically, for example when idle or before unmounting. Moving a file
+// costs as much as rewriting it.
+//
+// Returns a negative error code on failure.
+int lfs2_fs_wearlevel(lfs2_t *lfs2);
+
+// Get approximate erases per block
+//
+// Reports the erase counts kept with wear_regions. Counts are per region,
+// so every block in a region is treated as equally worn. Erases since the
+// last lfs2_fs_wearlevel are included but are only saved by that call. If
+// no counts were saved, they start from an estimate made on mount from how
+// often each metadata pair has been compacted.
+//
+// Returns a negative error code on failure, LFS2_ERR_INVAL if erases are
+// not being counted.
+int lfs2_fs_wear(lfs2_t *lfs2, struct lfs2_wear *wear);
+
+// Begins batching file syncs
+//
+// While a batch is open, lfs2_file_sync writes out file data but defers
+// the metadata commit to lfs2_fs_batchsync, which commits the files that
+// share a metadata pair together. This saves a commit per file, and each
+// pair's commit is atomic for its files, but the batch as a whole is not.
+// Pairs are committed one after another, and a power-loss between them
+// leaves some pairs committed and others not.
+//
+// Only file syncs are batched. Closing a file commits it immediately, and
+// directory operations and lfs2_setattr take effect immediately. Removing
+// or renaming an open file detaches it and drops its deferred changes.
+//
+// The batch struct is scratch space for lfs2_fs_batchsync and must stay
+// allocated until the batch ends.
+//
+// Returns a negative error code on failure.
+int lfs2_fs_batchbegin(lfs2_t *lfs2, lfs2_batch_t *batch);
+
+// Commits all files synced since lfs2_fs_batchbegin and ends the batch
+//
+// Returns a negative error code on failure. On failure, files that were
+// not yet committed keep their changes until their next sync.
+int lfs2_fs_batchsync(lfs2_t *lfs2);
+
+// Ends the batch without committing
+//
+// Files synced since lfs2_fs_batchbegin drop their changes and reload their
+// last committed state, positions past the reloaded end are moved back to
+// the end.
+//
+// Returns a negative error code on failure.
+int lfs2_fs_batchabort(lfs2_t *lfs2);
+
 #ifdef LFS2_MIGRATE
 // Attempts to migrate a previous version of littlefs
 //
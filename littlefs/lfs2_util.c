@@ -29,5 +29,129 @@ uint32_t lfs2_crc(uint32_t crc, const void *buffer, size_t size) {
     return crc;
 }
 
+#endif
+
+#ifdef LFS2_YES_TRACE_BINARY
+#include "lfs2.h"
+#include <stdarg.h>
+
+static struct lfs2_trace_record *lfs2_trace_buffer;
+static uint32_t lfs2_trace_count;
+static uint32_t lfs2_trace_seq;
+static uint32_t (*lfs2_trace_clock)(void);
+static const struct lfs2_stats *lfs2_trace_stats;
+
+void lfs2_trace_setbuffer(struct lfs2_trace_record *buffer, uint32_t count,
+        uint32_t (*clock)(void), const struct lfs2_stats *stats) {
+    lfs2_trace_buffer = buffer;
+    lfs2_trace_count = buffer ? count : 0;
+    lfs2_trace_seq = 0;
+    lfs2_trace_clock = clock;
+    lfs2_trace_stats = stats;
+    if (buffer) {
+        memset(buffer, 0, count*sizeof(struct lfs2_trace_record));
+    }
+}
+
+// kinds of trace arguments, as read from va_args
+enum {
+    LFS2_TRACE_INT,
+    LFS2_TRACE_LONG,
+    LFS2_TRACE_LLONG,
+    LFS2_TRACE_SIZE,
+    LFS2_TRACE_PTR,
+    LFS2_TRACE_STR,
+};
+
+static void lfs2_trace_parse(struct lfs2_trace_point *point,
+        const char *fmt) {
+    // find the kind of each argument from the format, once per trace point
+    lfs2_size_t argc = 0;
+    for (const char *p = strchr(fmt, '%'); p; p = strchr(p, '%')) {
+        p += 1;
+        if (*p == '%') {
+            p += 1;
+            continue;
+        }
+
+        // skip flags, width and precision
+        p += strspn(p, "-+ #0123456789.");
+        int longs = 0;
+        while (*p == 'l' || *p == 'h' || *p == 'z') {
+            longs += (*p == 'l') ? 1 : (*p == 'z') ? 3 : 0;
+            p += 1;
+        }
+
+        if (*p == '\0') {
+            break;
+        }
+
+        if (argc < LFS2_TRACE_ARGS) {
+            point->kinds[argc] =
+                    (*p == 'p') ? LFS2_TRACE_PTR :
+                    (*p == 's') ? LFS2_TRACE_STR :
+                    (longs >= 3) ? LFS2_TRACE_SIZE :
+                    (longs == 2) ? LFS2_TRACE_LLONG :
+                    (longs == 1) ? LFS2_TRACE_LONG :
+                    LFS2_TRACE_INT;
+        }
+        argc += 1;
+        p += 1;
+    }
+
+    point->argc = lfs2_min(argc, 0xfe) + 1;
+}
+
+void lfs2_trace(struct lfs2_trace_point *point, const char *fmt, ...) {
+    if (!lfs2_trace_count) {
+        return;
+    }
+
+    if (!point->argc) {
+        lfs2_trace_parse(point, fmt);
+    }
+
+    // 0 marks unused records
+    lfs2_trace_seq += 1;
+    if (lfs2_trace_seq == 0) {
+        lfs2_trace_seq = 1;
+    }
+
+    struct lfs2_trace_record *r =
+            &lfs2_trace_buffer[lfs2_trace_seq % lfs2_trace_count];
+    memset(r, 0, sizeof(struct lfs2_trace_record));
+    r->seq = lfs2_trace_seq;
+    r->time = lfs2_trace_clock ? lfs2_trace_clock() : 0;
+    r->line = point->line;
+    r->file = point->file;
+    r->argc = point->argc - 1;
+    if (lfs2_trace_stats) {
+        r->reads = lfs2_trace_stats->reads;
+        r->progs = lfs2_trace_stats->progs;
+        r->erases = lfs2_trace_stats->erases;
+    }
+
+    // copy the raw arguments we have room for, no formatting needed
+    va_list va;
+    va_start(va, fmt);
+    for (lfs2_size_t i = 0; i < lfs2_min(r->argc, LFS2_TRACE_ARGS); i++) {
+        uint8_t kind = point->kinds[i];
+        if (kind == LFS2_TRACE_PTR) {
+            r->args[i] = (uint32_t)(uintptr_t)va_arg(va, void*);
+        } else if (kind == LFS2_TRACE_STR) {
+            const char *str = va_arg(va, const char*);
+            r->args[i] = str ? lfs2_crc(0xffffffff, str, strlen(str)) : 0;
+        } else if (kind == LFS2_TRACE_SIZE) {
+            r->args[i] = (uint32_t)va_arg(va, size_t);
+        } else if (kind == LFS2_TRACE_LLONG) {
+            r->args[i] = (uint32_t)va_arg(va, long long);
+        } else if (kind == LFS2_TRACE_LONG) {
+            r->args[i] = (uint32_t)va_arg(va, long);
+        } else {
+            r->args[i] = (uint32_t)va_arg(va, int);
+        }
+    }
+    va_end(va);
+}
 #endif
 #endif
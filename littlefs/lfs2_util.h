@@ -62,7 +62,13 @@ extern "C"
 #endif
 
 // Logging functions
-#if defined(LFS2_YES_TRACE) && MBED_LFS2_ENABLE_TRACE
+#if defined(LFS2_YES_TRACE_BINARY)
+#define LFS2_TRACE_AT(file, ...) do { \
+        static struct lfs2_trace_point lfs2_trace_point_ = {file, __LINE__}; \
+        lfs2_trace(&lfs2_trace_point_, __VA_ARGS__); \
+    } while (0)
+#define LFS2_TRACE(...) LFS2_TRACE_AT(LFS2_TRACE_LFS2, __VA_ARGS__)
+#elif defined(LFS2_YES_TRACE) && MBED_LFS2_ENABLE_TRACE
 #define LFS2_TRACE_(fmt, ...) \
     printf("%s:%d:trace: " fmt "%s\n", __FILE__, __LINE__, __VA_ARGS__)
 #define LFS2_TRACE(...) LFS2_TRACE_(__VA_ARGS__, "")
@@ -74,6 +80,72 @@ extern "C"
 #define LFS2_TRACE(...)
 #endif
 
+#ifndef LFS2_TRACE_AT
+// Trace from a source file other than lfs2.c, only binary traces record
+// which file
+#define LFS2_TRACE_AT(file, ...) LFS2_TRACE(__VA_ARGS__)
+#endif
+
+#ifdef LFS2_YES_TRACE_BINARY
+// Binary tracing, instead of formatting text each trace point writes a
+// fixed-size record into a ring buffer, which scripts/readtrace.py decodes
+// against the source. Records are identified by the file and line of the
+// trace point.
+#ifndef LFS2_TRACE_ARGS
+#define LFS2_TRACE_ARGS 4
+#endif
+
+// Source files that can be traced
+enum lfs2_trace_file {
+    LFS2_TRACE_LFS2     = 0,
+    LFS2_TRACE_FILEBD   = 1,
+    LFS2_TRACE_RAMBD    = 2,
+    LFS2_TRACE_TESTBD   = 3,
+};
+
+// A trace point, one of these is kept statically for each LFS2_TRACE. The
+// kind of each argument is parsed from the format on the first record, so
+// later records only copy arguments.
+struct lfs2_trace_point {
+    uint8_t file;
+    uint16_t line;
+    // number of arguments plus one, 0 until the format is parsed
+    uint8_t argc;
+    uint8_t kinds[LFS2_TRACE_ARGS];
+};
+
+struct lfs2_trace_record {
+    // sequence number of the record, 0 if never written
+    uint32_t seq;
+    // time from the clock callback, 0 without one
+    uint32_t time;
+    // line of the trace point
+    uint16_t line;
+    // number of arguments, only the first LFS2_TRACE_ARGS are kept, strings
+    // are kept as their CRC-32 and everything else is truncated to 32-bits
+    uint8_t argc;
+    // source file of the trace point, see enum lfs2_trace_file
+    uint8_t file;
+    uint32_t args[LFS2_TRACE_ARGS];
+    // block device operation counts from the stats struct, if provided
+    uint32_t reads;
+    uint32_t progs;
+    uint32_t erases;
+};
+
+struct lfs2_stats;
+
+// Start tracing into a ring buffer of count records, the oldest records are
+// overwritten once it wraps. clock and stats are optional. The buffer must
+// stay allocated while tracing, a NULL buffer stops tracing. The ring buffer
+// is shared and unlocked, so traced calls must not run concurrently.
+void lfs2_trace_setbuffer(struct lfs2_trace_record *buffer, uint32_t count,
+        uint32_t (*clock)(void), const struct lfs2_stats *stats);
+
+// Write a trace record, used by LFS2_TRACE
+void lfs2_trace(struct lfs2_trace_point *point, const char *fmt, ...);
+#endif
+
 #if !defined(LFS2_NO_DEBUG) && MBED_LFS2_ENABLE_DEBUG
 #define LFS2_DEBUG_(fmt, ...) \
     printf("%s:%d:debug: " fmt "%s\n", __FILE__, __LINE__, __VA_ARGS__)
@@ -2,6 +2,7 @@
 
 import re
 import sys
+import io
 
 PATTERN = ['LFS2_ASSERT', 'assert']
 PREFIX = 'LFS2'
@@ -347,7 +348,13 @@ def main(args):
     lexemes = LEX.copy()
     if args.pattern:
         lexemes['assert'] = args.pattern
-    p = Parse(inf, lexemes)
+    data = inf.read()
+    p = Parse(io.StringIO(data), lexemes)
+
+    # feature test macros only work before the first system header, so
+    # they need to come before our includes
+    for m in re.finditer(r'^#define\s+_\w+_SOURCE\b.*$', data, re.M):
+        outf.write(m.group() + '\n')
 
     # write extra verbose asserts
     mkdecls(outf, maxwidth=args.maxwidth)
@@ -17,12 +17,16 @@ TAG_TYPES = {
     'dirstruct':    (0x7ff, 0x200),
     'ctzstruct':    (0x7ff, 0x202),
     'inlinestruct': (0x7ff, 0x201),
+    'extstruct':    (0x7ff, 0x203),
+    'ringstruct':   (0x7ff, 0x204),
     'userattr':     (0x700, 0x300),
     'tail':         (0x700, 0x600),
     'softtail':     (0x7ff, 0x600),
     'hardtail':     (0x7ff, 0x601),
     'gstate':       (0x700, 0x700),
     'movestate':    (0x7ff, 0x7ff),
+    'wearstate':    (0x7ff, 0x701),
+    'badblocks':    (0x7ff, 0x702),
     'crc':          (0x700, 0x500),
 }
 
@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+
+import struct
+import re
+import os
+import binascii
+
+# record layout, see struct lfs2_trace_record in lfs2_util.h
+def record_struct(args):
+    return struct.Struct('%sIIHBB%dIIII' % (
+        '>' if args.big_endian else '<', args.args))
+
+LITERAL = re.compile(r'"((?:\\.|[^"\\])*)"')
+PRI = re.compile(r'PRI([diouxX])(?:8|16|32|64|PTR|MAX)')
+CONV = re.compile(r'%([-+ #0]*)(\d*)(?:\.(\d+))?(?:hh|h|ll|l|z|j|t)?'
+    r'([diouxXpsc%])')
+
+def unescape(s):
+    return re.sub(r'\\(.)', lambda m: {
+        'n': '\n', 't': '\t'}.get(m.group(1), m.group(1)), s)
+
+# source files by their id in the record, see enum lfs2_trace_file in
+# lfs2_util.h, and the macro they trace with
+FILES = [
+    ('lfs2.c',            'LFS2_TRACE'),
+    ('bd/lfs2_filebd.c',  'LFS2_FILEBD_TRACE'),
+    ('bd/lfs2_rambd.c',   'LFS2_RAMBD_TRACE'),
+    ('bd/lfs2_testbd.c',  'LFS2_TESTBD_TRACE'),
+]
+
+def tracepoints(source, macro):
+    # find every trace point in the source, mapping each line it spans to
+    # its format string
+    points = {}
+    with open(source) as f:
+        text = f.read()
+
+    for m in re.finditer(r'\b%s\(' % macro, text):
+        # the format is made of literals and PRI macros up to the first
+        # top-level comma
+        i = m.end()
+        fmt = []
+        while True:
+            while text[i].isspace():
+                i += 1
+            lit = LITERAL.match(text, i)
+            pri = PRI.match(text, i)
+            if lit:
+                fmt.append(unescape(lit.group(1)))
+                i = lit.end()
+            elif pri:
+                fmt.append(pri.group(1))
+                i = pri.end()
+            else:
+                break
+
+        # and the call ends at the matching paren
+        depth = 1
+        j = i
+        while depth > 0 and j < len(text):
+            if text[j] == '"':
+                j = LITERAL.match(text, j).end()
+                continue
+            depth += {'(': 1, ')': -1}.get(text[j], 0)
+            j += 1
+
+        start = text.count('\n', 0, m.start()) + 1
+        end = text.count('\n', 0, j) + 1
+        for line in range(start, end+1):
+            points[line] = ''.join(fmt)
+
+    return points
+
+def render(fmt, argc, args, names):
+    i = 0
+    def conv(m):
+        nonlocal i
+        flags, width, prec, c = m.groups()
+        if c == '%':
+            return '%'
+        if i >= min(argc, len(args)):
+            i += 1
+            return '?'
+        v = args[i]
+        i += 1
+        if c in 'di':
+            v = struct.unpack('<i', struct.pack('<I', v))[0]
+        elif c == 'p':
+            return '0x%08x' % v
+        elif c == 's':
+            return names.get(v, '<crc %08x>' % v)
+        elif c == 'c':
+            return chr(v & 0xff)
+        spec = '%' + flags + width + ('.'+prec if prec else '') + (
+            'd' if c in 'iu' else c)
+        return spec % v
+    return CONV.sub(conv, fmt)
+
+def main(args):
+    points = {}
+    for file, (path, macro) in enumerate(FILES):
+        path = os.path.join(args.source, path)
+        if os.path.exists(path):
+            for line, fmt in tracepoints(path, macro).items():
+                points[(file, line)] = fmt
+
+    # strings are only kept as their CRC-32, map back any we know about
+    names = {}
+    for name in args.name or []:
+        names[binascii.crc32(name.encode()) ^ 0xffffffff] = name
+    if args.names:
+        with open(args.names) as f:
+            for name in f.read().splitlines():
+                names[binascii.crc32(name.encode()) ^ 0xffffffff] = name
+
+    rs = record_struct(args)
+    records = []
+    with open(args.trace, 'rb') as f:
+        data = f.read()
+    for off in range(0, len(data) - rs.size + 1, rs.size):
+        r = rs.unpack_from(data, off)
+        seq, time, line, argc, file = r[:5]
+        if seq == 0:
+            continue
+        records.append((seq, time, (file, line), argc,
+            r[5:5+args.args], r[5+args.args:]))
+    records.sort()
+
+    print("%-8s %-10s %-8s %-8s %-8s %s" % (
+        'seq', 'time', 'reads', 'progs', 'erases', 'trace'))
+    pending = []
+    for seq, time, point, argc, rargs, counts in records:
+        fmt = points.get(point)
+        if fmt is None:
+            file, line = point
+            text = '<unknown trace point at %s:%d>' % (
+                FILES[file][0] if file < len(FILES) else 'file %d' % file,
+                line)
+        else:
+            text = render(fmt, argc, rargs, names)
+
+        # pair up exits with their entries to show what each call cost
+        m = re.match(r'(\w+) -> ', text)
+        if m:
+            for k in reversed(range(len(pending))):
+                name, ptime, pcounts = pending[k]
+                if name == m.group(1):
+                    text += ' (%+d time, %d reads, %d progs, %d erases)' % (
+                        (time - ptime) & 0xffffffff,
+                        (counts[0] - pcounts[0]) & 0xffffffff,
+                        (counts[1] - pcounts[1]) & 0xffffffff,
+                        (counts[2] - pcounts[2]) & 0xffffffff)
+                    del pending[k:]
+                    break
+        else:
+            m = re.match(r'(\w+)\(', text)
+            if m:
+                pending.append((m.group(1), time, counts))
+
+        print("%-8d %-10d %-8d %-8d %-8d %s" % (
+            seq, time, counts[0], counts[1], counts[2], text))
+
+if __name__ == "__main__":
+    import argparse
+    import sys
+    parser = argparse.ArgumentParser(
+        description="Decode a binary trace captured with "
+            "LFS2_YES_TRACE_BINARY.")
+    parser.add_argument('trace',
+        help="File containing the dumped trace buffer.")
+    parser.add_argument('-s', '--source',
+        default=os.path.join(os.path.dirname(__file__), '..'),
+        help="Source tree the trace was built from, containing lfs2.c and "
+            "bd/, defaults to the tree this script is in.")
+    parser.add_argument('-a', '--args', type=lambda x: int(x, 0), default=4,
+        help="LFS2_TRACE_ARGS the trace was built with, defaults to 4.")
+    parser.add_argument('-B', '--big-endian', action='store_true',
+        help="Trace was captured on a big-endian device.")
+    parser.add_argument('-n', '--name', action='append',
+        help="Path that may appear in the trace, strings are only stored "
+            "as their CRC-32.")
+    parser.add_argument('-N', '--names',
+        help="File of paths that may appear in the trace, one per line.")
+    sys.exit(main(parser.parse_args()))
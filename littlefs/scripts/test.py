@@ -19,6 +19,9 @@ import shlex
 import pty
 import errno
 import signal
+import threading
+import collections
+import time
 
 TESTDIR = 'tests'
 RULES = """
@@ -41,6 +44,7 @@ GLOBALS = """
 #include <stdio.h>
 extern const char *lfs2_testbd_path;
 extern uint32_t lfs2_testbd_cycles;
+extern lfs2_testbd_snapshots_t *lfs2_testbd_snapshots;
 """
 DEFINES = {
     'LFS2_READ_SIZE': 16,
@@ -50,6 +54,7 @@ DEFINES = {
     'LFS2_BLOCK_CYCLES': -1,
     'LFS2_CACHE_SIZE': '(64 % LFS2_PROG_SIZE == 0 ? 64 : LFS2_PROG_SIZE)',
     'LFS2_LOOKAHEAD_SIZE': 16,
+    'LFS2_INLINE_MAX': 0,
     'LFS2_ERASE_VALUE': 0xff,
     'LFS2_ERASE_CYCLES': 0,
     'LFS2_BADBLOCK_BEHAVIOR': 'LFS2_TESTBD_BADBLOCK_PROGERROR',
@@ -79,6 +84,7 @@ PROLOGUE = """
         .block_cycles   = LFS2_BLOCK_CYCLES,
         .cache_size     = LFS2_CACHE_SIZE,
         .lookahead_size = LFS2_LOOKAHEAD_SIZE,
+        .inline_max     = LFS2_INLINE_MAX,
     };
 
     __attribute__((unused)) const struct lfs2_testbd_config bdcfg = {
@@ -86,6 +92,7 @@ PROLOGUE = """
         .erase_cycles       = LFS2_ERASE_CYCLES,
         .badblock_behavior  = LFS2_BADBLOCK_BEHAVIOR,
         .power_cycles       = lfs2_testbd_cycles,
+        .snapshots          = lfs2_testbd_snapshots,
     };
 
     lfs2_testbd_createcfg(&cfg, lfs2_testbd_path, &bdcfg) => 0;
@@ -200,7 +207,10 @@ class TestCase:
             return True
 
     def test(self, exec=[], persist=False, cycles=None,
-            gdb=False, failure=None, disk=None, **args):
+            gdb=False, failure=None, disk=None, log=None, **args):
+        # tests may run in parallel, so output goes wherever we're told
+        log = log or sys.stdout.write
+
         # build command
         cmd = exec + ['./%s.test' % self.suite.path,
             repr(self.caseno), repr(self.permno)]
@@ -208,19 +218,22 @@ class TestCase:
         # persist disk or keep in RAM for speed?
         if persist:
             if not disk:
-                disk = self.suite.path + '.disk'
+                disk = '%s.%d.%d.disk' % (
+                    self.suite.path, self.caseno, self.permno)
             if persist != 'noerase':
                 try:
                     with open(disk, 'w') as f:
                         f.truncate(0)
                     if args.get('verbose', False):
-                        print('truncate --size=0', disk)
+                        log('truncate --size=0 %s\n' % disk)
                 except FileNotFoundError:
                     pass
 
             cmd.append(disk)
+        elif cycles:
+            cmd.append('-')
 
-        # simulate power-loss after n cycles?
+        # simulate power-loss after n cycles, or after every cycle?
         if cycles:
             cmd.append(str(cycles))
 
@@ -245,7 +258,7 @@ class TestCase:
         # run test case!
         mpty, spty = pty.openpty()
         if args.get('verbose', False):
-            print(' '.join(shlex.quote(c) for c in cmd))
+            log(' '.join(shlex.quote(c) for c in cmd) + '\n')
         proc = sp.Popen(cmd, stdout=spty, stderr=spty)
         os.close(spty)
         mpty = os.fdopen(mpty, 'r', 1)
@@ -261,7 +274,7 @@ class TestCase:
                     raise
                 stdout.append(line)
                 if args.get('verbose', False):
-                    sys.stdout.write(line)
+                    log(line)
                 # intercept asserts
                 m = re.match(
                     '^{0}([^:]+):(\d+):(?:\d+:)?{0}{1}:{0}(.*)$'
@@ -321,6 +334,15 @@ class ReentrantTestCase(TestCase):
         return self.reentrant and super().shouldtest(**args)
 
     def test(self, persist=False, gdb=False, failure=None, **args):
+        # simulate power-loss in-process? the test binary records a snapshot
+        # before every prog/erase and replays the test from each one, this
+        # is faster but only loses power once per run, replays run to
+        # completion
+        if (args.get('snapshot', False)
+                and not persist and not args.get('disk', None)):
+            return super().test(cycles='all', gdb=gdb, failure=failure,
+                **args)
+
         for cycles in it.count(1):
             # clear disk first?
             if cycles == 1 and persist != 'noerase':
@@ -491,24 +513,39 @@ class TestSuite:
         tf.write('\n')
         tf.write('const char *lfs2_testbd_path;\n')
         tf.write('uint32_t lfs2_testbd_cycles;\n')
+        tf.write('lfs2_testbd_snapshots_t *lfs2_testbd_snapshots;\n')
         tf.write('int main(int argc, char **argv) {\n')
         tf.write(4*' '+'int case_         = (argc > 1) ? atoi(argv[1]) : 0;\n')
         tf.write(4*' '+'int perm          = (argc > 2) ? atoi(argv[2]) : 0;\n')
-        tf.write(4*' '+'lfs2_testbd_path   = (argc > 3) ? argv[3] : NULL;\n')
+        tf.write(4*' '+'lfs2_testbd_path   = (argc > 3 && '
+            'strcmp(argv[3], "-") != 0) ? argv[3] : NULL;\n')
         tf.write(4*' '+'lfs2_testbd_cycles = (argc > 4) ? atoi(argv[4]) : 0;\n')
+        # power-loss after every cycle, in-process?
+        tf.write(4*' '+'static lfs2_testbd_snapshots_t snapshots;\n')
+        tf.write(4*' '+'if (argc > 4 && strcmp(argv[4], "all") == 0) {\n')
+        tf.write(8*' '+'lfs2_testbd_snapshots = &snapshots;\n')
+        tf.write(4*' '+'}\n')
         for perm in self.perms:
             # test declaration
             tf.write(4*' '+'extern void test_case%d(%s);\n' % (
                 perm.caseno, ', '.join(
                     'intmax_t %s' % k for k in sorted(perm.defines)
                     if k not in perm.case.defines)))
-            # test call
+            # test call, replaying from each snapshot if we're recording
+            call = 'test_case%d(%s);' % (perm.caseno, ', '.join(
+                str(v) for k, v in sorted(perm.defines.items())
+                if k not in perm.case.defines))
             tf.write(4*' '+
-                'if (argc < 3 || (case_ == %d && perm == %d)) {'
-                ' test_case%d(%s); '
-                '}\n' % (perm.caseno, perm.permno, perm.caseno, ', '.join(
-                    str(v) for k, v in sorted(perm.defines.items())
-                    if k not in perm.case.defines)))
+                'if (argc < 3 || (case_ == %d && perm == %d)) {\n' % (
+                    perm.caseno, perm.permno))
+            tf.write(8*' '+call+'\n')
+            tf.write(8*' '+'if (lfs2_testbd_snapshots) {\n')
+            tf.write(12*' '+'while (lfs2_testbd_rewind(&snapshots)) {\n')
+            tf.write(16*' '+call+'\n')
+            tf.write(12*' '+'}\n')
+            tf.write(12*' '+'lfs2_testbd_freesnapshots(&snapshots);\n')
+            tf.write(8*' '+'}\n')
+            tf.write(4*' '+'}\n')
         tf.write('}\n')
 
         for tf in tfs.values():
@@ -525,15 +562,16 @@ class TestSuite:
                     self.path+'.test', k, v))
 
             for path in tfs:
+                # the harness comes from this script, so rebuild if it changes
                 if path is None:
-                    mk.write('%s: %s | %s\n' % (
+                    mk.write('%s: %s %s | %s\n' % (
                         self.path+'.test.c',
-                        self.path,
+                        self.path, sys.argv[0],
                         self.path+'.test.c.t'))
                 else:
-                    mk.write('%s: %s %s | %s\n' % (
+                    mk.write('%s: %s %s %s | %s\n' % (
                         self.path+'.'+path.replace('/', '.'),
-                        self.path, path,
+                        self.path, path, sys.argv[0],
                         self.path+'.'+path.replace('/', '.')+'.t'))
                 mk.write('\t./scripts/explode_asserts.py $| -o $@\n')
 
@@ -541,34 +579,101 @@ class TestSuite:
         self.target = self.path + '.test'
         return self.makefile, self.target
 
-    def test(self, **args):
-        # run test suite!
-        if not args.get('verbose', True):
-            sys.stdout.write(self.name + ' ')
-            sys.stdout.flush()
-        for perm in self.perms:
-            if not perm.shouldtest(**args):
-                continue
-
+def test(suites, jobs=None, **args):
+    perms = [perm
+        for suite in suites
+        for perm in suite.perms
+        if perm.shouldtest(**args)]
+    runnable = set(id(perm) for perm in perms)
+    for perm in perms:
+        perm.started = False
+
+    # each worker starts with a contiguous slice of permutations, keeping
+    # runs of the same suite together, and steals from the back of the
+    # busiest worker when it runs dry
+    queues = [collections.deque(perms[i*len(perms)//jobs:
+            (i+1)*len(perms)//jobs])
+        for i in range(jobs)]
+    cond = threading.Condition()
+    stop = False
+
+    def worker(queue):
+        nonlocal stop
+        while True:
+            with cond:
+                if stop:
+                    return
+                if queue:
+                    perm = queue.popleft()
+                else:
+                    victim = max(queues, key=len)
+                    if not victim:
+                        return
+                    perm = victim.pop()
+                perm.started = True
+
+            output = []
+            start = time.time()
             try:
-                result = perm.test(**args)
+                perm.test(log=output.append, **args)
             except TestFailure as failure:
-                perm.result = failure
-                if not args.get('verbose', True):
-                    sys.stdout.write(FAIL)
-                    sys.stdout.flush()
-                if not args.get('keep_going', False):
-                    if not args.get('verbose', True):
-                        sys.stdout.write('\n')
-                    raise
+                result = failure
             else:
-                perm.result = PASS
-                if not args.get('verbose', True):
-                    sys.stdout.write(PASS)
+                result = PASS
+
+            with cond:
+                perm.time = time.time() - start
+                perm.output = output
+                perm.result = result
+                if result != PASS and not args.get('keep_going', False):
+                    stop = True
+                cond.notify_all()
+
+    workers = [threading.Thread(target=worker, args=(queue,), daemon=True)
+        for queue in queues]
+    for w in workers:
+        w.start()
+
+    # report results in order, so output doesn't depend on scheduling
+    verbose = args.get('verbose', False)
+    try:
+        for suite in suites:
+            if not verbose:
+                sys.stdout.write(suite.name + ' ')
+                sys.stdout.flush()
+            for perm in suite.perms:
+                if id(perm) not in runnable:
+                    continue
+
+                with cond:
+                    while (not hasattr(perm, 'result') and
+                            not (stop and not perm.started)):
+                        cond.wait()
+                if not hasattr(perm, 'result'):
+                    break
+
+                for line in perm.output:
+                    sys.stdout.write(line)
+                if not verbose:
+                    sys.stdout.write(PASS if perm.result == PASS else FAIL)
                     sys.stdout.flush()
+                if (perm.result != PASS and
+                        not args.get('keep_going', False)):
+                    break
+            else:
+                if not verbose:
+                    sys.stdout.write('\n')
+                continue
+
+            if not verbose:
+                sys.stdout.write('\n')
+            break
+    except KeyboardInterrupt:
+        with cond:
+            stop = True
 
-        if not args.get('verbose', True):
-            sys.stdout.write('\n')
+    for w in workers:
+        w.join()
 
 def main(**args):
     # figure out explicit defines
@@ -615,6 +720,12 @@ def main(**args):
     for suite in suites:
         suite.permute(**args)
 
+    # run across all cores unless told otherwise, an explicitly provided
+    # disk can't be shared however
+    jobs = args.pop('jobs', None) or os.cpu_count() or 1
+    if args.get('disk', None):
+        jobs = 1
+
     # build tests in parallel
     print('====== building ======')
     makefiles = []
@@ -624,7 +735,7 @@ def main(**args):
         makefiles.append(makefile)
         targets.append(target)
 
-    cmd = (['make', '-f', 'Makefile'] +
+    cmd = (['make', '-j%d' % jobs, '-f', 'Makefile'] +
         list(it.chain.from_iterable(['-f', m] for m in makefiles)) +
         [target for target in targets])
     mpty, spty = pty.openpty()
@@ -686,11 +797,20 @@ def main(**args):
         return 0
 
     print('====== testing ======')
-    try:
-        for suite in suites:
-            suite.test(**args)
-    except TestFailure:
-        pass
+    start = time.time()
+    test(suites, jobs=min(jobs, max(filtered, 1)), **args)
+    elapsed = time.time() - start
+
+    slowest = sorted(
+        (perm for suite in suites for perm in suite.perms
+            if hasattr(perm, 'time')),
+        key=lambda perm: perm.time, reverse=True)[:args.get('slowest', 0)]
+    if slowest:
+        print('====== slowest ======')
+        for perm in slowest:
+            print('%7.2fs %s' % (perm.time, perm))
+        print('ran in %.2fs across %d jobs' % (
+            elapsed, min(jobs, max(filtered, 1))))
 
     print('====== results ======')
     passed = 0
@@ -769,10 +889,21 @@ if __name__ == "__main__":
         help="Run tests normally.")
     parser.add_argument('-r', '--reentrant', action='store_true',
         help="Run reentrant tests with simulated power-loss.")
+    parser.add_argument('-s', '--snapshot', action='store_true',
+        help="Simulate power-loss for reentrant tests in-process, replaying \
+            the test from a snapshot taken before every prog/erase. This is \
+            faster, but only loses power once per run. Ignored if -p or -d \
+            is provided.")
     parser.add_argument('-V', '--valgrind', action='store_true',
         help="Run non-leaky tests under valgrind to check for memory leaks.")
     parser.add_argument('-e', '--exec', default=[], type=lambda e: e.split(' '),
         help="Run tests with another executable prefixed on the command line.")
     parser.add_argument('-d', '--disk',
-        help="Specify a file to use for persistent/reentrant tests.")
+        help="Specify a file to use for persistent/reentrant tests. This \
+            forces tests to run one at a time.")
+    parser.add_argument('-j', '--jobs', type=int,
+        help="Number of tests to run in parallel. Defaults to the number of \
+            cores.")
+    parser.add_argument('--slowest', type=int, default=5,
+        help="Number of slowest permutations to report. Defaults to 5.")
     sys.exit(main(**vars(parser.parse_args())))